@@ -0,0 +1,44 @@
+#!/bin/sh
+# 编译bench/microbench.cpp
+#
+# 先在nginx源码目录中用本模块configure并make过, 然后:
+#   NGX_SRC=/path/to/nginx-1.2.5 sh bench/build_microbench.sh
+#
+# 链接nginx编译出的所有.o(去掉nginx.c里的main和模块自己的.o, 模块源文件已被
+# microbench.cpp直接包含), 再加上mock的TfsClient与pytfs.cpp.
+
+set -e
+
+ngx=${NGX_SRC:?set NGX_SRC to a configured and built nginx source tree}
+tfs=${TFS_HOME:-/opt/tfs-release-2.2.8}
+tbsys=${TBLIB_ROOT:-/opt/tb-common-utils}
+python=${PYTHON:-python2}
+libs=${NGX_LIBS:-"-lpthread -lcrypt -lpcre -lcrypto -ldl"}
+
+dir=$(cd "$(dirname "$0")" && pwd)
+out=${OUT:-$dir/microbench}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+objcopy --redefine-sym main=ngx_main "$ngx/objs/src/core/nginx.o" "$tmp/nginx.o"
+
+objs=$(find "$ngx/objs/src" "$ngx/objs/addon" -name '*.o' \
+       ! -path '*/src/core/nginx.o' \
+       ! -name ngx_http_tfs_module.o \
+       ! -name ngx_http_tfs_mock.o)
+
+pyinc=$($python -c 'from distutils import sysconfig; print(sysconfig.get_python_inc())')
+pyver=$($python -c 'import sys; print("%d.%d" % sys.version_info[:2])')
+
+g++ -O2 -g -Wno-write-strings \
+    -I"$ngx/src/core" -I"$ngx/src/event" -I"$ngx/src/event/modules" \
+    -I"$ngx/src/os/unix" -I"$ngx/src/http" -I"$ngx/src/http/modules" -I"$ngx/objs" \
+    -I"$tfs/include" -I"$tbsys/include/tbnet" -I"$tbsys/include/tbsys" -I"$pyinc" \
+    -o "$out" \
+    "$dir/microbench.cpp" "$dir/ngx_http_tfs_mock.cpp" "$dir/../pytfs/pytfs.cpp" \
+    $objs "$ngx/objs/ngx_modules.o" "$tmp/nginx.o" \
+    -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign \
+    -L"$tfs/lib" -L"$tbsys/lib" -ltfsclient -ltbnet -ltbsys -luuid -lz \
+    -lpython"$pyver" $libs
+
+echo "built $out"
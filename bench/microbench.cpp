@@ -0,0 +1,378 @@
+/*
+ * 模块与pytfs中CPU密集部分的微基准, 用bench/build_microbench.sh编译
+ *
+ * 每项输出 ns/op, bytes/cycle(按rdtsc计, 非x86为0)与每次操作的堆分配次数.
+ * tfs读写走bench/ngx_http_tfs_mock.cpp, 只剩内存拷贝, 不涉及网络.
+ *
+ *   microbench [filter] [--json]
+ * */
+
+/* 直接包含模块源文件, 以便调用其中的static函数; 编译时不再链接模块自己的.o */
+#include "../ngx_http_tfs_module.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+
+/* pytfs.cpp中的函数. 不包含Python.h, 避免其宏定义与nginx头文件冲突 */
+int _read_into(TfsClient* tfsclient, int fd, char* buffer, int64_t size, uint32_t file_crc);
+ssize_t _write_buffer(TfsClient* tfsclient, int fd, const char* buff, ssize_t len);
+
+extern "C" {
+void Py_Initialize(void);
+void *PyString_FromStringAndSize(const char *v, ssize_t len);
+char *PyString_AsString(void *o);
+void Py_DecRef(void *o);
+
+/* 用-Wl,--wrap统计nginx与本程序中的malloc次数 */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+int __real_posix_memalign(void **p, size_t align, size_t size);
+}
+
+#if __cplusplus >= 201103L
+#define MICROBENCH_THROW
+#define MICROBENCH_NOTHROW noexcept
+#else
+#define MICROBENCH_THROW throw (std::bad_alloc)
+#define MICROBENCH_NOTHROW throw ()
+#endif
+
+static uint64_t microbench_allocs;
+
+extern "C" void *
+__wrap_malloc(size_t size)
+{
+    microbench_allocs++;
+    return __real_malloc(size);
+}
+
+extern "C" void *
+__wrap_calloc(size_t n, size_t size)
+{
+    microbench_allocs++;
+    return __real_calloc(n, size);
+}
+
+extern "C" void *
+__wrap_realloc(void *p, size_t size)
+{
+    microbench_allocs++;
+    return __real_realloc(p, size);
+}
+
+extern "C" int
+__wrap_posix_memalign(void **p, size_t align, size_t size)
+{
+    microbench_allocs++;
+    return __real_posix_memalign(p, align, size);
+}
+
+void *
+operator new(size_t size) MICROBENCH_THROW
+{
+    void *p = __wrap_malloc(size);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *
+operator new[](size_t size) MICROBENCH_THROW
+{
+    return operator new(size);
+}
+
+void
+operator delete(void *p) MICROBENCH_NOTHROW
+{
+    free(p);
+}
+
+void
+operator delete[](void *p) MICROBENCH_NOTHROW
+{
+    free(p);
+}
+
+
+typedef struct {
+    const char *name;
+    size_t bytes;                   /* 每次操作处理的字节数, 用于bytes/cycle */
+    void (*run)(size_t bytes);
+} microbench_t;
+
+static char *microbench_src;        /* 测试数据 */
+static ngx_log_t microbench_log;
+static ngx_open_file_t microbench_log_file;
+static ngx_connection_t microbench_conn;
+static ngx_http_tfs_cluster_t microbench_cluster;
+static ngx_http_tfs_ns_loc_conf_t microbench_conf;
+
+#define MICROBENCH_MAX_SIZE (2 * 1024 * 1024)
+
+
+static uint64_t
+microbench_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+microbench_cycles()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* mock按文件名中的大小生成内容 */
+static void
+microbench_name(size_t size, u_char *name)
+{
+    ngx_sprintf(name, "TM%010uz000000%Z", size);
+}
+
+static void
+bench_parse_tfsname(size_t bytes)
+{
+    static u_char args[] = "tfsname=T1lHETBXVT1RCvBVdK&width=100";
+    ngx_http_request_t r;
+    u_char tfsname[TFS_FILE_LEN + 1];
+
+    ngx_memzero(&r, sizeof(r));
+    r.connection = &microbench_conn;
+    r.args.data = args;
+    r.args.len = sizeof(args) - 1;
+
+    if (ngx_http_tfs_get_args_tfsname(&r, tfsname) != NGX_OK) {
+        abort();
+    }
+}
+
+static void
+bench_crc(size_t bytes)
+{
+    volatile uint32_t crc = Func::crc(0, microbench_src, bytes);
+    (void) crc;
+}
+
+static void
+bench_memcpy(size_t bytes)
+{
+    static char dst[MICROBENCH_MAX_SIZE];
+    memcpy(dst, microbench_src, bytes);
+    __asm__ __volatile__("" : : "r" (dst) : "memory");
+}
+
+/* GET的读取路径: 分配响应buffer, 分块读入并算crc, 与请求pool一起释放 */
+static void
+bench_read_remote(size_t bytes)
+{
+    ngx_http_request_t r;
+    ngx_buf_t *b;
+    ngx_http_tfs_cache_stat_t st;
+    u_char name[TFS_FILE_LEN + 1];
+
+    ngx_memzero(&r, sizeof(r));
+    r.connection = &microbench_conn;
+    r.pool = ngx_create_pool(4096, &microbench_log);
+    if (r.pool == NULL) {
+        abort();
+    }
+
+    microbench_name(bytes, name);
+    if (ngx_http_tfs_read_remote(&r, &microbench_conf, name, &b, &st, NULL) != NGX_OK) {
+        abort();
+    }
+
+    ngx_destroy_pool(r.pool);
+}
+
+/* 同上, 但读buffer从tfs_buffer_arena复用; 放在read_remote各项之后, 开启后不再关闭 */
+static void
+bench_read_remote_arena(size_t bytes)
+{
+    static ngx_uint_t enabled;
+    ngx_http_tfs_main_conf_t tmcf;
+
+    if (!enabled) {
+        ngx_memzero(&tmcf, sizeof(tmcf));
+        tmcf.buffer_arena = 64 * 1024 * 1024;
+        ngx_http_tfs_buffer_init_process(NULL, &tmcf);
+        enabled = 1;
+    }
+
+    bench_read_remote(bytes);
+}
+
+/* pytfs get: 按fstat的大小分配python字符串, 直接读入 */
+static void
+bench_pytfs_read(size_t bytes)
+{
+    int fd;
+    void *s;
+    TfsFileStat fstat;
+    u_char name[TFS_FILE_LEN + 1];
+    TfsClient *tfsclient = TfsClient::Instance();
+
+    microbench_name(bytes, name);
+    fd = tfsclient->open((const char *) name, NULL, T_READ);
+    tfsclient->fstat(fd, &fstat);
+
+    s = PyString_FromStringAndSize(NULL, fstat.size_);
+    if (_read_into(tfsclient, fd, PyString_AsString(s), fstat.size_, fstat.crc_) != 0) {
+        abort();
+    }
+    tfsclient->close(fd);
+
+    Py_DecRef(s);
+}
+
+static void
+bench_pytfs_write(size_t bytes)
+{
+    int fd;
+    char name[TFS_FILE_LEN];
+    TfsClient *tfsclient = TfsClient::Instance();
+
+    fd = tfsclient->open((char *) NULL, NULL, T_WRITE);
+    _write_buffer(tfsclient, fd, microbench_src, bytes);
+    tfsclient->close(fd, name, TFS_FILE_LEN);
+}
+
+static microbench_t microbenchs[] = {
+    { "parse_tfsname", 0, bench_parse_tfsname },
+
+    { "crc/64", 64, bench_crc },
+    { "crc/4k", 4096, bench_crc },
+    { "crc/64k", 65536, bench_crc },
+    { "crc/1m", 1048576, bench_crc },
+
+    { "memcpy/4k", 4096, bench_memcpy },
+    { "memcpy/64k", 65536, bench_memcpy },
+    { "memcpy/1m", 1048576, bench_memcpy },
+
+    { "read_remote/4k", 4096, bench_read_remote },
+    { "read_remote/64k", 65536, bench_read_remote },
+    { "read_remote/1m", 1048576, bench_read_remote },
+
+    { "read_remote_arena/4k", 4096, bench_read_remote_arena },
+    { "read_remote_arena/64k", 65536, bench_read_remote_arena },
+    { "read_remote_arena/1m", 1048576, bench_read_remote_arena },
+
+    { "pytfs_read/4k", 4096, bench_pytfs_read },
+    { "pytfs_read/64k", 65536, bench_pytfs_read },
+    { "pytfs_read/1m", 1048576, bench_pytfs_read },
+
+    { "pytfs_write/4k", 4096, bench_pytfs_write },
+    { "pytfs_write/64k", 65536, bench_pytfs_write },
+    { "pytfs_write/1m", 1048576, bench_pytfs_write },
+
+    { NULL, 0, NULL }
+};
+
+static void
+microbench_init()
+{
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    ngx_time_init();
+
+    microbench_log_file.fd = ngx_stderr;
+    microbench_log.file = &microbench_log_file;
+    microbench_log.log_level = NGX_LOG_ERR;
+    microbench_conn.log = &microbench_log;
+
+    ngx_str_set(&microbench_cluster.nsip, "127.0.0.1:10000");
+    microbench_cluster.timeout = DEFAULT_TFS_TIMEOUT;
+    microbench_cluster.ready = 1;
+    microbench_conf.cluster = &microbench_cluster;
+    microbench_conf.tfs_rb_buffer_size = DEFAULT_TFS_READ_WRITE_SIZE;
+
+    microbench_src = (char *) malloc(MICROBENCH_MAX_SIZE);
+    for (size_t i = 0; i < MICROBENCH_MAX_SIZE; i++) {
+        microbench_src[i] = (char) random();
+    }
+
+    Py_Initialize();
+}
+
+int
+main(int argc, char **argv)
+{
+    int json = 0;
+    const char *filter = NULL;
+    microbench_t *m;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    microbench_init();
+
+    if (!json) {
+        printf("%-20s %12s %12s %12s\n", "name", "ns/op", "bytes/cycle", "allocs/op");
+    }
+
+    for (m = microbenchs; m->name; m++) {
+        if (filter && strstr(m->name, filter) == NULL) {
+            continue;
+        }
+
+        // 预热并估算次数, 使每项运行约0.5秒
+        uint64_t n = 1, elapsed;
+        for ( ;; ) {
+            uint64_t start = microbench_ns();
+            for (uint64_t i = 0; i < n; i++) {
+                m->run(m->bytes);
+            }
+            elapsed = microbench_ns() - start;
+            if (elapsed > 50000000 || n >= (1ULL << 30)) {
+                break;
+            }
+            n *= 2;
+        }
+        n = n * 500000000 / (elapsed ? elapsed : 1) + 1;
+
+        uint64_t allocs = microbench_allocs;
+        uint64_t cycles = microbench_cycles();
+        uint64_t start = microbench_ns();
+        for (uint64_t i = 0; i < n; i++) {
+            m->run(m->bytes);
+        }
+        elapsed = microbench_ns() - start;
+        cycles = microbench_cycles() - cycles;
+        allocs = microbench_allocs - allocs;
+
+        double ns_op = (double) elapsed / n;
+        double bpc = cycles ? (double) m->bytes * n / cycles : 0;
+        double allocs_op = (double) allocs / n;
+
+        if (json) {
+            printf("{\"name\": \"%s\", \"ns_per_op\": %.1f, \"bytes_per_cycle\": %.3f, "
+                   "\"allocs_per_op\": %.2f, \"iterations\": %llu}\n",
+                   m->name, ns_op, bpc, allocs_op, (unsigned long long) n);
+        } else {
+            printf("%-20s %12.1f %12.3f %12.2f\n", m->name, ns_op, bpc, allocs_op);
+        }
+    }
+
+    return 0;
+}
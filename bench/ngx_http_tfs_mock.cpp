@@ -0,0 +1,358 @@
+/*
+ * 压测用的tfs客户端替身, 不需要真实的nameserver/dataserver
+ *
+ * configure时设置NGX_TFS_MOCK=YES才会编进nginx. 这里定义的TfsClient成员函数
+ * 优先于libtfsclient.so中的同名函数, 其余(FSName, Func::crc等)仍用真实库.
+ *
+ * 文件内容不保存, 由文件名决定: 上传时返回 "TM" + 10位大小 + 6位序号 的名字,
+ * 读取时按名字中的大小生成固定内容, 多个worker之间不需要共享状态.
+ *
+ * pytfs也可以链接这个文件(PYTFS_MOCK=YES python setup.py build, 见bench/pytfs_bench.py),
+ * pytfs在多个线程中调用TfsClient, 所以内部状态用一个mutex保护, 延迟在锁外模拟.
+ *
+ * 通过环境变量(nginx.conf中需要用env指令保留)注入延迟和错误:
+ *   TFS_MOCK_NS_LATENCY_US   open/stat/unlink时模拟访问nameserver的延迟
+ *   TFS_MOCK_DS_LATENCY_US   每次read/write以及提交写入时模拟访问dataserver的延迟
+ *   TFS_MOCK_ERROR_RATE      open失败的比例, 0到1
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "tfs_client_api.h"
+#include "func.h"
+
+
+using namespace tfs::client;
+using namespace tfs::common;
+
+namespace {
+
+struct MockFile {
+    int flags;
+    int64_t size;
+    int64_t offset;
+};
+
+std::map<int, MockFile> g_files;
+std::map<int64_t, uint32_t> g_crcs;         /* 各大小对应内容的crc */
+int g_next_fd = 1;
+int g_next_seq = 0;
+pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct MockLock {
+    MockLock() { pthread_mutex_lock(&g_mutex); }
+    ~MockLock() { pthread_mutex_unlock(&g_mutex); }
+};
+
+bool g_env_loaded = false;
+useconds_t g_ns_latency = 0;
+useconds_t g_ds_latency = 0;
+double g_error_rate = 0;
+
+void load_env()
+{
+    const char *v;
+    MockLock lock;
+
+    if (g_env_loaded) {
+        return;
+    }
+    g_env_loaded = true;
+
+    if ((v = getenv("TFS_MOCK_NS_LATENCY_US")) != NULL) {
+        g_ns_latency = atoi(v);
+    }
+    if ((v = getenv("TFS_MOCK_DS_LATENCY_US")) != NULL) {
+        g_ds_latency = atoi(v);
+    }
+    if ((v = getenv("TFS_MOCK_ERROR_RATE")) != NULL) {
+        g_error_rate = atof(v);
+    }
+    srandom(getpid());
+}
+
+void delay(useconds_t usec)
+{
+    if (usec > 0) {
+        usleep(usec);
+    }
+}
+
+bool inject_error()
+{
+    return g_error_rate > 0 && random() < g_error_rate * RAND_MAX;
+}
+
+/*
+ * 第i个字节为(i * 131 + 7) & 0xff, 以256为周期.
+ * 预先生成一段, 读取时按块拷贝, 开销与真实客户端从网络缓冲区拷贝相当
+ * */
+#define MOCK_PATTERN_PERIOD 256
+#define MOCK_PATTERN_SIZE (64 * 1024)
+
+char g_pattern[MOCK_PATTERN_SIZE + MOCK_PATTERN_PERIOD];
+pthread_once_t g_pattern_once = PTHREAD_ONCE_INIT;
+
+void init_pattern()
+{
+    for (int64_t i = 0; i < (int64_t) sizeof(g_pattern); i++) {
+        g_pattern[i] = (char) ((i * 131 + 7) & 0xff);
+    }
+}
+
+void fill(char *buf, int64_t offset, int64_t count)
+{
+    pthread_once(&g_pattern_once, init_pattern);
+
+    while (count > 0) {
+        int64_t n = count < MOCK_PATTERN_SIZE ? count : MOCK_PATTERN_SIZE;
+        memcpy(buf, g_pattern + offset % MOCK_PATTERN_PERIOD, n);
+        buf += n;
+        offset += n;
+        count -= n;
+    }
+}
+
+uint32_t content_crc(int64_t size)
+{
+    {
+        MockLock lock;
+        std::map<int64_t, uint32_t>::iterator it = g_crcs.find(size);
+        if (it != g_crcs.end()) {
+            return it->second;
+        }
+    }
+
+    uint32_t crc = 0;
+    char buf[4096];
+    for (int64_t off = 0; off < size; off += sizeof(buf)) {
+        int64_t n = size - off < (int64_t) sizeof(buf) ? size - off : (int64_t) sizeof(buf);
+        fill(buf, off, n);
+        crc = Func::crc(crc, buf, n);
+    }
+
+    MockLock lock;
+    g_crcs[size] = crc;
+    return crc;
+}
+
+/* 名字格式不对时返回-1 */
+int64_t name_to_size(const char *name)
+{
+    char digits[11];
+
+    if (name == NULL || strlen(name) != FILE_NAME_LEN || name[0] != 'T' || name[1] != 'M') {
+        return -1;
+    }
+
+    memcpy(digits, name + 2, 10);
+    digits[10] = '\0';
+    for (int i = 0; i < 10; i++) {
+        if (digits[i] < '0' || digits[i] > '9') {
+            return -1;
+        }
+    }
+
+    return atoll(digits);
+}
+
+/* 调用者持有g_mutex */
+MockFile *get_file(int fd)
+{
+    std::map<int, MockFile>::iterator it = g_files.find(fd);
+    return it == g_files.end() ? NULL : &it->second;
+}
+
+int open_file(const char *file_name, const int flags)
+{
+    MockFile f;
+
+    load_env();
+    delay(g_ns_latency);
+
+    if (inject_error()) {
+        return TFS_ERROR;
+    }
+
+    f.flags = flags;
+    f.offset = 0;
+    f.size = 0;
+
+    if (flags & T_READ) {
+        f.size = name_to_size(file_name);
+        if (f.size < 0) {
+            return TFS_ERROR;
+        }
+    }
+
+    MockLock lock;
+    g_files[g_next_fd] = f;
+    return g_next_fd++;
+}
+
+}
+
+int TfsClient::initialize(const char* ns_addr, const int32_t cache_time, const int32_t cache_items,
+    const bool start_bg)
+{
+    load_env();
+    return TFS_SUCCESS;
+}
+
+int TfsClient::set_default_server(const char* ns_addr, const int32_t cache_time, const int32_t cache_items)
+{
+    return TFS_SUCCESS;
+}
+
+int TfsClient::destroy()
+{
+    MockLock lock;
+    g_files.clear();
+    return TFS_SUCCESS;
+}
+
+void TfsClient::set_wait_timeout(const int64_t timeout_ms)
+{
+}
+
+int TfsClient::open(const char* file_name, const char* suffix, const int flags, const char* key)
+{
+    return open_file(file_name, flags);
+}
+
+int TfsClient::open(const char* file_name, const char* suffix, const char* ns_addr, const int flags,
+    const char* key)
+{
+    return open_file(file_name, flags);
+}
+
+int64_t TfsClient::read(const int fd, void* buf, const int64_t count)
+{
+    int64_t offset, n;
+
+    {
+        MockLock lock;
+        MockFile *f = get_file(fd);
+        if (f == NULL || !(f->flags & T_READ)) {
+            return TFS_ERROR;
+        }
+
+        offset = f->offset;
+        n = f->size - f->offset < count ? f->size - f->offset : count;
+        f->offset += n;
+    }
+
+    delay(g_ds_latency);
+    fill((char *) buf, offset, n);
+
+    return n;
+}
+
+int64_t TfsClient::write(const int fd, const void* buf, const int64_t count)
+{
+    delay(g_ds_latency);
+    // 真实客户端写入时对数据算crc, 这里同样读一遍数据
+    Func::crc(0, (const char *) buf, (int32_t) count);
+
+    MockLock lock;
+    MockFile *f = get_file(fd);
+    if (f == NULL || !(f->flags & T_WRITE)) {
+        return TFS_ERROR;
+    }
+
+    f->size += count;
+    return count;
+}
+
+int TfsClient::fstat(const int fd, TfsFileStat* buf, const TfsStatType mode)
+{
+    int64_t size;
+
+    {
+        MockLock lock;
+        MockFile *f = get_file(fd);
+        if (f == NULL) {
+            return TFS_ERROR;
+        }
+        size = f->size;
+    }
+
+    memset(buf, 0, sizeof(TfsFileStat));
+    buf->size_ = size;
+    buf->usize_ = size;
+    buf->modify_time_ = buf->create_time_ = (int32_t) time(NULL);
+    buf->crc_ = content_crc(size);
+
+    return TFS_SUCCESS;
+}
+
+int TfsClient::close(const int fd, char* ret_tfs_name, const int32_t ret_tfs_name_len, const bool simple)
+{
+    MockFile f;
+    int seq;
+
+    {
+        MockLock lock;
+        MockFile *p = get_file(fd);
+        if (p == NULL) {
+            return TFS_ERROR;
+        }
+        f = *p;
+        seq = g_next_seq++;
+        g_files.erase(fd);
+    }
+
+    if (f.flags & T_WRITE) {
+        // 提交写入
+        delay(g_ds_latency);
+
+        if (ret_tfs_name != NULL && ret_tfs_name_len >= TFS_FILE_LEN) {
+            snprintf(ret_tfs_name, ret_tfs_name_len, "TM%010lld%06d",
+                     (long long) f.size, seq % 1000000);
+        }
+    }
+
+    return TFS_SUCCESS;
+}
+
+int TfsClient::unlink(int64_t& file_size, const char* file_name, const char* suffix,
+    const char* ns_addr, const TfsUnlinkType action)
+{
+    load_env();
+    delay(g_ns_latency + g_ds_latency);
+
+    file_size = name_to_size(file_name);
+    if (file_size < 0) {
+        // 与真实的nameserver一样, 文件不存在不是TFS_ERROR
+        file_size = 0;
+        return EXIT_META_NOT_FOUND_ERROR;
+    }
+
+    return TFS_SUCCESS;
+}
+
+int TfsClient::stat_file(TfsFileStat* file_stat, const char* file_name, const char* suffix,
+    const TfsStatType stat_type, const char* ns_addr)
+{
+    int64_t size;
+
+    load_env();
+    delay(g_ns_latency + g_ds_latency);
+
+    size = name_to_size(file_name);
+    if (size < 0) {
+        return TFS_ERROR;
+    }
+
+    memset(file_stat, 0, sizeof(TfsFileStat));
+    file_stat->size_ = size;
+    file_stat->usize_ = size;
+    file_stat->crc_ = content_crc(size);
+
+    return TFS_SUCCESS;
+}
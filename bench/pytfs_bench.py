@@ -0,0 +1,192 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+pytfs压测
+
+按 操作 x 文件大小 x chunk大小(pytfs.set_chunk_size) x 线程数 逐一压测,
+每个组合输出一行json: 吞吐(ops, mb_s), p50/p99/p999延迟(毫秒), 错误数,
+allocs_per_op(pytfs新分配读buffer的次数, 见pytfs.buffer_stats), 进程的RSS.
+
+不需要真实集群时, 用链接了bench/ngx_http_tfs_mock.cpp的pytfs:
+
+  cd pytfs && PYTFS_MOCK=YES python setup.py build_ext --inplace
+
+操作:
+  put, get, readinto    每个线程循环调用
+  put_many, get_many    一个线程每次提交--batch个, 线程数作为concurrency参数
+
+例:
+  python pytfs_bench.py --ns 127.0.0.1:8108 --sizes 1k,64k,1m,64m,1g \\
+      --chunks 256k,1m,4m --threads 1,8,32 --duration 5 --out result.json
+
+结束时在标准错误输出每个(操作, 大小)吞吐最高的chunk, 可用于设置
+pytfs.set_chunk_size或环境变量PYTFS_CHUNK_SIZE.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+
+
+def parse_size(s):
+    """'64k' -> 65536"""
+    s = s.strip().lower()
+    units = {'k': 1024, 'm': 1024 * 1024, 'g': 1024 * 1024 * 1024}
+    if s and s[-1] in units:
+        return int(float(s[:-1]) * units[s[-1]])
+    return int(s)
+
+
+def parse_list(s, conv=int):
+    return [conv(x) for x in s.split(',') if x.strip()]
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    k = int(round(p * (len(sorted_values) - 1)))
+    return sorted_values[k]
+
+
+def rss_kb():
+    with open('/proc/self/status') as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+
+def make_op(client, op, data, name, batch, threads):
+    """返回 (每次调用的函数, 每次调用完成的文件数)"""
+    if op == 'put':
+        return (lambda: client.put(data)), 1
+    if op == 'get':
+        return (lambda: client.get(name) is not None), 1
+    if op == 'readinto':
+        buf = bytearray(len(data))
+        return (lambda: client.readinto(name, buf) == len(data)), 1
+    if op == 'put_many':
+        datas = [data] * batch
+        return (lambda: all(client.put_many(datas, threads))), batch
+    if op == 'get_many':
+        names = [name] * batch
+        return (lambda: None not in client.get_many(names, threads)), batch
+    raise ValueError('unknown op ' + op)
+
+
+def _worker(call, deadline, latencies, errors):
+    while time.time() < deadline:
+        start = time.time()
+        try:
+            ok = call()
+        except Exception:
+            ok = False
+        latencies.append(time.time() - start)
+        if not ok:
+            errors.append(1)
+
+
+def drive(client, op, data, name, threads, batch, duration):
+    """运行duration秒, 返回 (每次调用的延迟, 错误数, 完成的文件数, 实际用时)"""
+    # put_many/get_many自己开线程, 调用方只用一个
+    callers = 1 if op.endswith('_many') else threads
+    calls = [make_op(client, op, data, name, batch, threads) for _ in range(callers)]
+    latencies, errors = [], []
+    start = time.time()
+    deadline = start + duration
+    workers = [threading.Thread(target=_worker, args=(call, deadline, latencies, errors))
+               for call, _ in calls]
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    elapsed = time.time() - start
+    latencies.sort()
+    return latencies, len(errors), len(latencies) * calls[0][1], elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--ns', default='127.0.0.1:8108', help='nameserver, mock时任意')
+    parser.add_argument('--ops', default='put,get,readinto,put_many,get_many')
+    parser.add_argument('--sizes', default='1k,64k,1m,16m')
+    parser.add_argument('--chunks', default='256k,1m,4m', help='pytfs.set_chunk_size')
+    parser.add_argument('--threads', default='1,8,32')
+    parser.add_argument('--batch', type=int, default=32, help='put_many/get_many每次的文件数')
+    parser.add_argument('--duration', type=float, default=5)
+    parser.add_argument('--max-memory', default='4g',
+                        help='大小 x 线程数(或batch)超过此值的组合跳过')
+    parser.add_argument('--ns-latency-us', type=int, default=0)
+    parser.add_argument('--ds-latency-us', type=int, default=0)
+    parser.add_argument('--error-rate', type=float, default=0)
+    parser.add_argument('--out', help='结果追加写入此文件, 默认标准输出')
+    args = parser.parse_args()
+
+    # mock在第一次调用时读取, 要在import之前设置
+    os.environ['TFS_MOCK_NS_LATENCY_US'] = str(args.ns_latency_us)
+    os.environ['TFS_MOCK_DS_LATENCY_US'] = str(args.ds_latency_us)
+    os.environ['TFS_MOCK_ERROR_RATE'] = str(args.error_rate)
+    import pytfs
+
+    client = pytfs.TfsClient()
+    if not client.init(args.ns):
+        sys.exit('init %s failed' % args.ns)
+    pytfs.set_cache(0)
+
+    out = open(args.out, 'a') if args.out else sys.stdout
+    max_memory = parse_size(args.max_memory)
+    best = {}
+
+    for size in parse_list(args.sizes, parse_size):
+        data = b'x' * size
+        name = None
+        for chunk in parse_list(args.chunks, parse_size):
+            pytfs.set_chunk_size(chunk)
+            if name is None:
+                name = client.put(data)
+                if not name:
+                    sys.exit('put %d bytes failed' % size)
+            for op in parse_list(args.ops, str):
+                for threads in parse_list(args.threads):
+                    inflight = args.batch if op.endswith('_many') else threads
+                    if size * inflight > max_memory:
+                        print('skip %s size=%d threads=%d: over --max-memory' % (op, size, threads),
+                              file=sys.stderr)
+                        continue
+                    allocated = pytfs.buffer_stats()['allocated']
+                    lat, err, files, elapsed = drive(client, op, data, name, threads,
+                                                     args.batch, args.duration)
+                    allocated = pytfs.buffer_stats()['allocated'] - allocated
+                    result = {'op': op, 'size': size, 'chunk_size': chunk,
+                              'threads': threads, 'batch': args.batch if op.endswith('_many') else 1,
+                              'ns_latency_us': args.ns_latency_us,
+                              'ds_latency_us': args.ds_latency_us,
+                              'error_rate': args.error_rate,
+                              'calls': len(lat),
+                              'errors': err,
+                              'ops': round(files / elapsed, 1),
+                              'mb_s': round(files * size / elapsed / (1024 * 1024), 2),
+                              'p50_ms': round(percentile(lat, 0.50) * 1000, 3),
+                              'p99_ms': round(percentile(lat, 0.99) * 1000, 3),
+                              'p999_ms': round(percentile(lat, 0.999) * 1000, 3),
+                              'allocs_per_op': round(allocated / float(max(files, 1)), 3),
+                              'rss_kb': rss_kb()}
+                    out.write(json.dumps(result, sort_keys=True) + '\n')
+                    out.flush()
+                    key = (op, size)
+                    if key not in best or result['mb_s'] > best[key][0]:
+                        best[key] = (result['mb_s'], chunk, threads)
+        client.unlink(name)
+
+    for (op, size), (mb_s, chunk, threads) in sorted(best.items()):
+        print('best %-9s size=%-11d chunk=%-9d threads=%-3d %.2f MB/s'
+              % (op, size, chunk, threads, mb_s), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,276 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+ngx_http_tfs_module压测
+
+启动一个带ngx_http_tfs_module(用NGX_TFS_MOCK=YES编译, 后端为bench/ngx_http_tfs_mock.cpp)
+的nginx, 按 操作 x 文件大小 x tfs_rb_buffer_size x 并发数 逐一压测,
+每个组合输出一行json: qps, p50/p99/p999延迟(毫秒), 错误数, worker的RSS.
+
+例:
+  python tfs_bench.py --nginx /path/to/objs/nginx --sizes 4k,64k,1m \\
+      --buffers 64k,2m --concurrency 1,16,64 --duration 10 --out result.json
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import multiprocessing
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+    import httplib
+except ImportError:
+    import http.client as httplib
+
+
+NGINX_CONF = """
+daemon on;
+master_process on;
+worker_processes %(workers)d;
+error_log logs/error.log error;
+pid logs/nginx.pid;
+env TFS_MOCK_NS_LATENCY_US;
+env TFS_MOCK_DS_LATENCY_US;
+env TFS_MOCK_ERROR_RATE;
+
+events {
+    worker_connections 4096;
+}
+
+http {
+    access_log off;
+    keepalive_requests 1000000;
+    client_max_body_size 64m;
+    client_body_buffer_size 64m;
+%(http_extra)s
+    server {
+        listen 127.0.0.1:%(port)d;
+        tfs_nsip '127.0.0.1:10000';
+        tfs_rb_buffer_size %(rb_buffer_size)d;
+        # mock的文件没有真实的block位置, 不做熔断
+        tfs_breaker_failures 0;
+%(server_extra)s
+        location = /put { tfs_put; }
+        location = /get { tfs_get; }
+        location = /unlink { tfs_unlink; }
+        location = /tfs_status { tfs_status; }
+    }
+}
+"""
+
+
+def parse_size(s):
+    """'64k' -> 65536"""
+    s = s.strip().lower()
+    units = {'k': 1024, 'm': 1024 * 1024, 'g': 1024 * 1024 * 1024}
+    if s and s[-1] in units:
+        return int(float(s[:-1]) * units[s[-1]])
+    return int(s)
+
+
+def parse_list(s, conv=int):
+    return [conv(x) for x in s.split(',') if x.strip()]
+
+
+def mock_name(size, seq):
+    """mock后端按名字中的大小生成内容, 见ngx_http_tfs_mock.cpp"""
+    return 'TM%010d%06d' % (size, seq % 1000000)
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    k = int(round(p * (len(sorted_values) - 1)))
+    return sorted_values[k]
+
+
+class Nginx(object):
+    """在临时目录中用给定配置启动的nginx"""
+
+    def __init__(self, binary, port, rb_buffer_size=2 * 1024 * 1024, workers=1,
+                 http_extra='', server_extra='', env=None):
+        self.binary = os.path.abspath(binary)
+        self.port = port
+        self.prefix = tempfile.mkdtemp(prefix='tfs_bench_')
+        os.mkdir(os.path.join(self.prefix, 'logs'))
+        self.conf = os.path.join(self.prefix, 'nginx.conf')
+        with open(self.conf, 'w') as f:
+            f.write(NGINX_CONF % {
+                'workers': workers, 'port': port, 'rb_buffer_size': rb_buffer_size,
+                'http_extra': http_extra, 'server_extra': server_extra})
+        self.env = dict(os.environ)
+        self.env.update(env or {})
+
+    def _run(self, *args):
+        subprocess.check_call([self.binary, '-p', self.prefix + '/', '-c', self.conf] + list(args),
+                              env=self.env)
+
+    def start(self):
+        self._run()
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            try:
+                socket.create_connection(('127.0.0.1', self.port), 1).close()
+                return self
+            except socket.error:
+                time.sleep(0.1)
+        raise RuntimeError('nginx did not start, see %s/logs/error.log' % self.prefix)
+
+    def stop(self):
+        try:
+            self._run('-s', 'stop')
+            time.sleep(0.5)
+        finally:
+            shutil.rmtree(self.prefix, ignore_errors=True)
+
+    def master_pid(self):
+        with open(os.path.join(self.prefix, 'logs', 'nginx.pid')) as f:
+            return int(f.read().strip())
+
+    def rss_kb(self):
+        """所有worker的VmRSS之和"""
+        master = self.master_pid()
+        total = 0
+        for pid in os.listdir('/proc'):
+            if not pid.isdigit():
+                continue
+            try:
+                with open('/proc/%s/stat' % pid) as f:
+                    ppid = int(f.read().rsplit(')', 1)[1].split()[1])
+                if ppid != master:
+                    continue
+                with open('/proc/%s/status' % pid) as f:
+                    for line in f:
+                        if line.startswith('VmRSS:'):
+                            total += int(line.split()[1])
+            except (IOError, OSError, ValueError, IndexError):
+                continue
+        return total
+
+    def status(self):
+        conn = httplib.HTTPConnection('127.0.0.1', self.port, timeout=10)
+        conn.request('GET', '/tfs_status')
+        body = conn.getresponse().read()
+        conn.close()
+        return body.decode('utf-8', 'replace')
+
+
+def _client(port, requests, deadline, queue):
+    """一个连接上顺序发送requests中的请求(循环使用), 直到deadline"""
+    conn = httplib.HTTPConnection('127.0.0.1', port, timeout=30)
+    latencies = []
+    errors = 0
+    i = 0
+    while time.time() < deadline:
+        method, url, body = requests[i % len(requests)]
+        i += 1
+        start = time.time()
+        try:
+            conn.request(method, url, body)
+            resp = conn.getresponse()
+            resp.read()
+            if resp.status != 200:
+                errors += 1
+        except (httplib.HTTPException, socket.error):
+            errors += 1
+            conn.close()
+            conn = httplib.HTTPConnection('127.0.0.1', port, timeout=30)
+            continue
+        latencies.append(time.time() - start)
+    conn.close()
+    queue.put((latencies, errors))
+
+
+def drive(port, requests_per_client, duration):
+    """每个并发用一个进程, 避免压测端受GIL限制; 返回汇总的延迟(秒)和错误数"""
+    queue = multiprocessing.Queue()
+    deadline = time.time() + duration
+    procs = [multiprocessing.Process(target=_client, args=(port, reqs, deadline, queue))
+             for reqs in requests_per_client]
+    for p in procs:
+        p.start()
+    latencies = []
+    errors = 0
+    for _ in procs:
+        l, e = queue.get()
+        latencies.extend(l)
+        errors += e
+    for p in procs:
+        p.join()
+    latencies.sort()
+    return latencies, errors
+
+
+def summarize(latencies, errors, duration):
+    return {
+        'requests': len(latencies),
+        'errors': errors,
+        'qps': round(len(latencies) / float(duration), 1),
+        'p50_ms': round(percentile(latencies, 0.50) * 1000, 3),
+        'p99_ms': round(percentile(latencies, 0.99) * 1000, 3),
+        'p999_ms': round(percentile(latencies, 0.999) * 1000, 3),
+    }
+
+
+def build_requests(op, size, concurrency):
+    reqs = []
+    for c in range(concurrency):
+        if op == 'get':
+            reqs.append([('GET', '/get?tfsname=' + mock_name(size, c * 1000 + i), None)
+                         for i in range(1000)])
+        else:
+            reqs.append([('POST', '/put', b'x' * size)])
+    return reqs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--nginx', required=True, help='NGX_TFS_MOCK=YES编译的nginx')
+    parser.add_argument('--port', type=int, default=18080)
+    parser.add_argument('--workers', type=int, default=1)
+    parser.add_argument('--ops', default='get,put')
+    parser.add_argument('--sizes', default='4k,64k,1m')
+    parser.add_argument('--buffers', default='2m', help='tfs_rb_buffer_size')
+    parser.add_argument('--concurrency', default='1,16,64')
+    parser.add_argument('--duration', type=float, default=10)
+    parser.add_argument('--ns-latency-us', type=int, default=0)
+    parser.add_argument('--ds-latency-us', type=int, default=0)
+    parser.add_argument('--error-rate', type=float, default=0)
+    parser.add_argument('--out', help='结果追加写入此文件, 默认标准输出')
+    args = parser.parse_args()
+
+    env = {'TFS_MOCK_NS_LATENCY_US': str(args.ns_latency_us),
+           'TFS_MOCK_DS_LATENCY_US': str(args.ds_latency_us),
+           'TFS_MOCK_ERROR_RATE': str(args.error_rate)}
+    out = open(args.out, 'a') if args.out else sys.stdout
+
+    for rb in parse_list(args.buffers, parse_size):
+        nginx = Nginx(args.nginx, args.port, rb, args.workers, env=env).start()
+        try:
+            for op in parse_list(args.ops, str):
+                for size in parse_list(args.sizes, parse_size):
+                    for c in parse_list(args.concurrency):
+                        lat, err = drive(args.port, build_requests(op, size, c), args.duration)
+                        result = {'op': op, 'size': size, 'rb_buffer_size': rb,
+                                  'concurrency': c, 'workers': args.workers,
+                                  'ns_latency_us': args.ns_latency_us,
+                                  'ds_latency_us': args.ds_latency_us,
+                                  'error_rate': args.error_rate,
+                                  'rss_kb': nginx.rss_kb()}
+                        result.update(summarize(lat, err, args.duration))
+                        out.write(json.dumps(result, sort_keys=True) + '\n')
+                        out.flush()
+        finally:
+            nginx.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,210 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+tfs_peers测试: 在本机启动多个mock nginx, 比较不转发与按一致性哈希转发时
+
+  cached_objects  各节点缓存的文件数之和, 转发时每个文件只在所有者上缓存一份
+  tfs_reads       各节点缓存未命中(读tfs)次数之和
+  forwarded       转发给所有者的GET数
+  spill_rate      并发压测时因所有者负载超过tfs_peer_load_factor而由其它节点处理的比例
+
+每轮从随机节点GET全部文件, 要求都返回200且长度正确. 转发时再用--concurrency个客户端
+分在各节点上并发GET --duration秒, spill_rate超过--max-spill算失败; 带不对的X-Tfs-Peer
+的请求应照常转发(forged_forwarded大于0). 最后停掉一个节点,
+转发到它的请求应回到本地读tfs(tfs_peer_failures_total增加), 仍然全部成功.
+有失败时退出码为1.
+
+例:
+  python tfs_peer_test.py --nginx /path/to/objs/nginx --nodes 4 --files 2000 --concurrency 64
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import multiprocessing
+import random
+import re
+import socket
+import sys
+import time
+
+from tfs_bench import Nginx, _client, httplib, mock_name, parse_size
+
+
+PEER_KEY = 'bench-peer-key'
+
+PEER_SERVER = """
+        tfs_cache peers;
+        tfs_peer_location @tfs_peer;
+        location @tfs_peer {
+            proxy_pass http://$tfs_peer;
+            proxy_http_version 1.1;
+            proxy_set_header Connection "";
+            proxy_set_header X-Tfs-Peer %(key)s;
+            proxy_connect_timeout 100ms;
+            proxy_intercept_errors on;
+            error_page 500 502 503 504 = @tfs_local;
+        }
+        location @tfs_local {
+            tfs_get;
+            tfs_peer_location off;
+        }
+"""
+
+
+def node_name(i):
+    return 'tfs_node%d' % i
+
+
+def start_nodes(args, peers):
+    ports = [args.base_port + i for i in range(args.nodes)]
+    nodes = []
+    for i, port in enumerate(ports):
+        http_extra = '    tfs_cache_zone peers:%d;\n' % parse_size(args.cache_size)
+        server_extra = '        tfs_cache peers;\n'
+        if peers:
+            http_extra += '    tfs_peers %s;\n    tfs_peer_self %s;\n    tfs_peer_key %s;\n' % (
+                ' '.join(node_name(j) for j in range(args.nodes)), node_name(i), PEER_KEY)
+            for j, p in enumerate(ports):
+                http_extra += '    upstream %s { server 127.0.0.1:%d; keepalive 8; }\n' % (
+                    node_name(j), p)
+            server_extra = PEER_SERVER % {'key': PEER_KEY}
+        nodes.append(Nginx(args.nginx, port, workers=args.workers,
+                           http_extra=http_extra, server_extra=server_extra).start())
+    return nodes
+
+
+def metric(nodes, name):
+    """各节点上以name开头的指标之和"""
+    total = 0
+    pattern = re.compile(r'^%s(\{[^}]*\})? (\d+)$' % re.escape(name), re.M)
+    for node in nodes:
+        for m in pattern.finditer(node.status()):
+            total += int(m.group(2))
+    return total
+
+
+def get_all(nodes, names, size, headers=None):
+    """每个文件从随机节点GET一次, 返回失败数"""
+    conns = {}
+    errors = 0
+    for name in names:
+        node = random.choice(nodes)
+        conn = conns.get(node.port)
+        if conn is None:
+            conn = conns[node.port] = httplib.HTTPConnection('127.0.0.1', node.port, timeout=30)
+        try:
+            conn.request('GET', '/get?tfsname=' + name, headers=headers or {})
+            resp = conn.getresponse()
+            body = resp.read()
+            if resp.status != 200 or len(body) != size:
+                errors += 1
+        except (httplib.HTTPException, socket.error):
+            errors += 1
+            conn.close()
+            del conns[node.port]
+    for conn in conns.values():
+        conn.close()
+    return errors
+
+
+def get_concurrent(nodes, names, concurrency, duration):
+    """concurrency个进程平均分在各节点上, 各自按随机顺序GET文件, 返回请求数与错误数"""
+    queue = multiprocessing.Queue()
+    deadline = time.time() + duration
+    procs = []
+    for c in range(concurrency):
+        order = list(names)
+        random.shuffle(order)
+        reqs = [('GET', '/get?tfsname=' + name, None) for name in order]
+        procs.append(multiprocessing.Process(target=_client,
+                                             args=(nodes[c % len(nodes)].port, reqs, deadline, queue)))
+    for p in procs:
+        p.start()
+    requests = 0
+    errors = 0
+    for _ in procs:
+        latencies, e = queue.get()
+        requests += len(latencies)
+        errors += e
+    for p in procs:
+        p.join()
+    return requests, errors
+
+
+def run(args, peers):
+    names = [mock_name(args.size, i) for i in range(args.files)]
+    nodes = start_nodes(args, peers)
+    result = {'peers': peers, 'nodes': args.nodes, 'files': args.files, 'rounds': args.rounds}
+    try:
+        errors = 0
+        for _ in range(args.rounds):
+            errors += get_all(nodes, names, args.size)
+        result['errors'] = errors
+        result['cached_objects'] = metric(nodes, 'tfs_cache_objects')
+        result['tfs_reads'] = metric(nodes, 'tfs_cache_misses_total')
+        result['forwarded'] = metric(nodes, 'tfs_peer_forwarded_total')
+
+        if peers and args.concurrency:
+            # 实际并发下有界负载让多少请求离开了所有者
+            spilled = metric(nodes, 'tfs_peer_spilled_total')
+            requests, errors = get_concurrent(nodes, names, args.concurrency, args.duration)
+            spilled = metric(nodes, 'tfs_peer_spilled_total') - spilled
+            result['concurrent_requests'] = requests
+            result['concurrent_errors'] = errors
+            result['spill_rate'] = round(spilled / float(max(requests, 1)), 4)
+
+        if peers and args.nodes > 1:
+            # 客户端自己带的X-Tfs-Peer不对, 仍应照常转发
+            forwarded = metric(nodes, 'tfs_peer_forwarded_total')
+            result['errors_forged'] = get_all(nodes, names, args.size, {'X-Tfs-Peer': 'forged'})
+            result['forged_forwarded'] = metric(nodes, 'tfs_peer_forwarded_total') - forwarded
+
+            # 停掉一个节点, 它拥有的文件由其它节点回到本地读tfs
+            nodes.pop().stop()
+            result['errors_after_stop'] = get_all(nodes, names, args.size)
+            result['peer_failures'] = metric(nodes, 'tfs_peer_failures_total')
+    finally:
+        for node in nodes:
+            node.stop()
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--nginx', required=True, help='NGX_TFS_MOCK=YES编译的nginx')
+    parser.add_argument('--base-port', type=int, default=18180)
+    parser.add_argument('--nodes', type=int, default=3)
+    parser.add_argument('--workers', type=int, default=1)
+    parser.add_argument('--files', type=int, default=2000)
+    parser.add_argument('--size', type=parse_size, default='4k')
+    parser.add_argument('--rounds', type=int, default=3)
+    parser.add_argument('--cache-size', default='64m')
+    parser.add_argument('--concurrency', type=int, default=32,
+                        help='转发时并发压测的客户端数, 0为不测')
+    parser.add_argument('--duration', type=float, default=10)
+    parser.add_argument('--max-spill', type=float, default=0.2,
+                        help='spill_rate的上限')
+    args = parser.parse_args()
+
+    failed = False
+    for peers in (False, True):
+        result = run(args, peers)
+        print(json.dumps(result, sort_keys=True))
+        failed = failed or result['errors'] or result.get('errors_after_stop') \
+            or result.get('concurrent_errors') or result.get('errors_forged') \
+            or result.get('forged_forwarded') == 0
+        if result.get('spill_rate', 0) > args.max_spill:
+            print('spill rate %.4f over %.4f' % (result['spill_rate'], args.max_spill),
+                  file=sys.stderr)
+            failed = True
+        if peers and args.nodes > 1 and result['cached_objects'] > args.files:
+            print('files cached on more than one node: %d > %d'
+                  % (result['cached_objects'], args.files), file=sys.stderr)
+            failed = True
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
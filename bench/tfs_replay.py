@@ -0,0 +1,373 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+用nginx访问日志中的 /get?tfsname= 请求做容量评估
+
+simulate  离线模拟: 对每个缓存大小与淘汰策略, 计算命中率(按次数与字节),
+          以及未命中时打到nameserver/dataserver的请求率(平均与峰值每秒).
+          nameserver请求按客户端的block缓存(tfs_block_cache_items/time)估算,
+          dataserver请求为每次未命中 1次fstat + ceil(大小/tfs_rb_buffer_size)次读.
+replay    按日志中的时间间隔(可用--speed加速)把请求重放到nginx, 报告实际QPS与延迟.
+          指定--nginx时在本地启动用NGX_TFS_MOCK=YES编译的nginx, 文件名按日志中的
+          大小换成mock的名字, 结束时附上tfs_status中的统计.
+
+日志默认按combined格式解析, 取 $time_local, 请求行, $status, $body_bytes_sent.
+log_format中带$tfs_block_id时, 可用--regex给出含block命名分组的正则, 否则按文件名估算block.
+
+例:
+  python tfs_replay.py simulate access.log --cache-sizes 256m,1g,4g --policies lru,fifo,lfu
+  python tfs_replay.py replay access.log --nginx objs/nginx --speed 4 --cache-size 1g
+"""
+from __future__ import print_function
+
+import argparse
+import collections
+import heapq
+import json
+import math
+import multiprocessing
+import re
+import socket
+import sys
+import time
+from datetime import datetime
+
+from tfs_bench import Nginx, httplib, mock_name, parse_list, parse_size, summarize
+
+
+COMBINED = (r'\S+ \S+ \S+ \[(?P<time>[^\]]+)\] "(?P<method>\S+) (?P<uri>\S+)[^"]*" '
+            r'(?P<status>\d{3}) (?P<bytes>\d+|-)')
+
+# 缓存中每个对象的额外开销(节点, 名字, slab取整), 与ngx_http_tfs_cache.cpp大致相当
+CACHE_ENTRY_OVERHEAD = 128
+
+
+class Request(object):
+    __slots__ = ('ts', 'name', 'size', 'block')
+
+    def __init__(self, ts, name, size, block):
+        self.ts = ts
+        self.name = name
+        self.size = size
+        self.block = block
+
+
+def parse_log(path, regex, limit=None):
+    pattern = re.compile(regex)
+    time_cache = {}
+    reqs = []
+    with open(path) as f:
+        for line in f:
+            m = pattern.search(line)
+            if not m or m.group('method') not in ('GET', 'HEAD'):
+                continue
+            uri = m.group('uri')
+            pos = uri.find('tfsname=')
+            if pos < 0:
+                continue
+            name = uri[pos + len('tfsname='):].split('&', 1)[0]
+            if not name:
+                continue
+
+            t = m.group('time')
+            ts = time_cache.get(t)
+            if ts is None:
+                dt = datetime.strptime(t.split()[0], '%d/%b/%Y:%H:%M:%S')
+                ts = time_cache[t] = time.mktime(dt.timetuple())
+
+            size = m.group('bytes')
+            size = int(size) if size != '-' and m.group('status') == '200' else 0
+            groups = m.groupdict()
+            # 文件名中第3到6个字符由block id的低位编码而来, 没有$tfs_block_id时用来近似区分block
+            block = groups.get('block') or name[2:6]
+
+            reqs.append(Request(ts, name, size, block))
+            if limit and len(reqs) >= limit:
+                break
+    return reqs
+
+
+class LRUCache(object):
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.used = 0
+        self.items = collections.OrderedDict()
+
+    def _weight(self, size):
+        return size + CACHE_ENTRY_OVERHEAD
+
+    def get(self, name):
+        size = self.items.pop(name, None)
+        if size is None:
+            return False
+        self.items[name] = size
+        return True
+
+    def evict(self):
+        _, size = self.items.popitem(last=False)
+        self.used -= self._weight(size)
+
+    def put(self, name, size):
+        w = self._weight(size)
+        if w > self.capacity:
+            return
+        while self.used + w > self.capacity:
+            self.evict()
+        self.items[name] = size
+        self.used += w
+
+
+class FIFOCache(LRUCache):
+    def get(self, name):
+        return name in self.items
+
+
+class LFUCache(LRUCache):
+    """按访问次数淘汰, 次数相同时淘汰最早的; 堆中的过期项在弹出时跳过"""
+
+    def __init__(self, capacity):
+        LRUCache.__init__(self, capacity)
+        self.counts = {}
+        self.heap = []
+        self.tick = 0
+
+    def _push(self, name):
+        self.tick += 1
+        heapq.heappush(self.heap, (self.counts[name], self.tick, name))
+
+    def get(self, name):
+        if name not in self.items:
+            return False
+        self.counts[name] += 1
+        self._push(name)
+        return True
+
+    def evict(self):
+        while True:
+            count, _, name = heapq.heappop(self.heap)
+            if name in self.items and self.counts[name] == count:
+                break
+        size = self.items.pop(name)
+        del self.counts[name]
+        self.used -= self._weight(size)
+
+    def put(self, name, size):
+        w = self._weight(size)
+        if w > self.capacity:
+            return
+        while self.used + w > self.capacity:
+            self.evict()
+        self.items[name] = size
+        self.counts[name] = 1
+        self._push(name)
+        self.used += w
+
+
+POLICIES = {'lru': LRUCache, 'fifo': FIFOCache, 'lfu': LFUCache}
+
+
+class BlockCache(object):
+    """TfsClient的block位置缓存: 条数上限加过期时间"""
+
+    def __init__(self, items, ttl):
+        self.items = items
+        self.ttl = ttl
+        self.blocks = collections.OrderedDict()
+
+    def lookup(self, block, now):
+        t = self.blocks.pop(block, None)
+        if t is not None and now - t < self.ttl:
+            self.blocks[block] = t
+            return True
+        self.blocks[block] = now
+        if len(self.blocks) > self.items:
+            self.blocks.popitem(last=False)
+        return False
+
+
+def simulate(reqs, cache_size, policy, max_object_size, rb_buffer_size,
+             block_cache_items, block_cache_time):
+    # 与模块一致, 缓存区留出1/8给slab的管理开销
+    cache = POLICIES[policy](cache_size - cache_size // 8) if cache_size else None
+    blocks = BlockCache(block_cache_items, block_cache_time)
+    hits = byte_hits = total_bytes = ns = ds = 0
+    ns_per_sec = collections.Counter()
+    ds_per_sec = collections.Counter()
+
+    for r in reqs:
+        total_bytes += r.size
+        if cache and cache.get(r.name):
+            hits += 1
+            byte_hits += r.size
+            continue
+
+        sec = int(r.ts)
+        if not blocks.lookup(r.block, r.ts):
+            ns += 1
+            ns_per_sec[sec] += 1
+        n = 1 + max(1, int(math.ceil(r.size / float(rb_buffer_size))))
+        ds += n
+        ds_per_sec[sec] += n
+
+        if cache and 0 < r.size <= max_object_size:
+            cache.put(r.name, r.size)
+
+    duration = max(1.0, reqs[-1].ts - reqs[0].ts + 1) if reqs else 1.0
+    return {
+        'cache_size': cache_size,
+        'policy': policy if cache_size else 'none',
+        'requests': len(reqs),
+        'log_qps': round(len(reqs) / duration, 1),
+        'hit_ratio': round(hits / float(len(reqs)), 4) if reqs else 0,
+        'byte_hit_ratio': round(byte_hits / float(total_bytes), 4) if total_bytes else 0,
+        'ns_qps': round(ns / duration, 1),
+        'ns_qps_peak': max(ns_per_sec.values()) if ns_per_sec else 0,
+        'ds_qps': round(ds / duration, 1),
+        'ds_qps_peak': max(ds_per_sec.values()) if ds_per_sec else 0,
+    }
+
+
+def cmd_simulate(args, reqs, out):
+    sizes = parse_list(args.cache_sizes, parse_size)
+    for size in sizes:
+        for policy in (parse_list(args.policies, str) if size else ['none']):
+            result = simulate(reqs, size, policy, parse_size(args.max_object_size),
+                              parse_size(args.rb_buffer_size), args.block_cache_items,
+                              args.block_cache_time)
+            out.write(json.dumps(result, sort_keys=True) + '\n')
+            out.flush()
+
+
+def _replay_client(port, host, schedule, start, queue):
+    """按计划时间发送请求, 落后于计划时立即发送"""
+    conn = httplib.HTTPConnection(host, port, timeout=30)
+    latencies = []
+    errors = 0
+    lag = 0.0
+    for offset, url in schedule:
+        wait = start + offset - time.time()
+        if wait > 0:
+            time.sleep(wait)
+        else:
+            lag = max(lag, -wait)
+        t = time.time()
+        try:
+            conn.request('GET', url)
+            resp = conn.getresponse()
+            resp.read()
+            if resp.status != 200:
+                errors += 1
+        except (httplib.HTTPException, socket.error):
+            errors += 1
+            conn.close()
+            conn = httplib.HTTPConnection(host, port, timeout=30)
+            continue
+        latencies.append(time.time() - t)
+    conn.close()
+    queue.put((latencies, errors, lag))
+
+
+def cmd_replay(args, reqs, out):
+    nginx = None
+    host, port = '127.0.0.1', args.port
+    if args.nginx:
+        http_extra = server_extra = ''
+        cache_size = parse_size(args.cache_size) if args.cache_size else 0
+        if cache_size:
+            http_extra = '    tfs_cache_zone replay:%d;\n' % cache_size
+            server_extra = ('        tfs_cache replay;\n'
+                            '        tfs_cache_max_object_size %d;\n' % parse_size(args.max_object_size))
+        nginx = Nginx(args.nginx, port, parse_size(args.rb_buffer_size), args.workers,
+                      http_extra, server_extra,
+                      env={'TFS_MOCK_NS_LATENCY_US': str(args.ns_latency_us),
+                           'TFS_MOCK_DS_LATENCY_US': str(args.ds_latency_us),
+                           'TFS_MOCK_ERROR_RATE': '0'}).start()
+    elif args.target:
+        host, _, p = args.target.partition(':')
+        port = int(p or 80)
+
+    try:
+        # 按文件名分配到各连接, 同一文件的请求保持原有顺序
+        base = reqs[0].ts
+        schedules = [[] for _ in range(args.concurrency)]
+        for r in reqs:
+            name = mock_name(r.size, hash(r.name)) if nginx else r.name
+            schedules[hash(r.name) % args.concurrency].append(
+                ((r.ts - base) / args.speed, '/get?tfsname=' + name))
+
+        queue = multiprocessing.Queue()
+        start = time.time() + 1
+        procs = [multiprocessing.Process(target=_replay_client, args=(port, host, s, start, queue))
+                 for s in schedules]
+        for p in procs:
+            p.start()
+        latencies, errors, lag = [], 0, 0.0
+        for _ in procs:
+            l, e, g = queue.get()
+            latencies.extend(l)
+            errors += e
+            lag = max(lag, g)
+        for p in procs:
+            p.join()
+        duration = max(time.time() - start, 0.001)
+        latencies.sort()
+
+        result = summarize(latencies, errors, duration)
+        result.update({'speed': args.speed, 'concurrency': args.concurrency,
+                       'target_qps': round(len(reqs) / max((reqs[-1].ts - base + 1) / args.speed, 0.001), 1),
+                       'max_lag_s': round(lag, 3)})
+        if nginx:
+            result['cache_size'] = args.cache_size or '0'
+            result['tfs_status'] = [line for line in nginx.status().splitlines()
+                                    if line.startswith(('tfs_requests_total', 'tfs_cache_'))]
+        out.write(json.dumps(result, sort_keys=True) + '\n')
+    finally:
+        if nginx:
+            nginx.stop()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('mode', choices=['simulate', 'replay'])
+    parser.add_argument('log', help='nginx访问日志')
+    parser.add_argument('--regex', default=COMBINED,
+                        help='解析日志的正则, 需要time/method/uri/status/bytes分组, 可选block分组')
+    parser.add_argument('--limit', type=int, help='只取前N条请求')
+    parser.add_argument('--max-object-size', default='1m', help='tfs_cache_max_object_size')
+    parser.add_argument('--rb-buffer-size', default='2m', help='tfs_rb_buffer_size')
+    parser.add_argument('--out', help='结果追加写入此文件, 默认标准输出')
+
+    sim = parser.add_argument_group('simulate')
+    sim.add_argument('--cache-sizes', default='0,256m,1g,4g')
+    sim.add_argument('--policies', default='lru,fifo,lfu')
+    sim.add_argument('--block-cache-items', type=int, default=500)
+    sim.add_argument('--block-cache-time', type=int, default=300)
+
+    rep = parser.add_argument_group('replay')
+    rep.add_argument('--nginx', help='NGX_TFS_MOCK=YES编译的nginx, 在本地启动')
+    rep.add_argument('--target', help='不启动nginx, 直接重放到host:port')
+    rep.add_argument('--port', type=int, default=18080)
+    rep.add_argument('--workers', type=int, default=1)
+    rep.add_argument('--cache-size', help='本地nginx的tfs_cache_zone大小, 默认不开缓存')
+    rep.add_argument('--speed', type=float, default=1.0, help='重放速度倍数')
+    rep.add_argument('--concurrency', type=int, default=32, help='连接数')
+    rep.add_argument('--ns-latency-us', type=int, default=0)
+    rep.add_argument('--ds-latency-us', type=int, default=0)
+    args = parser.parse_args()
+
+    reqs = parse_log(args.log, args.regex, args.limit)
+    if not reqs:
+        sys.exit('no tfsname GET requests found in %s' % args.log)
+
+    out = open(args.out, 'a') if args.out else sys.stdout
+    if args.mode == 'simulate':
+        cmd_simulate(args, reqs, out)
+    else:
+        if not args.nginx and not args.target:
+            sys.exit('replay needs --nginx or --target')
+        cmd_replay(args, reqs, out)
+
+
+if __name__ == '__main__':
+    main()
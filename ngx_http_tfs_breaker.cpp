@@ -0,0 +1,399 @@
+/*
+ * 按dataserver熔断与自适应超时
+ *
+ * TfsClient读文件时按file_id选一个副本, 这个dataserver半死不活时, 每次读都要
+ * 等满超时才换到其它副本, 期间worker被阻塞. 这里在每个worker内(与upstream的
+ * max_fails一样, 不跨worker共享)记录每个dataserver的连续失败次数和读耗时分布:
+ *
+ *   连续失败tfs_breaker_failures次后暂停tfs_breaker_timeout, 期间读它上面的文件
+ *   时open和第一次read只给tfs_breaker_skip_timeout的超时(第一次只读一小块),
+ *   客户端很快换到其它副本, 之后恢复正常超时读其余部分; 所有副本都暂停时直接
+ *   返回503. 暂停到期后放过一个请求用正常超时试探, 成功即恢复.
+ *
+ *   tfs_adaptive_timeout on时, 超时取该dataserver单次read耗时p99的若干倍,
+ *   不小于tfs_adaptive_timeout_min, 不大于tfs_timeout. 超时是对每次调用的,
+ *   所以按每次调用统计, 不按整个文件. 上传时dataserver由nameserver分配, 按集群统计.
+ *
+ * 失败指open之后的读失败或crc不对, 以及任何等满了超时的操作; 文件不存在不算.
+ * */
+#include "ngx_http_tfs_module.h"
+#include "fsname.h"
+
+
+using namespace tfs::common;
+
+#define NGX_HTTP_TFS_DS_CLOSED    0
+#define NGX_HTTP_TFS_DS_OPEN      1         /* 暂停使用 */
+#define NGX_HTTP_TFS_DS_HALF_OPEN 2         /* 试探中 */
+
+#define NGX_HTTP_TFS_LATENCY_MIN_SAMPLES 100    /* 样本少于此数时用tfs_timeout */
+#define NGX_HTTP_TFS_LATENCY_DECAY 1024         /* 样本数到此时减半, 让分布跟上变化 */
+#define NGX_HTTP_TFS_TIMEOUT_FACTOR 4           /* 超时为p99的倍数 */
+
+typedef struct {
+    ngx_rbtree_node_t node;             /* key由地址算出, 相同时再比较addr */
+    uint64_t addr;
+    ngx_uint_t state;
+    ngx_uint_t fails;
+    time_t opened;
+    ngx_http_tfs_latency_t latency;
+} ngx_http_tfs_ds_t;
+
+static ngx_rbtree_t ngx_http_tfs_ds_tree;
+static ngx_rbtree_node_t ngx_http_tfs_ds_sentinel;
+
+
+static uint64_t
+ngx_http_tfs_breaker_now()
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+ngx_http_tfs_latency_add(ngx_http_tfs_latency_t *l, uint64_t usec)
+{
+    ngx_uint_t i;
+
+    // 第i个桶的上限为2^(i+7)微秒
+    usec >>= 7;
+    for (i = 0; usec && i < NGX_HTTP_TFS_LATENCY_BUCKETS - 1; i++) {
+        usec >>= 1;
+    }
+
+    l->buckets[i]++;
+    l->samples++;
+
+    if (l->samples >= NGX_HTTP_TFS_LATENCY_DECAY) {
+        l->samples = 0;
+        for (i = 0; i < NGX_HTTP_TFS_LATENCY_BUCKETS; i++) {
+            l->buckets[i] >>= 1;
+            l->samples += l->buckets[i];
+        }
+    }
+}
+
+static ngx_msec_t
+ngx_http_tfs_latency_timeout(ngx_http_tfs_latency_t *l, ngx_http_tfs_ns_loc_conf_t *conf)
+{
+    ngx_uint_t i;
+    uint32_t target, n;
+    ngx_msec_t timeout;
+
+    if (!conf->adaptive_timeout || l->samples < NGX_HTTP_TFS_LATENCY_MIN_SAMPLES) {
+        return conf->timeout;
+    }
+
+    target = l->samples - l->samples / 100;
+    n = 0;
+    for (i = 0; i < NGX_HTTP_TFS_LATENCY_BUCKETS - 1; i++) {
+        n += l->buckets[i];
+        if (n >= target) {
+            break;
+        }
+    }
+
+    timeout = (ngx_msec_t) (((uint64_t) 1 << (i + 7)) * NGX_HTTP_TFS_TIMEOUT_FACTOR / 1000);
+
+    return ngx_max(conf->adaptive_timeout_min, ngx_min(timeout, conf->timeout));
+}
+
+static ngx_rbtree_key_t
+ngx_http_tfs_ds_key(uint64_t addr)
+{
+    return (ngx_rbtree_key_t) (addr ^ (addr >> 32));
+}
+
+static void
+ngx_http_tfs_ds_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+
+    for ( ;; ) {
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+        } else {
+            p = (((ngx_http_tfs_ds_t *) node)->addr < ((ngx_http_tfs_ds_t *) temp)->addr)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_tfs_ds_t *
+ngx_http_tfs_ds_lookup(uint64_t addr, ngx_uint_t create)
+{
+    ngx_rbtree_key_t key;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_tfs_ds_t *ds;
+
+    if (ngx_http_tfs_ds_tree.root == NULL) {
+        ngx_rbtree_init(&ngx_http_tfs_ds_tree, &ngx_http_tfs_ds_sentinel,
+                        ngx_http_tfs_ds_insert_value);
+    }
+
+    key = ngx_http_tfs_ds_key(addr);
+    node = ngx_http_tfs_ds_tree.root;
+    sentinel = ngx_http_tfs_ds_tree.sentinel;
+
+    while (node != sentinel) {
+        ds = (ngx_http_tfs_ds_t *) node;
+
+        if (key == node->key && addr == ds->addr) {
+            return ds;
+        }
+
+        if (key != node->key) {
+            node = (key < node->key) ? node->left : node->right;
+        } else {
+            node = (addr < ds->addr) ? node->left : node->right;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    // dataserver数量有限, 节点在worker退出前不释放
+    ds = (ngx_http_tfs_ds_t *) ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_http_tfs_ds_t));
+    if (ds == NULL) {
+        return NULL;
+    }
+
+    ds->node.key = key;
+    ds->addr = addr;
+    ngx_rbtree_insert(&ngx_http_tfs_ds_tree, &ds->node);
+
+    return ds;
+}
+
+/*
+ * 读文件前调用: 找出首选的dataserver, 决定本次的超时.
+ * 所有副本都暂停使用时返回NGX_BUSY
+ * */
+ngx_int_t
+ngx_http_tfs_breaker_read(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    u_char *tfsname, ngx_http_tfs_breaker_t *br)
+{
+    ngx_uint_t i, n, p, available;
+    uint64_t addrs[NGX_HTTP_TFS_MAX_REPLICAS], primary;
+    ngx_msec_t timeout;
+    ngx_http_tfs_ds_t *ds, *other;
+
+    ngx_memzero(br, sizeof(ngx_http_tfs_breaker_t));
+    br->max_fails = conf->breaker_failures;
+    br->timeout = conf->timeout;
+    br->normal_timeout = conf->timeout;
+    br->log = r->connection->log;
+
+    if (conf->breaker_failures == 0 && !conf->adaptive_timeout) {
+        return NGX_OK;
+    }
+
+    FSName fsname((const char *) tfsname);
+    if (!fsname.is_valid()) {
+        return NGX_OK;
+    }
+
+    n = ngx_http_tfs_dataservers(conf->cluster, fsname.get_block_id(), addrs, NGX_HTTP_TFS_MAX_REPLICAS);
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    p = fsname.get_file_id() % n;
+    primary = addrs[p];
+    br->addr = primary;
+
+    ds = ngx_http_tfs_ds_lookup(primary, 1);
+    if (ds == NULL) {
+        return NGX_OK;
+    }
+
+    br->ds = ds;
+    timeout = ngx_http_tfs_latency_timeout(&ds->latency, conf);
+
+    if (conf->breaker_failures && ds->state != NGX_HTTP_TFS_DS_CLOSED) {
+
+        if (ngx_time() - ds->opened >= conf->breaker_timeout) {
+            // 暂停到期, 本次用正常超时试探
+            ds->state = NGX_HTTP_TFS_DS_HALF_OPEN;
+            ds->opened = ngx_time();
+            br->probe = 1;
+
+        } else {
+            // 与客户端换副本的顺序一样从首选的下一个找起, 找到的就是本次实际读的
+            available = 0;
+            for (i = 1; i < n; i++) {
+                if (addrs[(p + i) % n] == primary) {
+                    continue;
+                }
+                other = ngx_http_tfs_ds_lookup(addrs[(p + i) % n], 0);
+                if (other == NULL || other->state == NGX_HTTP_TFS_DS_CLOSED) {
+                    br->addr = addrs[(p + i) % n];
+                    available = 1;
+                    break;
+                }
+            }
+
+            if (!available) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "ngx_tfs_mods: all dataservers of block %uD are disabled", fsname.get_block_id());
+                return NGX_BUSY;
+            }
+
+            // 很快放弃首选的dataserver, 让客户端换到其它副本; 这样的结果不计入它的统计.
+            // 只用于open和第一次read, 之后客户端已在用其它副本, 由restore恢复正常超时
+            timeout = ngx_min(timeout, conf->breaker_skip_timeout);
+            br->ds = NULL;
+            br->skip = 1;
+        }
+    }
+
+    br->timeout = timeout;
+    br->start = ngx_http_tfs_breaker_now();
+    br->last = br->start;
+    ngx_http_tfs_client_timeout(timeout);
+
+    return NGX_OK;
+}
+
+/*
+ * 本次读用的dataserver, 在open成功之后调用. 没有启用熔断和自适应超时时,
+ * block位置这时已在客户端缓存中, 查一次不会访问nameserver
+ * */
+uint64_t
+ngx_http_tfs_breaker_dataserver(ngx_http_tfs_ns_loc_conf_t *conf, u_char *tfsname,
+    ngx_http_tfs_breaker_t *br)
+{
+    if (br->addr) {
+        return br->addr;
+    }
+
+    FSName fsname((const char *) tfsname);
+    if (!fsname.is_valid()) {
+        return 0;
+    }
+
+    return ngx_http_tfs_dataserver(conf->cluster, fsname.get_block_id(), fsname.get_file_id());
+}
+
+/*
+ * 每次调用TfsClient之后调用, 检查这一次是否等满了超时.
+ * sample为这次是成功的read, 其耗时计入首选dataserver的分布
+ * */
+void
+ngx_http_tfs_breaker_lap(ngx_http_tfs_breaker_t *br, ngx_uint_t sample)
+{
+    uint64_t now, elapsed;
+    ngx_http_tfs_ds_t *ds = (ngx_http_tfs_ds_t *) br->ds;
+
+    if (ds == NULL) {
+        return;
+    }
+
+    now = ngx_http_tfs_breaker_now();
+    elapsed = now - br->last;
+    br->last = now;
+
+    if (elapsed >= (uint64_t) br->timeout * 1000) {
+        br->slow = 1;
+        return;
+    }
+
+    if (sample) {
+        ngx_http_tfs_latency_add(&ds->latency, elapsed);
+    }
+}
+
+/* 首选dataserver暂停时, 第一次read之后恢复正常超时 */
+void
+ngx_http_tfs_breaker_restore(ngx_http_tfs_breaker_t *br)
+{
+    if (!br->skip) {
+        return;
+    }
+
+    br->skip = 0;
+    br->timeout = br->normal_timeout;
+    ngx_http_tfs_client_timeout(br->timeout);
+}
+
+void
+ngx_http_tfs_breaker_read_done(ngx_http_tfs_breaker_t *br, ngx_int_t failed)
+{
+    ngx_http_tfs_ds_t *ds = (ngx_http_tfs_ds_t *) br->ds;
+
+    ngx_http_tfs_breaker_restore(br);
+
+    if (ds == NULL) {
+        return;
+    }
+
+    // 等满了超时才完成的, 多半是换到其它副本后才成功, 也算首选dataserver失败
+    if (br->slow) {
+        failed = 1;
+    }
+
+    if (!failed) {
+        ds->fails = 0;
+
+        if (ds->state != NGX_HTTP_TFS_DS_CLOSED) {
+            ds->state = NGX_HTTP_TFS_DS_CLOSED;
+            ngx_log_error(NGX_LOG_WARN, br->log, 0, "ngx_tfs_mods: dataserver %s recovered",
+                          Func::addr_to_str(ds->addr, true).c_str());
+        }
+        return;
+    }
+
+    ds->fails++;
+
+    if (br->probe || (br->max_fails && ds->fails >= br->max_fails
+                      && ds->state == NGX_HTTP_TFS_DS_CLOSED))
+    {
+        ds->state = NGX_HTTP_TFS_DS_OPEN;
+        ds->opened = ngx_time();
+        ngx_log_error(NGX_LOG_WARN, br->log, 0,
+            "ngx_tfs_mods: dataserver %s disabled after %ui failures",
+            Func::addr_to_str(ds->addr, true).c_str(), ds->fails);
+    }
+}
+
+/* 上传前调用, 只做自适应超时 */
+void
+ngx_http_tfs_breaker_write(ngx_http_tfs_ns_loc_conf_t *conf, ngx_http_tfs_breaker_t *br)
+{
+    ngx_memzero(br, sizeof(ngx_http_tfs_breaker_t));
+    br->timeout = conf->timeout;
+
+    if (!conf->adaptive_timeout) {
+        return;
+    }
+
+    br->timeout = ngx_http_tfs_latency_timeout(&conf->cluster->write_latency, conf);
+    br->start = ngx_http_tfs_breaker_now();
+    ngx_http_tfs_client_timeout(br->timeout);
+}
+
+void
+ngx_http_tfs_breaker_write_done(ngx_http_tfs_ns_loc_conf_t *conf, ngx_http_tfs_breaker_t *br,
+    ngx_int_t failed)
+{
+    if (!conf->adaptive_timeout || failed) {
+        return;
+    }
+
+    ngx_http_tfs_latency_add(&conf->cluster->write_latency, ngx_http_tfs_breaker_now() - br->start);
+}
@@ -0,0 +1,188 @@
+/*
+ * 按大小分级复用的读buffer
+ *
+ * GET从tfs读出的文件和从缓存拷出的文件都要一块整文件大小的buffer, 每次从请求的pool
+ * 分配, 请求结束时还给malloc. 几MB的分配反复进出, worker的堆越来越碎, 高峰过后RSS
+ * 也降不下来. 这里把buffer按64K/256K/2M分级, 请求结束时放回本worker的空闲链表,
+ * 下次直接复用; 超过2M的仍从pool中分配.
+ *
+ *   tfs_buffer_arena size: 每个worker空闲链表中最多留多少字节, 0为不启用
+ *   tfs_buffer_arena_hugepages on: 2M的buffer用大页(MAP_HUGETLB), 不可用时退回普通内存
+ *
+ * 复用与新分配的次数, 当前与最高占用的字节数计入tfs_status.
+ * */
+#include "ngx_http_tfs_module.h"
+#include <sys/mman.h>
+
+
+#define NGX_HTTP_TFS_BUFFER_CLASSES 3
+#define NGX_HTTP_TFS_BUFFER_HUGE (2 * 1024 * 1024)
+
+static const size_t ngx_http_tfs_buffer_sizes[NGX_HTTP_TFS_BUFFER_CLASSES] = {
+    64 * 1024, 256 * 1024, 2 * 1024 * 1024
+};
+
+/* 空闲的buffer, 链表节点就放在buffer的开头 */
+typedef struct ngx_http_tfs_buffer_free_s ngx_http_tfs_buffer_free_t;
+
+struct ngx_http_tfs_buffer_free_s {
+    ngx_http_tfs_buffer_free_t *next;
+    ngx_uint_t huge;
+};
+
+/* 借出的buffer, 作为请求pool的cleanup数据 */
+typedef struct {
+    u_char *data;
+    ngx_uint_t cls;
+    ngx_uint_t huge;                    /* 用mmap分配的大页 */
+} ngx_http_tfs_buffer_t;
+
+static size_t ngx_http_tfs_buffer_max;                 /* 空闲链表中最多留的字节数 */
+static ngx_flag_t ngx_http_tfs_buffer_hugepages;
+static size_t ngx_http_tfs_buffer_cached;              /* 空闲链表中的字节数 */
+static size_t ngx_http_tfs_buffer_total;               /* 借出的与空闲的合计 */
+static ngx_http_tfs_buffer_free_t *ngx_http_tfs_buffer_free[NGX_HTTP_TFS_BUFFER_CLASSES];
+
+
+static u_char *
+ngx_http_tfs_buffer_alloc(ngx_uint_t cls, ngx_uint_t *huge, ngx_log_t *log)
+{
+    size_t size = ngx_http_tfs_buffer_sizes[cls];
+    u_char *p;
+
+    *huge = 0;
+
+#ifdef MAP_HUGETLB
+    if (ngx_http_tfs_buffer_hugepages && size == NGX_HTTP_TFS_BUFFER_HUGE) {
+        p = (u_char *) mmap(NULL, size, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *huge = 1;
+            return p;
+        }
+
+        // 没有预留大页时每次都会失败, 只提示一次
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                      "ngx_tfs_mods: mmap(MAP_HUGETLB) failed, using normal pages");
+        ngx_http_tfs_buffer_hugepages = 0;
+    }
+#endif
+
+    return (u_char *) ngx_memalign(ngx_pagesize, size, log);
+}
+
+static void
+ngx_http_tfs_buffer_release(u_char *data, ngx_uint_t cls, ngx_uint_t huge)
+{
+    size_t size = ngx_http_tfs_buffer_sizes[cls];
+
+    if (huge) {
+        munmap(data, size);
+    } else {
+        ngx_free(data);
+    }
+
+    ngx_http_tfs_buffer_total -= size;
+    ngx_http_tfs_stats_arena_bytes(ngx_http_tfs_buffer_total);
+}
+
+static void
+ngx_http_tfs_buffer_cleanup(void *data)
+{
+    ngx_http_tfs_buffer_t *buf = (ngx_http_tfs_buffer_t *) data;
+    ngx_http_tfs_buffer_free_t *f;
+    size_t size = ngx_http_tfs_buffer_sizes[buf->cls];
+
+    if (ngx_http_tfs_buffer_cached + size > ngx_http_tfs_buffer_max) {
+        ngx_http_tfs_buffer_release(buf->data, buf->cls, buf->huge);
+        return;
+    }
+
+    f = (ngx_http_tfs_buffer_free_t *) buf->data;
+    f->next = ngx_http_tfs_buffer_free[buf->cls];
+    f->huge = buf->huge;
+    ngx_http_tfs_buffer_free[buf->cls] = f;
+    ngx_http_tfs_buffer_cached += size;
+}
+
+/* 分配size字节的临时buffer, 请求结束时自动归还 */
+ngx_buf_t *
+ngx_http_tfs_buffer_get(ngx_http_request_t *r, size_t size)
+{
+    ngx_uint_t cls;
+    ngx_buf_t *b;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_tfs_buffer_t *buf;
+    ngx_http_tfs_buffer_free_t *f;
+
+    if (ngx_http_tfs_buffer_max == 0 || size > ngx_http_tfs_buffer_sizes[NGX_HTTP_TFS_BUFFER_CLASSES - 1]) {
+        return ngx_create_temp_buf(r->pool, size);
+    }
+
+    for (cls = 0; size > ngx_http_tfs_buffer_sizes[cls]; cls++) { /* void */ }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_tfs_buffer_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    buf = (ngx_http_tfs_buffer_t *) cln->data;
+    buf->cls = cls;
+
+    f = ngx_http_tfs_buffer_free[cls];
+    if (f != NULL) {
+        ngx_http_tfs_buffer_free[cls] = f->next;
+        ngx_http_tfs_buffer_cached -= ngx_http_tfs_buffer_sizes[cls];
+        buf->data = (u_char *) f;
+        buf->huge = f->huge;
+        ngx_http_tfs_stats_arena_get(1);
+
+    } else {
+        buf->data = ngx_http_tfs_buffer_alloc(cls, &buf->huge, r->connection->log);
+        if (buf->data == NULL) {
+            return NULL;
+        }
+        ngx_http_tfs_buffer_total += ngx_http_tfs_buffer_sizes[cls];
+        ngx_http_tfs_stats_arena_get(0);
+        ngx_http_tfs_stats_arena_bytes(ngx_http_tfs_buffer_total);
+    }
+
+    cln->handler = ngx_http_tfs_buffer_cleanup;
+
+    b->start = buf->data;
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+
+    return b;
+}
+
+void
+ngx_http_tfs_buffer_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_http_tfs_buffer_max = tmcf->buffer_arena;
+    ngx_http_tfs_buffer_hugepages = tmcf->buffer_arena_hugepages;
+}
+
+void
+ngx_http_tfs_buffer_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t cls;
+    ngx_http_tfs_buffer_free_t *f;
+
+    for (cls = 0; cls < NGX_HTTP_TFS_BUFFER_CLASSES; cls++) {
+        while (ngx_http_tfs_buffer_free[cls]) {
+            f = ngx_http_tfs_buffer_free[cls];
+            ngx_http_tfs_buffer_free[cls] = f->next;
+            ngx_http_tfs_buffer_release((u_char *) f, cls, f->huge);
+        }
+    }
+
+    ngx_http_tfs_buffer_cached = 0;
+}
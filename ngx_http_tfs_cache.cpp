@@ -0,0 +1,492 @@
+/*
+ * 共享内存对象缓存
+ *
+ * tfs文件名一旦生成内容就不会再变, 因此直接以tfsname为key缓存整个文件,
+ * 不需要做过期校验. 各worker共用一块共享内存, 按LRU淘汰.
+ * */
+#include "ngx_http_tfs_module.h"
+
+
+typedef struct {
+    ngx_rbtree_node_t node;             /* node.key为tfsname的crc32, 必需放在第一个 */
+    ngx_queue_t queue;                  /* lru队列 */
+    ngx_http_tfs_cache_stat_t st;
+    u_char name_len;
+    u_char name[NGX_HTTP_TFS_NAME_LEN];
+    u_char data[1];                     /* 文件内容, 实际长度为st.size */
+} ngx_http_tfs_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t lru;
+
+    size_t limit;                       /* 缓存内容总大小上限, 按zone大小留出slab的管理开销 */
+    size_t used;
+    ngx_uint_t count;
+
+    ngx_uint_t hits;
+    ngx_uint_t misses;
+    ngx_uint_t inserts;
+    ngx_uint_t evictions;
+} ngx_http_tfs_cache_sh_t;
+
+typedef struct {
+    ngx_http_tfs_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_tfs_cache_t;
+
+
+static void
+ngx_http_tfs_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_tfs_cache_node_t *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            cn = (ngx_http_tfs_cache_node_t *) node;
+            cnt = (ngx_http_tfs_cache_node_t *) temp;
+
+            p = (ngx_memn2cmp(cn->name, cnt->name, cn->name_len, cnt->name_len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_tfs_cache_node_t *
+ngx_http_tfs_cache_lookup(ngx_http_tfs_cache_sh_t *sh, ngx_str_t *name, uint32_t hash)
+{
+    ngx_int_t rc;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_tfs_cache_node_t *cn;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+        cn = (ngx_http_tfs_cache_node_t *) node;
+
+        rc = ngx_memn2cmp(name->data, cn->name, name->len, cn->name_len);
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* 从lru尾部淘汰一项, 调用前必需已加锁 */
+static ngx_int_t
+ngx_http_tfs_cache_evict_locked(ngx_http_tfs_cache_t *ctx)
+{
+    ngx_queue_t *q;
+    ngx_http_tfs_cache_node_t *cn;
+
+    if (ngx_queue_empty(&ctx->sh->lru)) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_last(&ctx->sh->lru);
+    cn = ngx_queue_data(q, ngx_http_tfs_cache_node_t, queue);
+
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &cn->node);
+
+    ctx->sh->used -= cn->st.size;
+    ctx->sh->count--;
+    ctx->sh->evictions++;
+
+    ngx_slab_free_locked(ctx->shpool, cn);
+
+    return NGX_OK;
+}
+
+ngx_buf_t *
+ngx_http_tfs_cache_get(ngx_shm_zone_t *zone, ngx_str_t *name,
+    ngx_http_request_t *r, ngx_http_tfs_cache_stat_t *st)
+{
+    uint32_t hash;
+    ngx_buf_t *b;
+    ngx_http_tfs_cache_t *ctx;
+    ngx_http_tfs_cache_node_t *cn;
+
+    ctx = (ngx_http_tfs_cache_t *) zone->data;
+    hash = ngx_crc32_short(name->data, name->len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    cn = ngx_http_tfs_cache_lookup(ctx->sh, name, hash);
+    if (cn == NULL) {
+        ctx->sh->misses++;
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NULL;
+    }
+
+    // 解锁后节点随时可能被淘汰, 必需在锁内拷贝出来
+    b = ngx_http_tfs_buffer_get(r, cn->st.size);
+    if (b == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NULL;
+    }
+
+    b->last = ngx_cpymem(b->pos, cn->data, cn->st.size);
+    *st = cn->st;
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&ctx->sh->lru, &cn->queue);
+    ctx->sh->hits++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return b;
+}
+
+ngx_int_t
+ngx_http_tfs_cache_put(ngx_shm_zone_t *zone, ngx_str_t *name,
+    u_char *data, ngx_http_tfs_cache_stat_t *st)
+{
+    size_t size;
+    uint32_t hash;
+    ngx_http_tfs_cache_t *ctx;
+    ngx_http_tfs_cache_node_t *cn;
+
+    if (name->len == 0 || name->len > NGX_HTTP_TFS_NAME_LEN || st->size == 0) {
+        return NGX_DECLINED;
+    }
+
+    ctx = (ngx_http_tfs_cache_t *) zone->data;
+    hash = ngx_crc32_short(name->data, name->len);
+    size = offsetof(ngx_http_tfs_cache_node_t, data) + st->size;
+
+    if (st->size > ctx->sh->limit) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    // 文件内容不可变, 已经缓存的不必重复写入
+    if (ngx_http_tfs_cache_lookup(ctx->sh, name, hash) != NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    // 先按统计的大小腾出空间, 避免slab分配失败时打出大量crit日志
+    while (ctx->sh->used + st->size > ctx->sh->limit) {
+        if (ngx_http_tfs_cache_evict_locked(ctx) != NGX_OK) {
+            break;
+        }
+    }
+
+    for ( ;; ) {
+        cn = (ngx_http_tfs_cache_node_t *) ngx_slab_alloc_locked(ctx->shpool, size);
+        if (cn != NULL) {
+            break;
+        }
+
+        if (ngx_http_tfs_cache_evict_locked(ctx) != NGX_OK) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return NGX_ERROR;
+        }
+    }
+
+    cn->node.key = hash;
+    cn->st = *st;
+    cn->name_len = (u_char) name->len;
+    ngx_memcpy(cn->name, name->data, name->len);
+    ngx_memcpy(cn->data, data, st->size);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&ctx->sh->lru, &cn->queue);
+
+    ctx->sh->used += st->size;
+    ctx->sh->count++;
+    ctx->sh->inserts++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_tfs_cache_delete(ngx_shm_zone_t *zone, ngx_str_t *name)
+{
+    uint32_t hash;
+    ngx_http_tfs_cache_t *ctx;
+    ngx_http_tfs_cache_node_t *cn;
+
+    ctx = (ngx_http_tfs_cache_t *) zone->data;
+    hash = ngx_crc32_short(name->data, name->len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    cn = ngx_http_tfs_cache_lookup(ctx->sh, name, hash);
+    if (cn == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &cn->node);
+
+    ctx->sh->used -= cn->st.size;
+    ctx->sh->count--;
+
+    ngx_slab_free_locked(ctx->shpool, cn);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return NGX_OK;
+}
+
+void
+ngx_http_tfs_cache_info(ngx_shm_zone_t *zone, ngx_http_tfs_cache_info_t *info)
+{
+    ngx_http_tfs_cache_t *ctx;
+
+    ctx = (ngx_http_tfs_cache_t *) zone->data;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    info->hits = ctx->sh->hits;
+    info->misses = ctx->sh->misses;
+    info->inserts = ctx->sh->inserts;
+    info->evictions = ctx->sh->evictions;
+    info->count = ctx->sh->count;
+    info->used = ctx->sh->used;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+ngx_int_t
+ngx_http_tfs_cache_test_type(ngx_http_request_t *r, ngx_array_t *types)
+{
+    u_char *p, *last;
+    size_t len;
+    ngx_str_t *type;
+    ngx_uint_t i;
+
+    if (types == NULL) {
+        return NGX_OK;
+    }
+
+    if (r->headers_in.content_type == NULL) {
+        return NGX_DECLINED;
+    }
+
+    // 只比较 "text/html; charset=utf-8" 中分号前的部分
+    p = r->headers_in.content_type->value.data;
+    last = p + r->headers_in.content_type->value.len;
+    for (len = 0; p + len < last && p[len] != ';' && p[len] != ' '; len++) { /* void */ }
+
+    type = (ngx_str_t *) types->elts;
+    for (i = 0; i < types->nelts; i++) {
+        if (type[i].len == 1 && type[i].data[0] == '*') {
+            return NGX_OK;
+        }
+
+        if (type[i].len == len && ngx_strncasecmp(type[i].data, p, len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_tfs_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_tfs_cache_t *octx = (ngx_http_tfs_cache_t *) data;
+    ngx_http_tfs_cache_t *ctx;
+
+    ctx = (ngx_http_tfs_cache_t *) shm_zone->data;
+
+    if (octx) {
+        // reload时沿用旧的共享内存
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = (ngx_http_tfs_cache_sh_t *) ctx->shpool->data;
+        return NGX_OK;
+    }
+
+    ctx->sh = (ngx_http_tfs_cache_sh_t *) ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_tfs_cache_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ctx->sh, sizeof(ngx_http_tfs_cache_sh_t));
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_tfs_cache_rbtree_insert_value);
+    ngx_queue_init(&ctx->sh->lru);
+
+    ctx->sh->limit = shm_zone->shm.size - shm_zone->shm.size / 8;
+
+    return NGX_OK;
+}
+
+/* tfs_cache_zone name:size */
+char *
+ngx_http_tfs_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char *p;
+    ssize_t size;
+    ngx_str_t *value, name, s;
+    ngx_shm_zone_t *shm_zone, **zonep;
+    ngx_http_tfs_cache_t *ctx;
+    ngx_http_tfs_main_conf_t *tmcf = (ngx_http_tfs_main_conf_t *) conf;
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    p = (u_char *) ngx_strchr(value[1].data, ':');
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\", must be name:size", &value[1]);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    ctx = (ngx_http_tfs_cache_t *) ngx_pcalloc(cf->pool, sizeof(ngx_http_tfs_cache_t));
+    if (ctx == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_tfs_module);
+    if (shm_zone == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_tfs_cache_init_zone;
+    shm_zone->data = ctx;
+
+    // 登记下来供tfs_status输出统计
+    zonep = (ngx_shm_zone_t **) ngx_array_push(&tmcf->cache_zones);
+    if (zonep == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+    *zonep = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+/* tfs_cache name|off, zone由tfs_cache_zone定义 */
+char *
+ngx_http_tfs_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tfs_ns_loc_conf_t *cglcf = (ngx_http_tfs_ns_loc_conf_t *) conf;
+    ngx_str_t *value;
+
+    if (cglcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return (char *) "is duplicate";
+    }
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        cglcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    cglcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_http_tfs_module);
+    if (cglcf->cache_zone == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* tfs_cache_types, tfs_precompress_types: text/css application/json ...; "*" 为不限 */
+char *
+ngx_http_tfs_cache_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_array_t **types = (ngx_array_t **) ((char *) conf + cmd->offset);
+    ngx_str_t *value, *type;
+    ngx_uint_t i;
+
+    if (*types != NGX_CONF_UNSET_PTR) {
+        return (char *) "is duplicate";
+    }
+
+    *types = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_str_t));
+    if (*types == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        type = (ngx_str_t *) ngx_array_push(*types);
+        if (type == NULL) {
+            return (char *) NGX_CONF_ERROR;
+        }
+
+        *type = value[i];
+    }
+
+    return NGX_CONF_OK;
+}
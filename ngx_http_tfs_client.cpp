@@ -0,0 +1,478 @@
+/*
+ * 按nameserver地址管理的tfs客户端
+ *
+ * libtfsclient在进程内只有一个TfsClient实例, 不同nameserver对应其中不同的session.
+ * 配置解析时把各location用到的nameserver登记下来, worker启动时统一初始化一次,
+ * 请求中只取用, 不再每次调用initialize.
+ * */
+#include "ngx_http_tfs_module.h"
+#include "fsname.h"
+#include "tfs_session.h"
+#include "tfs_session_pool.h"
+
+
+using namespace tfs::client;
+using namespace tfs::common;
+
+#define NGX_HTTP_TFS_INIT_RETRY_INTERVAL 1      /* 初始化失败后, 至少间隔多少秒再重试 */
+
+static ngx_msec_t ngx_http_tfs_current_timeout = 0;    /* 当前已设置到TfsClient的超时 */
+static ngx_msec_t ngx_http_tfs_pinned_timeout = 0;     /* 批量删除的线程运行时固定的超时 */
+static ngx_uint_t ngx_http_tfs_initialized = 0;        /* 已对某个nameserver调用过initialize */
+static ngx_http_tfs_cluster_t *ngx_http_tfs_default = NULL;    /* 当前TfsClient的默认server */
+
+
+static ngx_int_t
+ngx_http_tfs_cluster_add_warmup(ngx_conf_t *cf, ngx_http_tfs_cluster_t *cl, ngx_str_t *file)
+{
+    ngx_str_t *name;
+    ngx_uint_t i;
+
+    if (file->len == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (cl->warmup == NULL) {
+        cl->warmup = ngx_array_create(cf->pool, 1, sizeof(ngx_str_t));
+        if (cl->warmup == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    name = (ngx_str_t *) cl->warmup->elts;
+    for (i = 0; i < cl->warmup->nelts; i++) {
+        if (name[i].len == file->len && ngx_strncmp(name[i].data, file->data, file->len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    name = (ngx_str_t *) ngx_array_push(cl->warmup);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+    *name = *file;
+
+    return NGX_OK;
+}
+
+/* 在tfs_get/tfs_put/tfs_unlink的location合并配置时调用, 同一nameserver只登记一次 */
+ngx_int_t
+ngx_http_tfs_cluster_add(ngx_conf_t *cf, ngx_http_tfs_ns_loc_conf_t *conf)
+{
+    ngx_uint_t i;
+    ngx_http_tfs_cluster_t *cl, **clp;
+    ngx_http_tfs_main_conf_t *tmcf;
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_conf_get_module_main_conf(cf, ngx_http_tfs_module);
+
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+    for (i = 0; i < tmcf->clusters.nelts; i++) {
+        cl = clp[i];
+        if (cl->nsip.len != conf->tfs_nsip.len
+            || ngx_strncmp(cl->nsip.data, conf->tfs_nsip.data, conf->tfs_nsip.len) != 0)
+        {
+            continue;
+        }
+
+        if (cl->block_cache_time != conf->block_cache_time
+            || cl->block_cache_items != conf->block_cache_items
+            || cl->timeout != conf->timeout
+            || cl->max_inflight != conf->cluster_max_inflight)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "conflicting tfs client settings for nameserver \"%V\"", &conf->tfs_nsip);
+            return NGX_ERROR;
+        }
+
+        conf->cluster = cl;
+        return ngx_http_tfs_cluster_add_warmup(cf, cl, &conf->warmup);
+    }
+
+    cl = (ngx_http_tfs_cluster_t *) ngx_pcalloc(cf->pool, sizeof(ngx_http_tfs_cluster_t));
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    clp = (ngx_http_tfs_cluster_t **) ngx_array_push(&tmcf->clusters);
+    if (clp == NULL) {
+        return NGX_ERROR;
+    }
+    *clp = cl;
+
+    cl->nsip = conf->tfs_nsip;
+    cl->block_cache_time = conf->block_cache_time;
+    cl->block_cache_items = conf->block_cache_items;
+    cl->timeout = conf->timeout;
+    cl->max_inflight = conf->cluster_max_inflight;
+
+    conf->cluster = cl;
+
+    if (cl->max_inflight) {
+        // 计数区中按nameserver地址给每个nameserver一个计数
+        if (tmcf->clusters.nelts > NGX_HTTP_TFS_LIMIT_CLUSTERS) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "tfs_cluster_max_inflight supports at most %d nameservers",
+                NGX_HTTP_TFS_LIMIT_CLUSTERS);
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_tfs_limit_add_zone(cf, tmcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return ngx_http_tfs_cluster_add_warmup(cf, cl, &conf->warmup);
+}
+
+static ngx_int_t
+ngx_http_tfs_cluster_init(ngx_log_t *log, ngx_http_tfs_cluster_t *cl)
+{
+    int ret;
+    TfsClient* tfsclient = TfsClient::Instance();
+
+    cl->last_init = ngx_time();
+
+    // initialize只对第一个初始化成功的nameserver调用, 其它的通过set_default_server创建各自的session,
+    // 这样某个nameserver不可用时不影响其它nameserver
+    if (!ngx_http_tfs_initialized) {
+        ret = tfsclient->initialize((const char*)cl->nsip.data,
+                                    cl->block_cache_time, cl->block_cache_items);
+        if (ret == TFS_SUCCESS) {
+            ngx_http_tfs_initialized = 1;
+        }
+    } else {
+        ret = tfsclient->set_default_server((const char*)cl->nsip.data,
+                                            cl->block_cache_time, cl->block_cache_items);
+    }
+
+    if (ret != TFS_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "ngx_tfs_mods: init tfs client for nameserver %V failed, ret = %d", &cl->nsip, ret);
+        return NGX_ERROR;
+    }
+
+    cl->ready = 1;
+    ngx_http_tfs_default = cl;
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "ngx_tfs_mods: tfs client for nameserver %V ready", &cl->nsip);
+
+    return NGX_OK;
+}
+
+/* set_default_server会改变默认nameserver, 初始化其它nameserver后恢复为登记顺序中第一个可用的 */
+static void
+ngx_http_tfs_restore_default(ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_uint_t i;
+    ngx_http_tfs_cluster_t **clp, *first;
+
+    first = NULL;
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+    for (i = 0; i < tmcf->clusters.nelts; i++) {
+        if (clp[i]->ready) {
+            first = clp[i];
+            break;
+        }
+    }
+
+    if (first == NULL || first == ngx_http_tfs_default) {
+        return;
+    }
+
+    if (TfsClient::Instance()->set_default_server((const char*)first->nsip.data,
+            first->block_cache_time, first->block_cache_items) == TFS_SUCCESS)
+    {
+        ngx_http_tfs_default = first;
+    }
+}
+
+/* 取得已初始化好的客户端, nameserver启动时不可用的, 间隔重试 */
+TfsClient *
+ngx_http_tfs_client(ngx_http_request_t *r, ngx_http_tfs_cluster_t *cl)
+{
+    ngx_http_tfs_main_conf_t *tmcf;
+    TfsClient* tfsclient = TfsClient::Instance();
+
+    if (!cl->ready) {
+        if (ngx_time() - cl->last_init < NGX_HTTP_TFS_INIT_RETRY_INTERVAL) {
+            return NULL;
+        }
+
+        if (ngx_http_tfs_cluster_init(r->connection->log, cl) != NGX_OK) {
+            return NULL;
+        }
+
+        tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_get_module_main_conf(r, ngx_http_tfs_module);
+        ngx_http_tfs_restore_default(tmcf);
+    }
+
+    // worker是单线程的, 每次操作前设置即可做到按nameserver区分超时
+    ngx_http_tfs_client_timeout(cl->timeout);
+
+    return tfsclient;
+}
+
+/* 设置本次操作的超时, 与当前值相同时不再调用TfsClient; 超时被固定时不改变 */
+void
+ngx_http_tfs_client_timeout(ngx_msec_t timeout)
+{
+    if (ngx_http_tfs_pinned_timeout) {
+        return;
+    }
+
+    if (timeout != ngx_http_tfs_current_timeout) {
+        TfsClient::Instance()->set_wait_timeout(timeout);
+        ngx_http_tfs_current_timeout = timeout;
+    }
+}
+
+/*
+ * 其它线程在使用TfsClient时固定超时, 期间worker中的ngx_http_tfs_client_timeout不起作用.
+ * timeout为0时取消固定
+ * */
+void
+ngx_http_tfs_client_pin_timeout(ngx_msec_t timeout)
+{
+    ngx_http_tfs_pinned_timeout = timeout;
+
+    if (timeout && timeout != ngx_http_tfs_current_timeout) {
+        TfsClient::Instance()->set_wait_timeout(timeout);
+        ngx_http_tfs_current_timeout = timeout;
+    }
+}
+
+/*
+ * 预热一个nameserver: 对列表中的每个文件做一次stat,
+ * 让客户端缓存下block的位置并建好到对应dataserver的连接.
+ * 列表每行一个tfsname或block id, 可由访问日志统计生成, #开头为注释.
+ * */
+static void
+ngx_http_tfs_warmup_cluster(ngx_cycle_t *cycle, ngx_http_tfs_cluster_t *cl,
+    ngx_str_t *file, ngx_msec_t deadline)
+{
+    u_char *buf, *p, *last, *start;
+    size_t len;
+    ssize_t n;
+    ngx_fd_t fd;
+    ngx_uint_t total, ok;
+    ngx_msec_t now;
+    ngx_file_info_t fi;
+    uint32_t block_id;
+    u_char tfsname[TFS_FILE_LEN + 1];
+    TfsFileStat fstat;
+    TfsClient* tfsclient = TfsClient::Instance();
+
+    fd = ngx_open_file(file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, ngx_errno,
+            "ngx_tfs_mods: " ngx_open_file_n " warmup list \"%V\" failed", file);
+        return;
+    }
+
+    buf = NULL;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR || ngx_file_size(&fi) == 0) {
+        goto done;
+    }
+
+    len = (size_t) ngx_file_size(&fi);
+    buf = (u_char *) ngx_alloc(len, cycle->log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_fd(fd, buf, len);
+    if (n <= 0) {
+        goto done;
+    }
+
+    total = 0;
+    ok = 0;
+    p = buf;
+    last = buf + n;
+
+    while (p < last) {
+        start = p;
+        while (p < last && *p != '\n') p++;
+        len = p - start;
+        p++;
+
+        while (len && (start[len - 1] == '\r' || start[len - 1] == ' ')) len--;
+        if (len == 0 || start[0] == '#') {
+            continue;
+        }
+
+        ngx_time_update();
+        now = ngx_current_msec;
+        if (now >= deadline) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                "ngx_tfs_mods: warmup of %V stopped by tfs_warmup_time after %ui entries", file, total);
+            break;
+        }
+
+        // 单次操作的超时不超过剩余的预热时间
+        tfsclient->set_wait_timeout(ngx_min(cl->timeout, deadline - now));
+        total++;
+
+        if (ngx_atoi(start, len) != NGX_ERROR) {
+            // block id: 构造该block上的一个文件名, 文件不存在也已完成block定位和连接
+            block_id = (uint32_t) ngx_atoi(start, len);
+            FSName fsname(block_id, 0);
+            tfsclient->stat_file(&fstat, fsname.get_name(), NULL, NORMAL_STAT,
+                                 (const char*)cl->nsip.data);
+            ok++;
+            continue;
+        }
+
+        if (len > TFS_FILE_LEN) {
+            continue;
+        }
+
+        ngx_cpystrn(tfsname, start, len + 1);
+        if (tfsclient->stat_file(&fstat, (const char*)tfsname, NULL, NORMAL_STAT,
+                                 (const char*)cl->nsip.data) == TFS_SUCCESS)
+        {
+            ok++;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, cycle->log, 0,
+        "ngx_tfs_mods: warmup nameserver %V from %V: %ui entries, %ui ok", &cl->nsip, file, total, ok);
+
+done:
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", file);
+    }
+}
+
+static void
+ngx_http_tfs_warmup(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_uint_t i, j;
+    ngx_str_t *file;
+    ngx_msec_t deadline;
+    ngx_http_tfs_cluster_t **clp;
+
+    ngx_time_update();
+    deadline = ngx_current_msec + tmcf->warmup_time;
+
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+    for (i = 0; i < tmcf->clusters.nelts; i++) {
+        if (!clp[i]->ready || clp[i]->warmup == NULL) {
+            continue;
+        }
+
+        file = (ngx_str_t *) clp[i]->warmup->elts;
+        for (j = 0; j < clp[i]->warmup->nelts; j++) {
+            ngx_http_tfs_warmup_cluster(cycle, clp[i], &file[j], deadline);
+        }
+    }
+
+    // 预热时改过超时, 让下一个请求重新设置
+    ngx_http_tfs_current_timeout = 0;
+}
+
+/*
+ * 取block所在的各dataserver, 返回个数, 0为未知.
+ * block位置一般已在open时进入session的缓存, 不会再访问nameserver
+ * */
+ngx_uint_t
+ngx_http_tfs_dataservers(ngx_http_tfs_cluster_t *cl, uint32_t block_id, uint64_t *ds, ngx_uint_t max)
+{
+    ngx_uint_t i;
+    VUINT64 servers;
+    TfsSession *session;
+
+    if (cl == NULL || !cl->ready || block_id == 0) {
+        return 0;
+    }
+
+    session = TfsSessionPool::get_instance().get((const char *) cl->nsip.data,
+                                                 cl->block_cache_time, cl->block_cache_items);
+    if (session == NULL || session->get_block_info(block_id, servers, T_READ) != TFS_SUCCESS) {
+        return 0;
+    }
+
+    for (i = 0; i < servers.size() && i < max; i++) {
+        ds[i] = servers[i];
+    }
+
+    return i;
+}
+
+/* 读取该文件时客户端选用的dataserver, 0为未知 */
+uint64_t
+ngx_http_tfs_dataserver(ngx_http_tfs_cluster_t *cl, uint32_t block_id, uint64_t file_id)
+{
+    ngx_uint_t n;
+    uint64_t ds[NGX_HTTP_TFS_MAX_REPLICAS];
+
+    n = ngx_http_tfs_dataservers(cl, block_id, ds, NGX_HTTP_TFS_MAX_REPLICAS);
+    if (n == 0) {
+        return 0;
+    }
+
+    // 与TfsFile一致, 按file_id在副本中选一个
+    return ds[file_id % n];
+}
+
+ngx_int_t
+ngx_http_tfs_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_http_tfs_cluster_t **clp;
+    ngx_http_tfs_main_conf_t *tmcf;
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_cycle_get_module_main_conf(cycle, ngx_http_tfs_module);
+    if (tmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_tfs_stats_init_process(cycle, tmcf);
+    ngx_http_tfs_limit_init_process(cycle, tmcf);
+    ngx_http_tfs_buffer_init_process(cycle, tmcf);
+
+    if (tmcf->clusters.nelts == 0) {
+        return NGX_OK;
+    }
+
+    // 初始化失败不影响worker启动, 请求到来时会再重试
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+    for (i = 0; i < tmcf->clusters.nelts; i++) {
+        ngx_http_tfs_cluster_init(cycle->log, clp[i]);
+    }
+
+    ngx_http_tfs_restore_default(tmcf);
+
+    // 在开始接受请求前预热, 避免冷启动时的延迟毛刺和对nameserver的请求洪峰
+    ngx_http_tfs_warmup(cycle, tmcf);
+
+    return NGX_OK;
+}
+
+void
+ngx_http_tfs_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_tfs_main_conf_t *tmcf;
+
+    ngx_http_tfs_buffer_exit_process(cycle);
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_cycle_get_module_main_conf(cycle, ngx_http_tfs_module);
+    if (tmcf == NULL || tmcf->clusters.nelts == 0) {
+        return;
+    }
+
+    // 批量删除的线程还在使用TfsClient
+    ngx_http_tfs_unlink_exit_process(cycle);
+
+    TfsClient::Instance()->destroy();
+}
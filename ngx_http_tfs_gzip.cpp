@@ -0,0 +1,316 @@
+/*
+ * 上传时压缩保存, 读取时按Accept-Encoding直接返回或解压
+ *
+ * JSON, SVG, JS, CSS, 日志等文本通常能压缩到1/5以下. 开启tfs_precompress后,
+ * 符合类型的上传先用gzip压缩再写入tfs, 文件以".gz"为suffix创建, 返回的名字
+ * 也带上".gz"(T1xxxxxxxxxxxxxxxx.gz). GET时名字带".gz"的文件:
+ *   客户端接受gzip: 原样返回压缩后的内容, 加Content-Encoding: gzip
+ *   否则: 按gzip尾部记录的原始大小分配buffer, 解压后返回
+ * 都带Vary: Accept-Encoding. 压缩只在上传时做一次, 缓存中存的也是压缩后的内容.
+ *
+ *   tfs_precompress on|off
+ *   tfs_precompress_types text/css application/json ...; "*" 为不限, 默认为常见的文本类型
+ *   tfs_precompress_min_length 256; 更小的不压缩
+ *   tfs_precompress_level 1..9
+ *
+ * 只用已链接的zlib, 没有brotli/zstd. 压缩后没有小于原大小7/8的仍保存原文件.
+ * */
+#include "ngx_http_tfs_module.h"
+#include <zlib.h>
+
+
+/* gzip头10字节, 尾部crc32与原始大小各4字节 */
+#define NGX_HTTP_TFS_GZIP_MIN_SIZE 18
+
+static ngx_str_t ngx_http_tfs_precompress_default_types[] = {
+    ngx_string("text/plain"),
+    ngx_string("text/html"),
+    ngx_string("text/css"),
+    ngx_string("text/xml"),
+    ngx_string("text/csv"),
+    ngx_string("text/javascript"),
+    ngx_string("application/javascript"),
+    ngx_string("application/x-javascript"),
+    ngx_string("application/json"),
+    ngx_string("application/xml"),
+    ngx_string("image/svg+xml")
+};
+
+
+/* "T1xxxxxxxxxxxxxxxx.gz" 去掉后缀, 返回是否带后缀 */
+ngx_uint_t
+ngx_http_tfs_gzip_name(ngx_str_t *name)
+{
+    if (name->len == NGX_HTTP_TFS_NAME_LEN
+        && ngx_strncmp(name->data + FILE_NAME_LEN, NGX_HTTP_TFS_GZIP_SUFFIX,
+                       sizeof(NGX_HTTP_TFS_GZIP_SUFFIX) - 1) == 0)
+    {
+        name->len = FILE_NAME_LEN;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * 压缩上传的内容, 成功时out指向请求pool中压缩后的数据.
+ * 未开启, 类型不符, 太小或压缩效果不好时返回NGX_DECLINED, 由调用者保存原文件
+ * */
+ngx_int_t
+ngx_http_tfs_gzip_compress(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    u_char *data, size_t len, ngx_str_t *out)
+{
+    int rc;
+    u_char *p;
+    size_t bound;
+    z_stream zs;
+    ngx_array_t types;
+
+    if (!conf->precompress || len == 0 || len < conf->precompress_min_length
+        || len > NGX_MAX_UINT32_VALUE)
+    {
+        return NGX_DECLINED;
+    }
+
+    // 已是gzip格式的不再压缩
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        return NGX_DECLINED;
+    }
+
+    if (conf->precompress_types == NULL) {
+        types.elts = ngx_http_tfs_precompress_default_types;
+        types.nelts = sizeof(ngx_http_tfs_precompress_default_types) / sizeof(ngx_str_t);
+        if (ngx_http_tfs_cache_test_type(r, &types) != NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+    } else if (ngx_http_tfs_cache_test_type(r, conf->precompress_types) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    // windowBits加16输出gzip格式, 解压时可从尾部得到原始大小
+    rc = deflateInit2(&zs, (int) conf->precompress_level, Z_DEFLATED, MAX_WBITS + 16,
+                      MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "ngx_tfs_mods: deflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    bound = deflateBound(&zs, len);
+    p = (u_char *) ngx_pnalloc(r->pool, bound);
+    if (p == NULL) {
+        deflateEnd(&zs);
+        return NGX_ERROR;
+    }
+
+    zs.next_in = data;
+    zs.avail_in = (uInt) len;
+    zs.next_out = p;
+    zs.avail_out = (uInt) bound;
+
+    rc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "ngx_tfs_mods: deflate() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    if (zs.total_out > len - len / 8) {
+        return NGX_DECLINED;
+    }
+
+    out->data = p;
+    out->len = zs.total_out;
+
+    ngx_http_tfs_stats_precompress(len, out->len);
+
+    return NGX_OK;
+}
+
+/* Accept-Encoding中有gzip且q不为0 */
+ngx_uint_t
+ngx_http_tfs_gzip_accepted(ngx_http_request_t *r)
+{
+    u_char *p, *last;
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    part = &r->headers_in.headers.part;
+    h = (ngx_table_elt_t *) part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return 0;
+            }
+
+            part = part->next;
+            h = (ngx_table_elt_t *) part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len != sizeof("Accept-Encoding") - 1
+            || ngx_strncasecmp(h[i].key.data, (u_char *) "Accept-Encoding",
+                               sizeof("Accept-Encoding") - 1) != 0)
+        {
+            continue;
+        }
+
+        p = ngx_strcasestrn(h[i].value.data, (char *) "gzip", sizeof("gzip") - 2);
+        if (p == NULL) {
+            continue;
+        }
+
+        last = h[i].value.data + h[i].value.len;
+        p += sizeof("gzip") - 1;
+        while (p < last && *p == ' ') p++;
+
+        if (p == last || *p == ',') {
+            return 1;
+        }
+
+        if (*p != ';') {
+            continue;
+        }
+
+        // gzip;q=0 或 q=0.000 表示不接受
+        p++;
+        while (p < last && *p == ' ') p++;
+        if (last - p < 3 || p[0] != 'q' || p[1] != '=' || p[2] != '0') {
+            return 1;
+        }
+
+        for (p += 3; p < last && (*p == '.' || *p == '0'); p++) { /* void */ }
+
+        return p < last && *p >= '1' && *p <= '9';
+    }
+}
+
+static ngx_int_t
+ngx_http_tfs_gzip_header(ngx_http_request_t *r, const char *key, size_t key_len,
+    const char *value, size_t value_len, ngx_table_elt_t **ph)
+{
+    ngx_table_elt_t *h;
+
+    h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->key.len = key_len;
+    h->key.data = (u_char *) key;
+    h->value.len = value_len;
+    h->value.data = (u_char *) value;
+
+    if (ph) {
+        *ph = h;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * 准备返回压缩保存的文件: 客户端接受gzip时加Content-Encoding, 否则解压到新的buffer.
+ * HEAD不解压, 只按gzip尾部设置Content-Length. 解压buffer的预算不够时返回NGX_BUSY,
+ * 由handler保留已读到的文件后排队, 重新进入时再调用
+ * */
+ngx_int_t
+ngx_http_tfs_gzip_response(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_buf_t **pb)
+{
+    int rc;
+    u_char *p;
+    size_t len, size;
+    z_stream zs;
+    ngx_int_t accepted;
+    ngx_buf_t *b;
+
+    p = (*pb)->pos;
+    len = (*pb)->last - (*pb)->pos;
+
+    if (len < NGX_HTTP_TFS_GZIP_MIN_SIZE || p[0] != 0x1f || p[1] != 0x8b) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_tfs_mods: file with " NGX_HTTP_TFS_GZIP_SUFFIX " suffix is not gzipped");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // 上传时只压缩不超过4G的文件, 尾部记录的大小就是原始大小
+    size = (size_t) p[len - 4] | (size_t) p[len - 3] << 8
+           | (size_t) p[len - 2] << 16 | (size_t) p[len - 1] << 24;
+
+    accepted = ngx_http_tfs_gzip_accepted(r);
+
+    // 解压后的buffer同样计入tfs_buffer_budget, 排队后重新进入handler, 所以先于添加header
+    if (!accepted && r->method != NGX_HTTP_HEAD && size > 0) {
+        rc = ngx_http_tfs_budget_reserve(r, conf, len + size);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (ngx_http_tfs_gzip_header(r, "Vary", sizeof("Vary") - 1,
+                                 "Accept-Encoding", sizeof("Accept-Encoding") - 1, NULL) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (accepted) {
+        if (ngx_http_tfs_gzip_header(r, "Content-Encoding", sizeof("Content-Encoding") - 1,
+                                     "gzip", sizeof("gzip") - 1,
+                                     &r->headers_out.content_encoding) != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        r->headers_out.content_length_n = len;
+        return NGX_OK;
+    }
+
+    r->headers_out.content_length_n = size;
+
+    if (r->method == NGX_HTTP_HEAD || size == 0) {
+        return NGX_OK;
+    }
+
+    b = ngx_http_tfs_buffer_get(r, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    rc = inflateInit2(&zs, MAX_WBITS + 16);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "ngx_tfs_mods: inflateInit2() failed: %d", rc);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    zs.next_in = p;
+    zs.avail_in = (uInt) len;
+    zs.next_out = b->pos;
+    zs.avail_out = (uInt) size;
+
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (rc != Z_STREAM_END || zs.total_out != size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_tfs_mods: inflate() failed: %d, %uz of %uz bytes", rc, (size_t) zs.total_out, size);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = b->pos + size;
+    *pb = b;
+
+    ngx_http_tfs_stats_gunzip();
+
+    return NGX_OK;
+}
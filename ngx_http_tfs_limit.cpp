@@ -0,0 +1,645 @@
+/*
+ * 准入控制: 限制同时处理中的tfs请求数与缓冲的字节数, 过载时尽早拒绝
+ *
+ * TfsClient的调用是阻塞的, 一个worker同一时刻只做一次tfs操作; 但读完tfs后还在
+ * 向慢客户端发送的GET, 接收body中的PUT, 都各占着一份整文件大小的buffer. 过载时
+ * 这样的请求越积越多, 每个请求都变慢, 最终所有请求都超时.
+ *
+ *   tfs_max_inflight: 每个worker同时处理中(从进入handler到请求结束)的请求数
+ *   tfs_cluster_max_inflight: 同一nameserver在所有worker上的总数, 计数在共享内存中
+ *   tfs_buffer_budget: 所有worker上GET/PUT缓冲的文件字节数合计, 计数在共享内存中.
+ *     GET在fstat之后, PUT在读body之前按文件大小预留, 请求结束时归还. 一个文件
+ *     比整个预算还大时, 只在没有其它预留时放行, 不会永远等不到.
+ *
+ * 超过上限的请求排队, 最多tfs_queue_size个, 等待tfs_queue_timeout. 本worker有请求
+ * 结束时唤醒队首, 其它worker释放的名额靠定时重试发现. 队列满或等待超时返回503并带
+ * Retry-After. 没有名额需要排队时, 请求进入handler前已在worker中等的时间(排在阻塞
+ * 的tfs调用之后)也算在等待时间内, 已经等太久的直接拒绝, 不再占用队列; 有名额时总是
+ * 放行, 已经为它付出的等待不白费.
+ *
+ * HEAD, 单个文件的删除, 以及一次写入即可完成的小上传优先: 普通请求只能用到上限的
+ * 3/4, 排队时也先唤醒优先的请求.
+ * */
+#include "ngx_http_tfs_module.h"
+
+
+#define NGX_HTTP_TFS_LIMIT_POLL 10          /* 排队时检查其它worker释放名额的间隔, 毫秒 */
+#define NGX_HTTP_TFS_LIMIT_RETRY_AFTER "1"
+#define NGX_HTTP_TFS_LIMIT_NAME_LEN 64      /* 计数区中nameserver地址的最大长度 */
+
+/*
+ * 共享内存中的计数. 各nameserver按地址占一项, reload后nameserver的顺序变了也不会
+ * 用错计数. 每个worker还按ngx_process_slot记下自己在各项中所占的份额, 异常退出的
+ * worker没有归还的名额, 由占用同一slot的新worker启动时从总数中减去.
+ * */
+typedef struct {
+    u_char name[NGX_HTTP_TFS_LIMIT_NAME_LEN];   /* nameserver地址, 空为未用 */
+    ngx_atomic_t inflight;
+} ngx_http_tfs_limit_cluster_t;
+
+typedef struct {
+    ngx_http_tfs_limit_cluster_t clusters[NGX_HTTP_TFS_LIMIT_CLUSTERS];
+    ngx_atomic_t budget_used;                   /* 已预留的缓冲字节数 */
+    ngx_atomic_t own[NGX_MAX_PROCESSES][NGX_HTTP_TFS_LIMIT_CLUSTERS + 1];   /* 最后一项为预留字节数 */
+} ngx_http_tfs_limit_shm_t;
+
+typedef struct {
+    ngx_http_tfs_limit_shm_t *sh;
+    ngx_http_tfs_main_conf_t *tmcf;
+} ngx_http_tfs_limit_ctx_t;
+
+typedef struct {
+    ngx_queue_t queue;
+    ngx_http_request_t *r;
+    ngx_http_tfs_cluster_t *cluster;
+    ngx_uint_t max_inflight;
+    ngx_uint_t priority;
+    size_t need;                        /* 排队等待预留的字节数 */
+    size_t reserved;                    /* 已预留的字节数 */
+    ngx_msec_t deadline;
+    ngx_event_t ev;                     /* 唤醒与超时 */
+    unsigned admitted:1;
+    unsigned waiting:1;
+} ngx_http_tfs_limit_t;
+
+static ngx_str_t ngx_http_tfs_limit_zone_name = ngx_string("ngx_http_tfs_limit");
+
+static ngx_uint_t ngx_http_tfs_inflight;               /* 本worker处理中的请求数 */
+static ngx_uint_t ngx_http_tfs_nwaiting;
+static ngx_queue_t ngx_http_tfs_waiting[2];            /* 排队的请求, [1]为优先的 */
+
+static size_t ngx_http_tfs_budget;                     /* tfs_buffer_budget */
+static ngx_atomic_t *ngx_http_tfs_budget_used;         /* 共享内存中已预留的字节数 */
+static ngx_atomic_t *ngx_http_tfs_budget_own;          /* 其中本worker预留的 */
+
+static void ngx_http_tfs_limit_cleanup(void *data);
+
+
+/* 普通请求只能用到上限的3/4, 其余留给优先的请求 */
+static ngx_uint_t
+ngx_http_tfs_limit_of(ngx_uint_t max, ngx_uint_t priority)
+{
+    if (priority || max < 4) {
+        return max;
+    }
+
+    return max - max / 4;
+}
+
+static ngx_uint_t
+ngx_http_tfs_limit_slot(ngx_http_tfs_limit_t *lm)
+{
+    ngx_atomic_t *inflight;
+    ngx_uint_t max;
+
+    if (lm->admitted) {
+        return 1;
+    }
+
+    if (lm->max_inflight
+        && ngx_http_tfs_inflight >= ngx_http_tfs_limit_of(lm->max_inflight, lm->priority))
+    {
+        return 0;
+    }
+
+    inflight = lm->cluster->inflight;
+    if (inflight) {
+        max = ngx_http_tfs_limit_of(lm->cluster->max_inflight, lm->priority);
+        if ((ngx_uint_t) ngx_atomic_fetch_add(inflight, 1) >= max) {
+            (void) ngx_atomic_fetch_add(inflight, -1);
+            return 0;
+        }
+        (*lm->cluster->inflight_own)++;
+    }
+
+    ngx_http_tfs_inflight++;
+    lm->admitted = 1;
+
+    return 1;
+}
+
+static ngx_uint_t
+ngx_http_tfs_limit_budget(ngx_http_tfs_limit_t *lm)
+{
+    ngx_atomic_uint_t used;
+
+    if (lm->need == 0) {
+        return 1;
+    }
+
+    used = ngx_atomic_fetch_add(ngx_http_tfs_budget_used, (ngx_atomic_int_t) lm->need);
+    if (used != 0 && used + lm->need > ngx_http_tfs_budget) {
+        (void) ngx_atomic_fetch_add(ngx_http_tfs_budget_used, - (ngx_atomic_int_t) lm->need);
+        return 0;
+    }
+
+    *ngx_http_tfs_budget_own += lm->need;
+    lm->reserved += lm->need;
+    lm->need = 0;
+
+    return 1;
+}
+
+static ngx_uint_t
+ngx_http_tfs_limit_acquire(ngx_http_tfs_limit_t *lm)
+{
+    return ngx_http_tfs_limit_slot(lm) && ngx_http_tfs_limit_budget(lm);
+}
+
+static ngx_int_t
+ngx_http_tfs_limit_reject(ngx_http_request_t *r, const char *reason)
+{
+    ngx_table_elt_t *h;
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+        "ngx_tfs_mods: request rejected, %s, %ui in flight", reason, ngx_http_tfs_inflight);
+    ngx_http_tfs_stats_rejected();
+
+    h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
+    if (h != NULL) {
+        h->hash = 1;
+        ngx_str_set(&h->key, "Retry-After");
+        ngx_str_set(&h->value, NGX_HTTP_TFS_LIMIT_RETRY_AFTER);
+    }
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+/* 唤醒排在最前面的请求, 优先的先 */
+static void
+ngx_http_tfs_limit_wake_next()
+{
+    ngx_int_t i;
+    ngx_http_tfs_limit_t *lm;
+
+    for (i = 1; i >= 0; i--) {
+        if (ngx_http_tfs_waiting[i].next != NULL && !ngx_queue_empty(&ngx_http_tfs_waiting[i])) {
+            lm = ngx_queue_data(ngx_queue_head(&ngx_http_tfs_waiting[i]), ngx_http_tfs_limit_t, queue);
+            if (!lm->ev.posted) {
+                ngx_post_event(&lm->ev, &ngx_posted_events);
+            }
+            return;
+        }
+    }
+}
+
+static void
+ngx_http_tfs_limit_dequeue(ngx_http_tfs_limit_t *lm)
+{
+    if (!lm->waiting) {
+        return;
+    }
+
+    ngx_queue_remove(&lm->queue);
+    ngx_http_tfs_nwaiting--;
+    lm->waiting = 0;
+
+    if (lm->ev.timer_set) {
+        ngx_del_timer(&lm->ev);
+    }
+
+    if (lm->ev.posted) {
+        ngx_delete_posted_event(&lm->ev);
+    }
+}
+
+static void
+ngx_http_tfs_limit_wake(ngx_event_t *ev)
+{
+    ngx_msec_t timer;
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+    ngx_http_tfs_limit_t *lm = (ngx_http_tfs_limit_t *) ev->data;
+
+    r = lm->r;
+    c = r->connection;
+
+    if (ngx_http_tfs_limit_acquire(lm)) {
+        ngx_http_tfs_limit_dequeue(lm);
+
+        // 重新进入content handler, 这次直接放行
+        r->read_event_handler = ngx_http_block_reading;
+        r->write_event_handler = ngx_http_core_run_phases;
+        ngx_http_core_run_phases(r);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if ((ngx_msec_int_t) (lm->deadline - ngx_current_msec) <= 0) {
+        ngx_http_tfs_limit_dequeue(lm);
+        ngx_http_finalize_request(r, ngx_http_tfs_limit_reject(r, "queue timeout"));
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    timer = ngx_min(NGX_HTTP_TFS_LIMIT_POLL, lm->deadline - ngx_current_msec);
+    ngx_add_timer(&lm->ev, timer);
+}
+
+static void
+ngx_http_tfs_limit_cleanup(void *data)
+{
+    ngx_http_tfs_limit_t *lm = (ngx_http_tfs_limit_t *) data;
+    ngx_uint_t released = 0;
+
+    // 排队中客户端断开了
+    ngx_http_tfs_limit_dequeue(lm);
+
+    if (lm->reserved) {
+        (void) ngx_atomic_fetch_add(ngx_http_tfs_budget_used, - (ngx_atomic_int_t) lm->reserved);
+        *ngx_http_tfs_budget_own -= lm->reserved;
+        lm->reserved = 0;
+        released = 1;
+    }
+
+    if (lm->admitted) {
+        lm->admitted = 0;
+        ngx_http_tfs_inflight--;
+        if (lm->cluster->inflight) {
+            (void) ngx_atomic_fetch_add(lm->cluster->inflight, -1);
+            (*lm->cluster->inflight_own)--;
+        }
+        released = 1;
+    }
+
+    if (released) {
+        ngx_http_tfs_limit_wake_next();
+    }
+}
+
+static ngx_http_tfs_limit_t *
+ngx_http_tfs_limit_get(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t *cln;
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_tfs_limit_cleanup) {
+            return (ngx_http_tfs_limit_t *) cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+static ngx_http_tfs_limit_t *
+ngx_http_tfs_limit_create(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_uint_t priority)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_tfs_limit_t *lm;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_tfs_limit_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    lm = (ngx_http_tfs_limit_t *) cln->data;
+    ngx_memzero(lm, sizeof(ngx_http_tfs_limit_t));
+    lm->r = r;
+    lm->cluster = conf->cluster;
+    lm->max_inflight = conf->max_inflight;
+    lm->priority = priority ? 1 : 0;
+    cln->handler = ngx_http_tfs_limit_cleanup;
+
+    return lm;
+}
+
+static ngx_int_t
+ngx_http_tfs_limit_enqueue(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_http_tfs_limit_t *lm, ngx_msec_t timeout)
+{
+    if (timeout == 0 || ngx_http_tfs_nwaiting >= conf->queue_size) {
+        return ngx_http_tfs_limit_reject(r, "queue full");
+    }
+
+    if (ngx_http_tfs_waiting[0].next == NULL) {
+        ngx_queue_init(&ngx_http_tfs_waiting[0]);
+        ngx_queue_init(&ngx_http_tfs_waiting[1]);
+    }
+
+    ngx_queue_insert_tail(&ngx_http_tfs_waiting[lm->priority], &lm->queue);
+    ngx_http_tfs_nwaiting++;
+    lm->waiting = 1;
+    lm->deadline = ngx_current_msec + timeout;
+
+    lm->ev.handler = ngx_http_tfs_limit_wake;
+    lm->ev.data = lm;
+    lm->ev.log = r->connection->log;
+    ngx_add_timer(&lm->ev, ngx_min(NGX_HTTP_TFS_LIMIT_POLL, timeout));
+
+    // 与读取请求体一样, 增加引用计数后返回NGX_DONE, 等待期间检测客户端断开
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_DONE;
+}
+
+/*
+ * 在各handler开始访问tfs前调用. 返回NGX_OK时放行; NGX_DONE时已排队,
+ * handler直接返回NGX_DONE, 放行后会重新调用handler; 其它为应返回的状态码
+ * */
+ngx_int_t
+ngx_http_tfs_limit(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf, ngx_uint_t priority)
+{
+    ngx_msec_int_t waited;
+    ngx_time_t *tp;
+    ngx_http_tfs_limit_t *lm;
+
+    if (conf->max_inflight == 0 && conf->cluster->inflight == NULL) {
+        return NGX_OK;
+    }
+
+    lm = ngx_http_tfs_limit_get(r);
+    if (lm != NULL) {
+        return lm->admitted ? NGX_OK : NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    lm = ngx_http_tfs_limit_create(r, conf, priority);
+    if (lm == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // 有名额时直接放行, 等得再久也已经轮到了
+    if (ngx_http_tfs_limit_acquire(lm)) {
+        return NGX_OK;
+    }
+
+    // 要排队时, 在worker中已等的时间算在tfs_queue_timeout内
+    tp = ngx_timeofday();
+    waited = (ngx_msec_int_t) ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    if (waited < 0) {
+        waited = 0;
+    }
+
+    if (conf->queue_timeout && (ngx_msec_t) waited >= conf->queue_timeout) {
+        return ngx_http_tfs_limit_reject(r, "waited too long");
+    }
+
+    return ngx_http_tfs_limit_enqueue(r, conf, lm,
+                                      conf->queue_timeout ? conf->queue_timeout - waited : 0);
+}
+
+/*
+ * 在分配size字节的文件buffer前调用. 预算不够时返回NGX_BUSY, 这时handler应返回
+ * ngx_http_tfs_limit_wait()的结果; 同一请求重新进入handler时已预留的不再重复预留
+ * */
+ngx_int_t
+ngx_http_tfs_budget_reserve(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf, size_t size)
+{
+    ngx_http_tfs_limit_t *lm;
+
+    if (ngx_http_tfs_budget_used == NULL || size == 0) {
+        return NGX_OK;
+    }
+
+    lm = ngx_http_tfs_limit_get(r);
+    if (lm == NULL) {
+        lm = ngx_http_tfs_limit_create(r, conf, 0);
+        if (lm == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (lm->reserved >= size) {
+        return NGX_OK;
+    }
+
+    lm->need = size - lm->reserved;
+    if (ngx_http_tfs_limit_budget(lm)) {
+        return NGX_OK;
+    }
+
+    ngx_http_tfs_stats_budget_wait();
+
+    return NGX_BUSY;
+}
+
+/* ngx_http_tfs_budget_reserve返回NGX_BUSY后调用, 排队等预算 */
+ngx_int_t
+ngx_http_tfs_limit_wait(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf)
+{
+    ngx_http_tfs_limit_t *lm;
+
+    lm = ngx_http_tfs_limit_get(r);
+    if (lm == NULL || lm->need == 0) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_http_tfs_limit_enqueue(r, conf, lm, conf->queue_timeout);
+}
+
+void
+ngx_http_tfs_budget_info(size_t *used, size_t *budget)
+{
+    *used = ngx_http_tfs_budget_used ? (size_t) *ngx_http_tfs_budget_used : 0;
+    *budget = ngx_http_tfs_budget;
+}
+
+/* 找到nameserver对应的项, 没有时占用一个空项, 或当前配置中已不用且计数为0的项 */
+static ngx_int_t
+ngx_http_tfs_limit_zone_entry(ngx_http_tfs_limit_shm_t *sh, ngx_http_tfs_main_conf_t *tmcf,
+    ngx_str_t *nsip)
+{
+    ngx_uint_t i, j, used;
+    ngx_int_t free_entry, stale;
+    ngx_http_tfs_cluster_t **clp;
+    ngx_http_tfs_limit_cluster_t *e;
+
+    free_entry = -1;
+    stale = -1;
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+
+    for (i = 0; i < NGX_HTTP_TFS_LIMIT_CLUSTERS; i++) {
+        e = &sh->clusters[i];
+
+        if (e->name[0] == '\0') {
+            if (free_entry == -1) {
+                free_entry = (ngx_int_t) i;
+            }
+            continue;
+        }
+
+        if (ngx_strlen(e->name) == nsip->len && ngx_strncmp(e->name, nsip->data, nsip->len) == 0) {
+            return (ngx_int_t) i;
+        }
+
+        if (stale != -1 || e->inflight != 0) {
+            continue;
+        }
+
+        used = 0;
+        for (j = 0; j < tmcf->clusters.nelts; j++) {
+            if (ngx_strlen(e->name) == clp[j]->nsip.len
+                && ngx_strncmp(e->name, clp[j]->nsip.data, clp[j]->nsip.len) == 0)
+            {
+                used = 1;
+                break;
+            }
+        }
+
+        if (!used) {
+            stale = (ngx_int_t) i;
+        }
+    }
+
+    if (free_entry == -1) {
+        free_entry = stale;
+        if (free_entry == -1) {
+            return NGX_ERROR;
+        }
+    }
+
+    e = &sh->clusters[free_entry];
+    ngx_memzero(e->name, NGX_HTTP_TFS_LIMIT_NAME_LEN);
+    ngx_memcpy(e->name, nsip->data, nsip->len);
+
+    return free_entry;
+}
+
+static ngx_int_t
+ngx_http_tfs_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_uint_t i;
+    ngx_slab_pool_t *shpool;
+    ngx_http_tfs_cluster_t **clp;
+    ngx_http_tfs_limit_ctx_t *ctx, *octx;
+
+    ctx = (ngx_http_tfs_limit_ctx_t *) shm_zone->data;
+
+    // reload时沿用旧的计数, 旧worker上还在处理的请求结束时会减去
+    if (data) {
+        octx = (ngx_http_tfs_limit_ctx_t *) data;
+        ctx->sh = octx->sh;
+
+    } else {
+        shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        if (shm_zone->shm.exists) {
+            ctx->sh = (ngx_http_tfs_limit_shm_t *) shpool->data;
+
+        } else {
+            ctx->sh = (ngx_http_tfs_limit_shm_t *) ngx_slab_alloc(shpool, sizeof(ngx_http_tfs_limit_shm_t));
+            if (ctx->sh == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(ctx->sh, sizeof(ngx_http_tfs_limit_shm_t));
+            shpool->data = ctx->sh;
+        }
+    }
+
+    // 只在master中配置加载时登记, worker中只查找
+    clp = (ngx_http_tfs_cluster_t **) ctx->tmcf->clusters.elts;
+    for (i = 0; i < ctx->tmcf->clusters.nelts; i++) {
+        if (!clp[i]->max_inflight) {
+            continue;
+        }
+
+        if (clp[i]->nsip.len >= NGX_HTTP_TFS_LIMIT_NAME_LEN) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                "ngx_tfs_mods: nameserver address \"%V\" is too long for tfs_cluster_max_inflight",
+                &clp[i]->nsip);
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_tfs_limit_zone_entry(ctx->sh, ctx->tmcf, &clp[i]->nsip) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                "ngx_tfs_mods: no room for nameserver \"%V\" in tfs limit zone", &clp[i]->nsip);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* 有nameserver设置了tfs_cluster_max_inflight, 或设置了tfs_buffer_budget时分配计数区 */
+ngx_int_t
+ngx_http_tfs_limit_add_zone(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_http_tfs_limit_ctx_t *ctx;
+
+    if (tmcf->limit_zone != NULL) {
+        return NGX_OK;
+    }
+
+    ctx = (ngx_http_tfs_limit_ctx_t *) ngx_pcalloc(cf->pool, sizeof(ngx_http_tfs_limit_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->tmcf = tmcf;
+
+    tmcf->limit_zone = ngx_shared_memory_add(cf, &ngx_http_tfs_limit_zone_name,
+                                             sizeof(ngx_http_tfs_limit_shm_t) + 8 * ngx_pagesize,
+                                             &ngx_http_tfs_module);
+    if (tmcf->limit_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmcf->limit_zone->init = ngx_http_tfs_limit_init_zone;
+    tmcf->limit_zone->data = ctx;
+
+    return NGX_OK;
+}
+
+void
+ngx_http_tfs_limit_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_uint_t i, j;
+    ngx_atomic_t *own;
+    ngx_atomic_int_t left;
+    ngx_http_tfs_cluster_t **clp;
+    ngx_http_tfs_limit_shm_t *sh;
+
+    if (tmcf->limit_zone == NULL || tmcf->limit_zone->data == NULL) {
+        return;
+    }
+
+    sh = ((ngx_http_tfs_limit_ctx_t *) tmcf->limit_zone->data)->sh;
+    if (sh == NULL) {
+        return;
+    }
+
+    // 之前用这个slot的worker异常退出时没有归还的名额和预留, 从总数中减去
+    own = sh->own[ngx_process_slot];
+    for (j = 0; j <= NGX_HTTP_TFS_LIMIT_CLUSTERS; j++) {
+        left = (ngx_atomic_int_t) own[j];
+        if (left == 0) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+            "ngx_tfs_mods: reclaim %l left by previous worker in slot %i",
+            (long) left, ngx_process_slot);
+
+        if (j == NGX_HTTP_TFS_LIMIT_CLUSTERS) {
+            (void) ngx_atomic_fetch_add(&sh->budget_used, -left);
+        } else {
+            (void) ngx_atomic_fetch_add(&sh->clusters[j].inflight, -left);
+        }
+        own[j] = 0;
+    }
+
+    clp = (ngx_http_tfs_cluster_t **) tmcf->clusters.elts;
+    for (i = 0; i < tmcf->clusters.nelts; i++) {
+        if (!clp[i]->max_inflight) {
+            continue;
+        }
+
+        for (j = 0; j < NGX_HTTP_TFS_LIMIT_CLUSTERS; j++) {
+            if (ngx_strlen(sh->clusters[j].name) == clp[i]->nsip.len
+                && ngx_strncmp(sh->clusters[j].name, clp[i]->nsip.data, clp[i]->nsip.len) == 0)
+            {
+                clp[i]->inflight = &sh->clusters[j].inflight;
+                clp[i]->inflight_own = &own[j];
+                break;
+            }
+        }
+    }
+
+    if (tmcf->buffer_budget) {
+        ngx_http_tfs_budget = tmcf->buffer_budget;
+        ngx_http_tfs_budget_used = &sh->budget_used;
+        ngx_http_tfs_budget_own = &own[NGX_HTTP_TFS_LIMIT_CLUSTERS];
+    }
+}
@@ -4,46 +4,76 @@
  * help on:
  * http://www.jiajun.org/2010/10/06/nginx_module_development_part_2.html
  * */
-extern "C"{
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
-}
-#include "tfs_client_api.h"
-#include "func.h"
+#include "ngx_http_tfs_module.h"
 
 
 using namespace std;
 using namespace tfs::client;
 using namespace tfs::common;
 
-#define DEFAULT_TFS_READ_WRITE_SIZE (2 * 1024 * 1024)
-
+static void* ngx_http_tfs_create_main_conf(ngx_conf_t *cf);
+static char* ngx_http_tfs_init_main_conf(ngx_conf_t *cf, void *conf);
 static void* ngx_http_tfs_create_loc_conf(ngx_conf_t *cf);
 static char* ngx_http_tfs_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static char* ngx_http_tfs_put(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char* ngx_http_tfs_get(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_tfs_unlink(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_conf_num_bounds_t ngx_http_tfs_precompress_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 9
+};
 
-typedef struct {
-    ngx_str_t tfs_nsip;         /* 字符串不要在_create_loc_conf中初始化，在_merge_loc_conf给默认值相当初始化 */
-    size_t tfs_rb_buffer_size;
-} ngx_http_tfs_ns_loc_conf_t;
+static ngx_conf_num_bounds_t ngx_http_tfs_unlink_concurrency_bounds = {
+    ngx_conf_check_num_bounds, 1, NGX_HTTP_TFS_UNLINK_MAX_THREADS
+};
+
+static ngx_conf_num_bounds_t ngx_http_tfs_peer_load_factor_bounds = {
+    ngx_conf_check_num_bounds, 100, 1000
+};
 
 static ngx_command_t  ngx_http_tfs_commands[] = {
     { ngx_string("tfs_put"),
       NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS, /* 不带参数 */
       ngx_http_tfs_put,
-      0,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
     { ngx_string("tfs_get"),
       NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS, /* 不带参数 */
       ngx_http_tfs_get,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
+      NULL },
+
+    { ngx_string("tfs_unlink"),                /* DELETE删除单个文件, POST批量删除 */
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_tfs_unlink,
+      NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("tfs_unlink_max_names"),      /* 批量删除一次最多的文件数 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, unlink_max_names),
+      NULL },
+
+    { ngx_string("tfs_unlink_concurrency"),    /* 批量删除时同时删除的文件数(线程数) */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, unlink_concurrency),
+      &ngx_http_tfs_unlink_concurrency_bounds },
+
+    { ngx_string("tfs_unlink_timeout"),        /* 批量删除的总时间 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, unlink_timeout),
+      NULL },
+
     { ngx_string("tfs_nsip"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
       ngx_conf_set_str_slot    ,                /* 直接调用内置的字符串解释函数解释参数*/
@@ -51,6 +81,160 @@ static ngx_command_t  ngx_http_tfs_commands[] = {
       offsetof(ngx_http_tfs_ns_loc_conf_t, tfs_nsip),
       NULL },
 
+    { ngx_string("tfs_block_cache_time"),      /* 客户端block位置缓存时间 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, block_cache_time),
+      NULL },
+
+    { ngx_string("tfs_block_cache_items"),     /* 客户端block位置缓存条数 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, block_cache_items),
+      NULL },
+
+    { ngx_string("tfs_timeout"),               /* 等待nameserver/dataserver响应的超时 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, timeout),
+      NULL },
+
+    { ngx_string("tfs_breaker_failures"),      /* dataserver连续失败多少次后暂停使用, 0为不启用 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, breaker_failures),
+      NULL },
+
+    { ngx_string("tfs_breaker_timeout"),       /* 暂停多久后再试探 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, breaker_timeout),
+      NULL },
+
+    { ngx_string("tfs_breaker_skip_timeout"),  /* 首选dataserver暂停时的超时 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, breaker_skip_timeout),
+      NULL },
+
+    { ngx_string("tfs_adaptive_timeout"),      /* 按观测到的耗时p99推算超时 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, adaptive_timeout),
+      NULL },
+
+    { ngx_string("tfs_adaptive_timeout_min"),  /* 自适应超时的下限 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, adaptive_timeout_min),
+      NULL },
+
+    { ngx_string("tfs_max_inflight"),          /* 每个worker同时处理中的请求数, 0为不限 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, max_inflight),
+      NULL },
+
+    { ngx_string("tfs_cluster_max_inflight"),  /* 同一nameserver在所有worker上同时处理中的请求数 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, cluster_max_inflight),
+      NULL },
+
+    { ngx_string("tfs_queue_size"),            /* 超过上限时每个worker排队的请求数 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, queue_size),
+      NULL },
+
+    { ngx_string("tfs_queue_timeout"),         /* 排队等待的上限, 超过返回503 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, queue_timeout),
+      NULL },
+
+    { ngx_string("tfs_warmup"),                /* worker启动时预热的热点文件(tfsname或block id)列表 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, warmup),
+      NULL },
+
+    { ngx_string("tfs_warmup_time"),           /* 预热的时间上限 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, warmup_time),
+      NULL },
+
+    { ngx_string("tfs_buffer_arena"),          /* 每个worker缓存多少字节的空闲读buffer供复用, 0为不复用 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, buffer_arena),
+      NULL },
+
+    { ngx_string("tfs_buffer_arena_hugepages"), /* 2M的读buffer使用大页 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, buffer_arena_hugepages),
+      NULL },
+
+    { ngx_string("tfs_buffer_budget"),         /* 所有worker上GET/PUT缓冲的文件字节数上限 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, buffer_budget),
+      NULL },
+
+    { ngx_string("tfs_peers"),                 /* 按tfsname一致性哈希分担缓存的前端节点, 见ngx_http_tfs_peer.cpp */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_tfs_peers,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tfs_peer_self"),             /* 本节点在tfs_peers中的名字 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, peer_self),
+      NULL },
+
+    { ngx_string("tfs_peer_key"),              /* 节点间转发时X-Tfs-Peer头的值, 其它值的不当作转发来的 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, peer_key),
+      NULL },
+
+    { ngx_string("tfs_peer_load_factor"),      /* 转发到一个节点的请求数不超过平均的百分之多少 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, peer_load_factor),
+      &ngx_http_tfs_peer_load_factor_bounds },
+
+    { ngx_string("tfs_peer_fail_timeout"),     /* 转发失败后暂停使用该节点的时间 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_tfs_main_conf_t, peer_fail_timeout),
+      NULL },
+
     { ngx_string("tfs_rb_buffer_size"),        /* 每次读写tfs文件buffer大小  */
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -58,15 +242,85 @@ static ngx_command_t  ngx_http_tfs_commands[] = {
       offsetof(ngx_http_tfs_ns_loc_conf_t, tfs_rb_buffer_size),
       NULL },
 
+    { ngx_string("tfs_cache_zone"),            /* tfs_cache_zone name:size 定义共享内存缓存 */
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+      ngx_http_tfs_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("tfs_cache"),                 /* tfs_cache name|off */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_tfs_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tfs_cache_max_object_size"), /* 超过此大小的文件不进缓存 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, cache_max_object_size),
+      NULL },
+
+    { ngx_string("tfs_cache_types"),           /* 上传后写入缓存的Content-Type */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+      ngx_http_tfs_cache_types,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, cache_types),
+      NULL },
+
+    { ngx_string("tfs_precompress"),           /* 上传时gzip压缩后保存, 见ngx_http_tfs_gzip.cpp */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, precompress),
+      NULL },
+
+    { ngx_string("tfs_precompress_types"),     /* 压缩的Content-Type, 默认为常见的文本类型 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+      ngx_http_tfs_cache_types,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, precompress_types),
+      NULL },
+
+    { ngx_string("tfs_precompress_min_length"),    /* 小于此大小的不压缩 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, precompress_min_length),
+      NULL },
+
+    { ngx_string("tfs_precompress_level"),     /* gzip压缩级别 1..9 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, precompress_level),
+      &ngx_http_tfs_precompress_level_bounds },
+
+    { ngx_string("tfs_peer_location"),         /* GET转发给所有者节点的named location, off为不转发 */
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tfs_ns_loc_conf_t, peer_location),
+      NULL },
+
+    { ngx_string("tfs_status"),                /* Prometheus格式的统计输出 */
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_tfs_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 static ngx_http_module_t  ngx_http_tfs_module_ctx = {
-    NULL,                          /* preconfiguration */
+    ngx_http_tfs_add_variables,    /* preconfiguration */
     NULL,                          /* postconfiguration */
 
-    NULL,                          /* create main configuration */
-    NULL,                          /* init main configuration */
+    ngx_http_tfs_create_main_conf, /* create main configuration */
+    ngx_http_tfs_init_main_conf,   /* init main configuration */
 
     NULL,                          /* create server configuration */
     NULL,                          /* merge server configuration */
@@ -81,19 +335,20 @@ ngx_module_t  ngx_http_tfs_module = {
     ngx_http_tfs_commands,   /* module directives */
     NGX_HTTP_MODULE,               /* module type */
     NULL,                          /* init master */
-    NULL,                          /* init module */
-    NULL,                          /* init process */
+    ngx_http_tfs_init_module,      /* init module */
+    ngx_http_tfs_init_process,     /* init process  worker启动时初始化tfs客户端 */
     NULL,                          /* init thread */
     NULL,                          /* exit thread */
-    NULL,                          /* exit process */
+    ngx_http_tfs_exit_process,     /* exit process */
     NULL,                          /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 static ngx_int_t
-ngx_http_tfs_get_args_tfsname(ngx_http_request_t *r, u_char *ret)
+ngx_http_tfs_get_args_tfsname(ngx_http_request_t *r, u_char *ret, ngx_uint_t *gzip)
 {
     static const ngx_str_t TFSNAME_KEY = ngx_string("tfsname=");
+    ngx_str_t arg;
     if(!r->args.len) {
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_tfs_mods: --- > args not match! 1 %s, %zd", r->args.data, r->args.len);
         return NGX_ERROR;
@@ -103,6 +358,12 @@ ngx_http_tfs_get_args_tfsname(ngx_http_request_t *r, u_char *ret)
 
         ngx_cpystrn(ret, (r->args.data + TFSNAME_KEY.len), TFS_FILE_LEN);
         ret[TFS_FILE_LEN] = '\0';
+
+        // 名字带".gz"的是压缩保存的文件
+        arg.data = r->args.data + TFSNAME_KEY.len;
+        for (arg.len = 0; arg.data + arg.len < r->args.data + r->args.len
+             && arg.data[arg.len] != '&'; arg.len++) { /* void */ }
+        *gzip = ngx_http_tfs_gzip_name(&arg);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_tfs_mods: --- > tfs_name: %s", ret);
         return NGX_OK;
     }
@@ -110,85 +371,289 @@ ngx_http_tfs_get_args_tfsname(ngx_http_request_t *r, u_char *ret)
     return NGX_ERROR;
 }
 
+/* 从tfs读取整个文件到b中, 并校验crc */
 static ngx_int_t
-ngx_http_tfs_get_handler(ngx_http_request_t *r)
+ngx_http_tfs_read_remote(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *cglcf,
+    u_char *tfsname, const char *suffix, ngx_buf_t **pb, ngx_http_tfs_cache_stat_t *st,
+    ngx_http_tfs_ctx_t *ctx)
 {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "called:ngx_http_tfs_put_handler");
-    ngx_int_t     rc;
     ngx_buf_t    *b;
-    ngx_chain_t   out;
-    u_char tfsname[TFS_FILE_LEN + 1];
-    ngx_http_tfs_ns_loc_conf_t  *cglcf;
-
-    cglcf = (ngx_http_tfs_ns_loc_conf_t*)ngx_http_get_module_loc_conf(r, ngx_http_tfs_module);
+    ngx_int_t     rc;
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        return NGX_HTTP_NOT_ALLOWED;
-    }
-    if (r->headers_in.if_modified_since) {
-        return NGX_HTTP_NOT_MODIFIED;
+    int ret = 0;
+    int fd = -1;
+    uint64_t t, open_time, read_time, crc_time;
+    ngx_http_tfs_breaker_t br;
+    TfsClient* tfsclient = ngx_http_tfs_client(r, cglcf->cluster);
+    if (tfsclient == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
     }
 
-    if( NGX_OK != ngx_http_tfs_get_args_tfsname(r, tfsname)) {
-        return NGX_DECLINED;
+    // 按首选dataserver的状态决定本次超时, 所有副本都暂停使用时不再等待
+    if (ngx_http_tfs_breaker_read(r, cglcf, tfsname, &br) == NGX_BUSY) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
     }
 
-    int ret = 0;
-    int fd = -1;
-    TfsClient* tfsclient = TfsClient::Instance();
-    tfsclient->initialize((const char*)cglcf->tfs_nsip.data);
-
     // 打开待读写的文件
-    fd= tfsclient->open((const char*)tfsname, NULL, T_READ);
+    t = ngx_http_tfs_stats_now();
+    fd= tfsclient->open((const char*)tfsname, suffix, (const char*)cglcf->cluster->nsip.data, T_READ);
+    open_time = ngx_http_tfs_stats_lap(&t);
+    ngx_http_tfs_breaker_lap(&br, 0);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_OPEN, open_time);
+    if (ctx) {
+        ctx->remote = 1;
+        ctx->open_time = open_time;
+        ctx->ret = fd;
+        if (fd > 0) {
+            ctx->dataserver = ngx_http_tfs_breaker_dataserver(cglcf, tfsname, &br);
+        }
+    }
+    if (fd <= 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "open remote file error! ret = %d", fd);
+        ngx_http_tfs_stats_error(fd);
+        // 文件不存在等不算dataserver失败, 只看是否等满了超时
+        ngx_http_tfs_breaker_read_done(&br, 0);
+        return NGX_DECLINED;
+    }
     // 获得文件属性
     TfsFileStat fstat;
     ret = tfsclient->fstat(fd, &fstat);
+    ngx_http_tfs_breaker_lap(&br, 0);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_FSTAT, ngx_http_tfs_stats_lap(&t));
     if (ret != TFS_SUCCESS || fstat.size_ <= 0)    {
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "get remote file info error");
+        ngx_http_tfs_stats_error(ret);
+        if (ctx) {
+            ctx->ret = ret != TFS_SUCCESS ? ret : TFS_ERROR;
+        }
+        tfsclient->close(fd);
+        ngx_http_tfs_breaker_read_done(&br, 1);
         return NGX_DECLINED;
     }
 
-    b = (ngx_buf_t *)ngx_create_temp_buf(r->pool, fstat.size_);
+    // 先在tfs_buffer_budget中预留, 不够时关闭文件, 由调用者排队后重试
+    rc = ngx_http_tfs_budget_reserve(r, cglcf, fstat.size_);
+    if (rc != NGX_OK) {
+        tfsclient->close(fd);
+        return rc;
+    }
+
+    b = ngx_http_tfs_buffer_get(r, fstat.size_);
 
     if (b == NULL) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate response buffer.");
+        tfsclient->close(fd);
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    out.buf = b;
-    out.next = NULL;
     b->last = b->pos + fstat.size_ ;
-    b->memory = 1;
-    b->last_buf = 1;
 
     int read = 0;
     int read_size;
     uint32_t crc = 0;
     size_t left = fstat.size_;
-    // 读取文件
+    read_time = 0;
+    crc_time = 0;
+    ngx_http_tfs_stats_lap(&t);
+    // 读取文件, 读和crc的耗时分块累计
     while (read < fstat.size_) {
         read_size = left > cglcf->tfs_rb_buffer_size ? cglcf->tfs_rb_buffer_size : left;
+        // 用短超时跳过首选dataserver时, 第一次只读一小块, 短超时内能读完
+        if (br.skip && read_size > NGX_HTTP_TFS_BREAKER_PROBE_SIZE) {
+            read_size = NGX_HTTP_TFS_BREAKER_PROBE_SIZE;
+        }
         ret = tfsclient->read(fd, (char*)b->pos + read, read_size);
+        read_time += ngx_http_tfs_stats_lap(&t);
+        ngx_http_tfs_breaker_lap(&br, ret > 0);
+        ngx_http_tfs_breaker_restore(&br);
         if (ret < 0) {
             break;
         }
         else {
             crc = Func::crc(crc, (const char*)(b->pos + read), ret); // 对读取的文件计算crc值
+            crc_time += ngx_http_tfs_stats_lap(&t);
             read += ret;
             left -= ret;
         }
     }
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_READ, read_time);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_CRC, crc_time);
+    ngx_http_tfs_stats_bytes(read, 0);
+    if (ctx) {
+        ctx->read_time = read_time;
+        ctx->crc_time = crc_time;
+        ctx->bytes = read;
+        ctx->ret = ret < 0 ? ret : TFS_SUCCESS;
+    }
+
+    // 读完即关闭, 否则fd会一直留在TfsClient中
+    tfsclient->close(fd);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_CLOSE, ngx_http_tfs_stats_lap(&t));
+
+    if (ret < 0) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "read remote file error!");
+        ngx_http_tfs_stats_error(ret);
+        ngx_http_tfs_breaker_read_done(&br, 1);
+        return NGX_DECLINED;
+    }
 
-    if (ret < 0 || crc != fstat.crc_) {
+    if (crc != fstat.crc_) {
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "read remote file error!");
+        ngx_http_tfs_stats_crc_error();
+        if (ctx) {
+            ctx->ret = TFS_ERROR;
+        }
+        ngx_http_tfs_breaker_read_done(&br, 1);
+        return NGX_DECLINED;
+    }
+
+    ngx_http_tfs_breaker_read_done(&br, 0);
+
+    st->size = fstat.size_;
+    st->mtime = fstat.modify_time_;
+    *pb = b;
+
+    return NGX_OK;
+}
+
+/* 取handler所在location的配置, 没有登记nameserver的返回NULL */
+static ngx_http_tfs_ns_loc_conf_t *
+ngx_http_tfs_handler_conf(ngx_http_request_t *r)
+{
+    ngx_http_tfs_ns_loc_conf_t *cglcf;
+
+    cglcf = (ngx_http_tfs_ns_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_tfs_module);
+    if (cglcf->cluster == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "ngx_tfs_mods: no tfs nameserver for location of \"%V\"", &r->uri);
+        return NULL;
+    }
+
+    return cglcf;
+}
+
+static ngx_int_t
+ngx_http_tfs_get_handler(ngx_http_request_t *r)
+{
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "called:ngx_http_tfs_put_handler");
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+    ngx_str_t     name;
+    uint64_t      t;
+    ngx_uint_t    gzip;
+    u_char tfsname[TFS_FILE_LEN + 1];
+    ngx_http_tfs_ctx_t *ctx;
+    ngx_http_tfs_cache_stat_t st;
+    ngx_http_tfs_ns_loc_conf_t  *cglcf;
+
+    cglcf = ngx_http_tfs_handler_conf(r);
+    if (cglcf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+    if (r->headers_in.if_modified_since) {
+        return NGX_HTTP_NOT_MODIFIED;
+    }
+
+    if( NGX_OK != ngx_http_tfs_get_args_tfsname(r, tfsname, &gzip)) {
         return NGX_DECLINED;
     }
 
+    // 配置了tfs_peers时由所有者节点读取并缓存, 转发的请求不占本节点的处理名额
+    rc = ngx_http_tfs_peer_route(r, cglcf, tfsname);
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    // 过载时排队或拒绝, HEAD优先
+    rc = ngx_http_tfs_limit(r, cglcf, r->method == NGX_HTTP_HEAD);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    // 排队等解压buffer的预算后重新进入, 用已读到的文件, 不再重读也不重复计数
+    ctx = (ngx_http_tfs_ctx_t *) ngx_http_get_module_ctx(r, ngx_http_tfs_module);
+    if (ctx != NULL && ctx->pending != NULL) {
+        b = ctx->pending;
+        st = ctx->pending_st;
+        ctx->pending = NULL;
+        goto response;
+    }
+
+    ngx_http_tfs_stats_request(NGX_HTTP_TFS_OP_GET);
+
+    // 缓存与$tfs_name用带后缀的名字, 压缩与未压缩的不会混在一起
+    name.data = tfsname;
+    name.len = ngx_strlen(tfsname);
+    if (gzip) {
+        name.data = (u_char *) ngx_pnalloc(r->pool, NGX_HTTP_TFS_NAME_LEN);
+        if (name.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        name.len = ngx_cpymem(ngx_cpymem(name.data, tfsname, FILE_NAME_LEN), NGX_HTTP_TFS_GZIP_SUFFIX,
+                              sizeof(NGX_HTTP_TFS_GZIP_SUFFIX) - 1) - name.data;
+    }
+    b = NULL;
+    ctx = ngx_http_tfs_get_ctx(r, name.data, name.len);
+
+    // 先查共享内存缓存, 命中则不必访问tfs
+    if (cglcf->cache_zone != NULL) {
+        b = ngx_http_tfs_cache_get(cglcf->cache_zone, &name, r, &st);
+        if (b != NULL && ctx) {
+            ctx->bytes = st.size;
+        }
+    }
+
+    if (b == NULL) {
+        rc = ngx_http_tfs_read_remote(r, cglcf, tfsname, gzip ? NGX_HTTP_TFS_GZIP_SUFFIX : NULL,
+                                      &b, &st, ctx);
+        if (rc == NGX_BUSY) {
+            // 超出tfs_buffer_budget, 排队等其它请求归还
+            return ngx_http_tfs_limit_wait(r, cglcf);
+        }
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (cglcf->cache_zone != NULL && st.size <= cglcf->cache_max_object_size) {
+            ngx_http_tfs_cache_put(cglcf->cache_zone, &name, b->pos, &st);
+        }
+    }
+
+response:
+
+    r->headers_out.content_length_n = st.size;
+
+    // 压缩保存的文件, 客户端不接受gzip时解压后返回
+    if (gzip) {
+        rc = ngx_http_tfs_gzip_response(r, cglcf, &b);
+        if (rc == NGX_BUSY) {
+            // 解压buffer超出tfs_buffer_budget, 保留读到的文件, 排队后重新进入
+            ctx = ngx_http_tfs_request_ctx(r);
+            if (ctx == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            ctx->pending = b;
+            ctx->pending_st = st;
+            return ngx_http_tfs_limit_wait(r, cglcf);
+        }
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    out.buf = b;
+    out.next = NULL;
+    b->memory = 1;
+    b->last_buf = 1;
 
     r->headers_out.content_type.len = sizeof("application/octet-stream") - 1;
     r->headers_out.content_type.data = (u_char *) "application/octet-stream";
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = fstat.size_;
 
     if (r->method == NGX_HTTP_HEAD) {
         rc = ngx_http_send_header(r);
@@ -197,12 +662,16 @@ ngx_http_tfs_get_handler(ngx_http_request_t *r)
         }
     }
 
+    t = ngx_http_tfs_stats_now();
     rc = ngx_http_send_header(r);
     if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
         return rc;
     }
 
-    return ngx_http_output_filter(r, &out);
+    rc = ngx_http_output_filter(r, &out);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_SEND, ngx_http_tfs_stats_lap(&t));
+
+    return rc;
 }
 
 void ngx_http_tfs_cb_handler (ngx_http_request_t *r)
@@ -216,18 +685,48 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
     ngx_int_t     rc;
     ngx_buf_t    *b;
     ngx_chain_t   out;
+    ngx_str_t     name, data;
+    const char   *suffix;
     ngx_http_request_body_t        *rb;
+    ngx_http_tfs_cache_stat_t st;
     ngx_http_tfs_ns_loc_conf_t  *cglcf;
 
     int rb_size;
     int ret = 0;
     int fd = -1;
+    uint64_t t, open_time, write_time;
+    ngx_http_tfs_ctx_t *ctx;
+    ngx_http_tfs_breaker_t br;
 
     if (!(r->method & NGX_HTTP_POST)) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
             "ngx_tfs_mods: request method must be POST.");
         return NGX_DECLINED;
     }
+
+    cglcf = ngx_http_tfs_handler_conf(r);
+    if (cglcf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // 过载时排队或拒绝, 一次写入即可完成的小文件优先
+    rc = ngx_http_tfs_limit(r, cglcf, r->headers_in.content_length_n >= 0
+                            && (size_t) r->headers_in.content_length_n <= cglcf->tfs_rb_buffer_size);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    // 读body前按文件大小在tfs_buffer_budget中预留
+    if (r->headers_in.content_length_n > 0) {
+        rc = ngx_http_tfs_budget_reserve(r, cglcf, r->headers_in.content_length_n);
+        if (rc == NGX_BUSY) {
+            return ngx_http_tfs_limit_wait(r, cglcf);
+        }
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
     //  必需先调用到个回调，读body数据
     rc = ngx_http_read_client_request_body(r, ngx_http_tfs_cb_handler);
 
@@ -237,13 +736,12 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
         return NGX_HTTP_BAD_REQUEST;
     }
 
-    // 创建tfs客户端，并打开一个新的文件准备写入
-    TfsClient* tfsclient = TfsClient::Instance();
+    // 取得worker启动时已初始化的tfs客户端，并打开一个新的文件准备写入
+    TfsClient* tfsclient = ngx_http_tfs_client(r, cglcf->cluster);
+    if (tfsclient == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
 
-    cglcf = (ngx_http_tfs_ns_loc_conf_t*)ngx_http_get_module_loc_conf(r, ngx_http_tfs_module);
-    //应该不必每次调用 init
-    tfsclient->initialize((const char*)cglcf->tfs_nsip.data);
-    fd = tfsclient->open((char*)NULL, NULL, NULL, T_WRITE);
     rb = r->request_body;
     rb_size = rb->buf->last - rb->buf->pos;
 
@@ -253,15 +751,54 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
         return NGX_HTTP_BAD_REQUEST;
     }
 
+    // 开启tfs_precompress时文本类的内容压缩后保存, 文件以".gz"为suffix
+    data.data = rb->buf->pos;
+    data.len = rb_size;
+    suffix = NULL;
+    if (!rb->buf->in_file) {
+        rc = ngx_http_tfs_gzip_compress(r, cglcf, rb->buf->pos, rb_size, &data);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (rc == NGX_OK) {
+            suffix = NGX_HTTP_TFS_GZIP_SUFFIX;
+            rb_size = data.len;
+        }
+    }
+
+    ngx_http_tfs_stats_request(NGX_HTTP_TFS_OP_PUT);
+    ngx_http_tfs_breaker_write(cglcf, &br);
+
+    t = ngx_http_tfs_stats_now();
+    fd = tfsclient->open((char*)NULL, suffix, (const char*)cglcf->cluster->nsip.data, T_WRITE);
+    open_time = ngx_http_tfs_stats_lap(&t);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_OPEN, open_time);
+    // 写入前还不知道文件名, 提交成功后再记下
+    ctx = ngx_http_tfs_get_ctx(r, NULL, 0);
+    if (ctx) {
+        ctx->remote = 1;
+        ctx->open_time = open_time;
+        ctx->ret = fd;
+    }
+    if (fd <= 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_tfs_mods: open tfs file for write error! ret = %d", fd);
+        ngx_http_tfs_stats_error(fd);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
     int wrote = 0;
     size_t left = rb_size;
     int wrote_size;
     char tfs_file_name[TFS_FILE_LEN];
 
+    write_time = 0;
+    ngx_http_tfs_stats_lap(&t);
     while (wrote < rb_size) {
         wrote_size = left > cglcf->tfs_rb_buffer_size ? cglcf->tfs_rb_buffer_size : left;
         // 将buffer中的数据写入tfs
-        ret = tfsclient->write(fd, (char*)(rb->buf->pos + wrote), wrote_size);
+        ret = tfsclient->write(fd, (char*)(data.data + wrote), wrote_size);
+        write_time += ngx_http_tfs_stats_lap(&t);
         if (ret < 0 || ret >= (int)left) {
             // 读写失败或完成
             break;
@@ -273,22 +810,36 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
         }
     }
 
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_WRITE, write_time);
+    if (ctx) {
+        ctx->ret = ret < 0 ? ret : TFS_SUCCESS;
+    }
+
     // 读写失败
     if (ret < 0) {
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "write data error!");
+        ngx_http_tfs_stats_error(ret);
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
     // 提交写入
     ret = tfsclient->close(fd, tfs_file_name, TFS_FILE_LEN);
+    ngx_http_tfs_stats_observe(NGX_HTTP_TFS_PHASE_CLOSE, ngx_http_tfs_stats_lap(&t));
+    ngx_http_tfs_breaker_write_done(cglcf, &br, ret != TFS_SUCCESS);
 
     if (ret != TFS_SUCCESS)    {
         // 提交失败
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "ngx_tfs_mods: upload file error! ret =%d ", ret);
+        ngx_http_tfs_stats_error(ret);
+        if (ctx) {
+            ctx->ret = ret;
+        }
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
     else {
-        b = ngx_create_temp_buf(r->pool, TFS_FILE_LEN);
+        ngx_http_tfs_stats_bytes(0, rb_size);
+
+        b = ngx_create_temp_buf(r->pool, NGX_HTTP_TFS_NAME_LEN);
 
         if (b == NULL) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -296,22 +847,42 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        ngx_cpystrn(b->pos, (u_char*)tfs_file_name, TFS_FILE_LEN);
+        // 压缩保存的文件返回带后缀的名字, 读取时据此解压
+        b->last = ngx_cpymem(b->pos, tfs_file_name, ngx_strlen(tfs_file_name));
+        if (suffix != NULL) {
+            b->last = ngx_cpymem(b->last, suffix, sizeof(NGX_HTTP_TFS_GZIP_SUFFIX) - 1);
+        }
         //b->temporary = 1;
         b->memory = 1;
         b->last_buf = 1;
-        b->last = b->pos + TFS_FILE_LEN;
+
+        if (ctx) {
+            ngx_http_tfs_get_ctx(r, b->pos, b->last - b->pos);
+            ctx->bytes = rb_size;
+        }
 
         out.buf = b;
         out.next = NULL;
 
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "write remote file:%s", (u_char*)b->pos);
+
+        // 刚上传的文件马上会被读取, 直接写入缓存, 避免读请求再回到dataserver
+        if (cglcf->cache_zone != NULL && !rb->buf->in_file
+            && (size_t) rb_size <= cglcf->cache_max_object_size
+            && ngx_http_tfs_cache_test_type(r, cglcf->cache_types) == NGX_OK)
+        {
+            name.data = b->pos;
+            name.len = b->last - b->pos;
+            st.size = rb_size;
+            st.mtime = ngx_time();
+            ngx_http_tfs_cache_put(cglcf->cache_zone, &name, data.data, &st);
+        }
     }
 
     r->headers_out.content_type.len = sizeof("text/html") - 1;
     r->headers_out.content_type.data = (u_char *) "text/html";
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = FILE_NAME_LEN;
+    r->headers_out.content_length_n = b->last - b->pos;
 
     rc = ngx_http_send_header(r);
 
@@ -325,6 +896,321 @@ ngx_http_tfs_put_handler(ngx_http_request_t *r)
     return NGX_OK;
 }
 
+/* 检查要删除的名字, 把不带.gz后缀的部分复制到tfsname */
+ngx_int_t
+ngx_http_tfs_unlink_parse(ngx_str_t *name, u_char *tfsname, ngx_uint_t *gzip)
+{
+    ngx_str_t key;
+
+    if (name->len == 0 || name->len > NGX_HTTP_TFS_NAME_LEN) {
+        return NGX_ERROR;
+    }
+    ngx_cpystrn(tfsname, name->data, name->len + 1);
+
+    // 压缩保存的文件, 后缀作为suffix传给tfs
+    key.data = tfsname;
+    key.len = name->len;
+    *gzip = ngx_http_tfs_gzip_name(&key);
+    if (!*gzip && key.len > TFS_FILE_LEN) {
+        return NGX_ERROR;
+    }
+    tfsname[key.len] = '\0';
+
+    return NGX_OK;
+}
+
+/* 删除完成后在worker中记录统计并清掉本地缓存, tfsname为parse的结果 */
+void
+ngx_http_tfs_unlink_done(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *cglcf,
+    ngx_str_t *name, u_char *tfsname, ngx_uint_t gzip, int ret)
+{
+    ngx_str_t key;
+
+    ngx_http_tfs_stats_request(NGX_HTTP_TFS_OP_UNLINK);
+
+    if (ret != TFS_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_tfs_mods: unlink %V failed, ret = %d", name, ret);
+        ngx_http_tfs_stats_error(ret);
+    }
+
+    // 不论删除是否成功都让缓存失效, 下次读取以tfs为准; 带与不带后缀的名字都可能在缓存中
+    if (cglcf->cache_zone != NULL) {
+        key.data = tfsname;
+        key.len = gzip ? FILE_NAME_LEN : ngx_strlen(tfsname);
+        ngx_http_tfs_cache_delete(cglcf->cache_zone, &key);
+        if (key.len == FILE_NAME_LEN) {
+            ngx_memcpy(tfsname + FILE_NAME_LEN, NGX_HTTP_TFS_GZIP_SUFFIX, sizeof(NGX_HTTP_TFS_GZIP_SUFFIX));
+            key.len = NGX_HTTP_TFS_NAME_LEN;
+            ngx_http_tfs_cache_delete(cglcf->cache_zone, &key);
+        }
+    }
+}
+
+/* 文件不存在或已删除, 重试也没有用; 其它错误可能是超时或网络问题 */
+static ngx_uint_t
+ngx_http_tfs_unlink_gone(int ret)
+{
+    return ret == EXIT_META_NOT_FOUND_ERROR || ret == EXIT_FILE_STATUS_ERROR
+           || ret == EXIT_NO_LOGICBLOCK_ERROR || ret == EXIT_BLOCK_NOT_FOUND;
+}
+
+/* ?action=delete|undelete|conceal|reveal, 默认delete */
+static ngx_int_t
+ngx_http_tfs_unlink_action(ngx_http_request_t *r, TfsUnlinkType *action)
+{
+    ngx_str_t value;
+
+    *action = DELETE;
+    if (ngx_http_arg(r, (u_char *) "action", sizeof("action") - 1, &value) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (value.len == 6 && ngx_strncasecmp(value.data, (u_char *) "delete", 6) == 0) {
+        *action = DELETE;
+    } else if (value.len == 8 && ngx_strncasecmp(value.data, (u_char *) "undelete", 8) == 0) {
+        *action = UNDELETE;
+    } else if (value.len == 7 && ngx_strncasecmp(value.data, (u_char *) "conceal", 7) == 0) {
+        *action = CONCEAL;
+    } else if (value.len == 6 && ngx_strncasecmp(value.data, (u_char *) "reveal", 6) == 0) {
+        *action = REVEAL;
+    } else {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_tfs_unlink_send(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t     rc;
+    ngx_chain_t   out;
+
+    b->memory = 1;
+    b->last_buf = 1;
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.content_type.len = sizeof("text/plain") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/plain";
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* 把请求体(可能部分在临时文件中)读到一块连续内存 */
+static ngx_int_t
+ngx_http_tfs_read_body(ngx_http_request_t *r, ngx_str_t *body)
+{
+    u_char       *p;
+    size_t        len;
+    ssize_t       n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    body->len = 0;
+    body->data = NULL;
+
+    if (r->request_body == NULL || r->request_body->bufs == NULL) {
+        return NGX_OK;
+    }
+
+    len = 0;
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        b = cl->buf;
+        len += b->in_file ? (size_t) (b->file_last - b->file_pos) : (size_t) (b->last - b->pos);
+    }
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    body->data = p;
+
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->in_file) {
+            n = ngx_read_file(b->file, p, (size_t) (b->file_last - b->file_pos), b->file_pos);
+            if (n != b->file_last - b->file_pos) {
+                return NGX_ERROR;
+            }
+            p += n;
+
+        } else {
+            p = ngx_cpymem(p, b->pos, b->last - b->pos);
+        }
+    }
+
+    body->len = p - body->data;
+
+    return NGX_OK;
+}
+
+/*
+ * 批量删除, 请求体为以空白或逗号分隔的tfsname列表, 每个文件返回一行: tfsname ret file_size.
+ * 删除在ngx_http_tfs_unlink.cpp的线程中进行, 超过tfs_unlink_timeout时只返回已处理的文件
+ * */
+static ngx_int_t
+ngx_http_tfs_unlink_batch(ngx_http_request_t *r)
+{
+    u_char       *p, *last, *start;
+    ngx_str_t     body, *name;
+    ngx_array_t   names;
+    TfsUnlinkType action;
+    ngx_http_tfs_ns_loc_conf_t  *cglcf;
+
+    cglcf = (ngx_http_tfs_ns_loc_conf_t*)ngx_http_get_module_loc_conf(r, ngx_http_tfs_module);
+
+    if (ngx_http_tfs_unlink_action(r, &action) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_tfs_read_body(r, &body) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_array_init(&names, r->pool, 64, sizeof(ngx_str_t)) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = body.data;
+    last = body.data + body.len;
+    while (p < last) {
+        while (p < last && (*p == ',' || isspace(*p))) p++;
+        if (p == last) break;
+        start = p;
+        while (p < last && *p != ',' && !isspace(*p)) p++;
+
+        // 超过上限直接拒绝, 避免一个请求长时间占用tfs
+        if (names.nelts == cglcf->unlink_max_names) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_tfs_mods: too many names to unlink, max %ui", cglcf->unlink_max_names);
+            return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+        }
+
+        name = (ngx_str_t *) ngx_array_push(&names);
+        if (name == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        name->data = start;
+        name->len = p - start;
+    }
+
+    if (names.nelts == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    // 在worker中初始化客户端并设置超时, 线程中直接使用
+    if (ngx_http_tfs_client(r, cglcf->cluster) == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    return ngx_http_tfs_unlink_batch_start(r, cglcf, &names, action);
+}
+
+static void
+ngx_http_tfs_unlink_body_handler(ngx_http_request_t *r)
+{
+    ngx_http_finalize_request(r, ngx_http_tfs_unlink_batch(r));
+}
+
+static ngx_int_t
+ngx_http_tfs_unlink_handler(ngx_http_request_t *r)
+{
+    ngx_int_t     rc;
+    int           ret;
+    int64_t       file_size;
+    ngx_buf_t    *b;
+    ngx_str_t     name;
+    ngx_uint_t    gzip;
+    ngx_table_elt_t *h;
+    TfsUnlinkType action;
+    TfsClient    *tfsclient;
+    ngx_http_tfs_ns_loc_conf_t  *cglcf;
+    u_char        tfsname[NGX_HTTP_TFS_NAME_LEN + 1];
+
+    if (!(r->method & (NGX_HTTP_POST|NGX_HTTP_DELETE))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    cglcf = ngx_http_tfs_handler_conf(r);
+    if (cglcf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    // 过载时排队或拒绝, 单个文件的删除优先
+    rc = ngx_http_tfs_limit(r, cglcf, r->method & NGX_HTTP_DELETE);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (r->method & NGX_HTTP_POST) {
+        // 批量删除, 必需等请求体读完后在回调中处理
+        rc = ngx_http_read_client_request_body(r, ngx_http_tfs_unlink_body_handler);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+        return NGX_DONE;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "tfsname", sizeof("tfsname") - 1, &name) != NGX_OK
+        || ngx_http_tfs_unlink_action(r, &action) != NGX_OK
+        || ngx_http_tfs_unlink_parse(&name, tfsname, &gzip) != NGX_OK)
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    tfsclient = ngx_http_tfs_client(r, cglcf->cluster);
+    if (tfsclient == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    file_size = 0;
+    ret = tfsclient->unlink(file_size, (const char*)tfsname, gzip ? NGX_HTTP_TFS_GZIP_SUFFIX : NULL,
+                            (const char*)cglcf->cluster->nsip.data, action);
+    ngx_http_tfs_unlink_done(r, cglcf, &name, tfsname, gzip, ret);
+
+    // 只有确定不存在时返回404, 超时等错误让调用者重试
+    if (ret != TFS_SUCCESS) {
+        if (ngx_http_tfs_unlink_gone(ret)) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
+        if (h != NULL) {
+            h->hash = 1;
+            ngx_str_set(&h->key, "Retry-After");
+            ngx_str_set(&h->value, "1");
+        }
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    b = ngx_create_temp_buf(r->pool, NGX_INT64_LEN + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    b->last = ngx_sprintf(b->last, "%L\n", file_size);
+
+    return ngx_http_tfs_unlink_send(r, b);
+}
+
 static char *
 ngx_http_tfs_put(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -334,6 +1220,7 @@ ngx_http_tfs_put(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     clcf = reinterpret_cast<ngx_http_core_loc_conf_t*>(
                 ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
     clcf->handler = ngx_http_tfs_put_handler;
+    ((ngx_http_tfs_ns_loc_conf_t *) conf)->enabled = 1;
 
     return NGX_CONF_OK;
 }
@@ -347,6 +1234,74 @@ ngx_http_tfs_get(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     clcf = reinterpret_cast<ngx_http_core_loc_conf_t*>(
                 ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
     clcf->handler = ngx_http_tfs_get_handler;
+    ((ngx_http_tfs_ns_loc_conf_t *) conf)->enabled = 1;
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_tfs_unlink(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = reinterpret_cast<ngx_http_core_loc_conf_t*>(
+                ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+    clcf->handler = ngx_http_tfs_unlink_handler;
+    ((ngx_http_tfs_ns_loc_conf_t *) conf)->enabled = 1;
+    return NGX_CONF_OK;
+}
+
+static void *
+ngx_http_tfs_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_tfs_main_conf_t  *conf;
+
+    conf = (ngx_http_tfs_main_conf_t *)ngx_pcalloc(cf->pool, sizeof(ngx_http_tfs_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->clusters, cf->pool, 4, sizeof(ngx_http_tfs_cluster_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->cache_zones, cf->pool, 4, sizeof(ngx_shm_zone_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    conf->warmup_time = NGX_CONF_UNSET_MSEC;
+    conf->buffer_arena = NGX_CONF_UNSET_SIZE;
+    conf->buffer_arena_hugepages = NGX_CONF_UNSET;
+    conf->buffer_budget = NGX_CONF_UNSET_SIZE;
+    conf->peer_load_factor = NGX_CONF_UNSET_UINT;
+    conf->peer_fail_timeout = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+static char *
+ngx_http_tfs_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_tfs_main_conf_t *tmcf = (ngx_http_tfs_main_conf_t *)conf;
+
+    ngx_conf_init_msec_value(tmcf->warmup_time, DEFAULT_TFS_WARMUP_TIME);
+    ngx_conf_init_size_value(tmcf->buffer_arena, DEFAULT_TFS_BUFFER_ARENA);
+    ngx_conf_init_value(tmcf->buffer_arena_hugepages, 0);
+    ngx_conf_init_size_value(tmcf->buffer_budget, DEFAULT_TFS_BUFFER_BUDGET);
+    ngx_conf_init_uint_value(tmcf->peer_load_factor, DEFAULT_TFS_PEER_LOAD_FACTOR);
+    ngx_conf_init_value(tmcf->peer_fail_timeout, DEFAULT_TFS_PEER_FAIL_TIMEOUT);
+
+    if (ngx_http_tfs_stats_add_zone(cf, tmcf) != NGX_OK) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    if (tmcf->buffer_budget && ngx_http_tfs_limit_add_zone(cf, tmcf) != NGX_OK) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_tfs_peer_init(cf, tmcf) != NGX_OK) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -362,6 +1317,28 @@ ngx_http_tfs_create_loc_conf(ngx_conf_t *cf)
     }
 
     conf->tfs_rb_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->cache_zone = (ngx_shm_zone_t *) NGX_CONF_UNSET_PTR;
+    conf->cache_max_object_size = NGX_CONF_UNSET_SIZE;
+    conf->cache_types = (ngx_array_t *) NGX_CONF_UNSET_PTR;
+    conf->precompress = NGX_CONF_UNSET;
+    conf->precompress_types = (ngx_array_t *) NGX_CONF_UNSET_PTR;
+    conf->precompress_min_length = NGX_CONF_UNSET_SIZE;
+    conf->precompress_level = NGX_CONF_UNSET;
+    conf->unlink_max_names = NGX_CONF_UNSET_UINT;
+    conf->unlink_concurrency = NGX_CONF_UNSET_UINT;
+    conf->unlink_timeout = NGX_CONF_UNSET_MSEC;
+    conf->block_cache_time = NGX_CONF_UNSET;
+    conf->block_cache_items = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->breaker_failures = NGX_CONF_UNSET_UINT;
+    conf->breaker_timeout = NGX_CONF_UNSET;
+    conf->breaker_skip_timeout = NGX_CONF_UNSET_MSEC;
+    conf->adaptive_timeout = NGX_CONF_UNSET;
+    conf->adaptive_timeout_min = NGX_CONF_UNSET_MSEC;
+    conf->max_inflight = NGX_CONF_UNSET_UINT;
+    conf->cluster_max_inflight = NGX_CONF_UNSET_UINT;
+    conf->queue_size = NGX_CONF_UNSET_UINT;
+    conf->queue_timeout = NGX_CONF_UNSET_MSEC;
 
     return conf;
 }
@@ -375,6 +1352,64 @@ ngx_http_tfs_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->tfs_nsip, prev->tfs_nsip, "127.0.0.1:10000");
     ngx_conf_merge_size_value(conf->tfs_rb_buffer_size, prev->tfs_rb_buffer_size, (size_t)DEFAULT_TFS_READ_WRITE_SIZE);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_size_value(conf->cache_max_object_size, prev->cache_max_object_size,
+                              (size_t)DEFAULT_TFS_CACHE_MAX_OBJECT_SIZE);
+    ngx_conf_merge_ptr_value(conf->cache_types, prev->cache_types, NULL);
+    ngx_conf_merge_value(conf->precompress, prev->precompress, 0);
+    ngx_conf_merge_ptr_value(conf->precompress_types, prev->precompress_types, NULL);
+    ngx_conf_merge_size_value(conf->precompress_min_length, prev->precompress_min_length,
+                              DEFAULT_TFS_PRECOMPRESS_MIN_LENGTH);
+    ngx_conf_merge_value(conf->precompress_level, prev->precompress_level,
+                         DEFAULT_TFS_PRECOMPRESS_LEVEL);
+    ngx_conf_merge_uint_value(conf->unlink_max_names, prev->unlink_max_names,
+                              DEFAULT_TFS_UNLINK_MAX_NAMES);
+    ngx_conf_merge_uint_value(conf->unlink_concurrency, prev->unlink_concurrency,
+                              DEFAULT_TFS_UNLINK_CONCURRENCY);
+    ngx_conf_merge_msec_value(conf->unlink_timeout, prev->unlink_timeout,
+                              DEFAULT_TFS_UNLINK_TIMEOUT);
+    ngx_conf_merge_sec_value(conf->block_cache_time, prev->block_cache_time,
+                             DEFAULT_TFS_BLOCK_CACHE_TIME);
+    ngx_conf_merge_uint_value(conf->block_cache_items, prev->block_cache_items,
+                              DEFAULT_TFS_BLOCK_CACHE_ITEMS);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, DEFAULT_TFS_TIMEOUT);
+    ngx_conf_merge_str_value(conf->warmup, prev->warmup, "");
+    ngx_conf_merge_uint_value(conf->breaker_failures, prev->breaker_failures,
+                              DEFAULT_TFS_BREAKER_FAILURES);
+    ngx_conf_merge_sec_value(conf->breaker_timeout, prev->breaker_timeout,
+                             DEFAULT_TFS_BREAKER_TIMEOUT);
+    ngx_conf_merge_msec_value(conf->breaker_skip_timeout, prev->breaker_skip_timeout,
+                              DEFAULT_TFS_BREAKER_SKIP_TIMEOUT);
+    ngx_conf_merge_value(conf->adaptive_timeout, prev->adaptive_timeout, 0);
+    ngx_conf_merge_msec_value(conf->adaptive_timeout_min, prev->adaptive_timeout_min,
+                              DEFAULT_TFS_ADAPTIVE_TIMEOUT_MIN);
+    ngx_conf_merge_uint_value(conf->max_inflight, prev->max_inflight, 0);
+    ngx_conf_merge_uint_value(conf->cluster_max_inflight, prev->cluster_max_inflight, 0);
+    ngx_conf_merge_uint_value(conf->queue_size, prev->queue_size, DEFAULT_TFS_QUEUE_SIZE);
+    ngx_conf_merge_msec_value(conf->queue_timeout, prev->queue_timeout, DEFAULT_TFS_QUEUE_TIMEOUT);
+    ngx_conf_merge_str_value(conf->peer_location, prev->peer_location, "");
+
+    if (conf->peer_location.len == 3
+        && ngx_strncmp(conf->peer_location.data, "off", 3) == 0)
+    {
+        conf->peer_location.len = 0;
+    }
+
+    if (conf->peer_location.len && conf->peer_location.data[0] != '@') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "tfs_peer_location \"%V\" is not a named location", &conf->peer_location);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    // if块和嵌套location中的请求仍由外层tfs_get/tfs_put/tfs_unlink的handler处理
+    if (prev->enabled) {
+        conf->enabled = 1;
+    }
+
+    // 只登记真正处理tfs请求的location用到的nameserver
+    if (conf->enabled && ngx_http_tfs_cluster_add(cf, conf) != NGX_OK) {
+        return (char *) NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
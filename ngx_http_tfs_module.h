@@ -0,0 +1,299 @@
+/*
+ * ngx_http_tfs_module 各源文件共用的定义
+ * */
+#ifndef _NGX_HTTP_TFS_MODULE_H_INCLUDED_
+#define _NGX_HTTP_TFS_MODULE_H_INCLUDED_
+
+extern "C"{
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+}
+#include "tfs_client_api.h"
+#include "func.h"
+
+
+#define DEFAULT_TFS_READ_WRITE_SIZE (2 * 1024 * 1024)
+#define DEFAULT_TFS_CACHE_MAX_OBJECT_SIZE (1024 * 1024)
+#define DEFAULT_TFS_UNLINK_MAX_NAMES 1000
+#define DEFAULT_TFS_UNLINK_CONCURRENCY 8
+#define NGX_HTTP_TFS_UNLINK_MAX_THREADS 64      /* tfs_unlink_concurrency的上限 */
+#define DEFAULT_TFS_UNLINK_TIMEOUT 10000
+#define DEFAULT_TFS_BLOCK_CACHE_TIME 300
+#define DEFAULT_TFS_BLOCK_CACHE_ITEMS 500
+#define DEFAULT_TFS_TIMEOUT 3000
+#define DEFAULT_TFS_WARMUP_TIME 5000
+#define DEFAULT_TFS_BREAKER_FAILURES 5
+#define DEFAULT_TFS_BREAKER_TIMEOUT 10
+#define DEFAULT_TFS_BREAKER_SKIP_TIMEOUT 50
+#define DEFAULT_TFS_ADAPTIVE_TIMEOUT_MIN 100
+#define DEFAULT_TFS_QUEUE_SIZE 64
+#define DEFAULT_TFS_QUEUE_TIMEOUT 1000
+#define DEFAULT_TFS_BUFFER_ARENA 0
+#define DEFAULT_TFS_BUFFER_BUDGET 0
+#define DEFAULT_TFS_PRECOMPRESS_MIN_LENGTH 256
+#define DEFAULT_TFS_PRECOMPRESS_LEVEL 6
+#define DEFAULT_TFS_PEER_LOAD_FACTOR 125
+#define DEFAULT_TFS_PEER_FAIL_TIMEOUT 10
+
+/* 压缩保存的文件以".gz"为suffix, 名字为 T1xxxxxxxxxxxxxxxx.gz */
+#define NGX_HTTP_TFS_GZIP_SUFFIX ".gz"
+#define NGX_HTTP_TFS_NAME_LEN (FILE_NAME_LEN + sizeof(NGX_HTTP_TFS_GZIP_SUFFIX) - 1)
+
+#define NGX_HTTP_TFS_MAX_REPLICAS 8
+#define NGX_HTTP_TFS_LATENCY_BUCKETS 18     /* 2^7 ~ 2^24 微秒 */
+#define NGX_HTTP_TFS_BREAKER_PROBE_SIZE 65536   /* 跳过首选dataserver时第一次read的大小 */
+#define NGX_HTTP_TFS_LIMIT_CLUSTERS 64      /* 设置了tfs_cluster_max_inflight的nameserver最多个数 */
+#define NGX_HTTP_TFS_PEER_MAX 256           /* tfs_peers最多的节点数 */
+
+/* 统计的各阶段, 见ngx_http_tfs_stats.cpp */
+#define NGX_HTTP_TFS_PHASE_OPEN  0
+#define NGX_HTTP_TFS_PHASE_FSTAT 1
+#define NGX_HTTP_TFS_PHASE_READ  2
+#define NGX_HTTP_TFS_PHASE_CRC   3
+#define NGX_HTTP_TFS_PHASE_WRITE 4
+#define NGX_HTTP_TFS_PHASE_CLOSE 5
+#define NGX_HTTP_TFS_PHASE_SEND  6
+#define NGX_HTTP_TFS_PHASE_MAX   7
+
+#define NGX_HTTP_TFS_OP_GET      0
+#define NGX_HTTP_TFS_OP_PUT      1
+#define NGX_HTTP_TFS_OP_UNLINK   2
+#define NGX_HTTP_TFS_OP_MAX      3
+
+/* 按2的幂分桶的耗时分布, 用于由百分位推算超时 */
+typedef struct {
+    uint32_t buckets[NGX_HTTP_TFS_LATENCY_BUCKETS];
+    uint32_t samples;
+} ngx_http_tfs_latency_t;
+
+/* 一个nameserver对应的客户端设置, 每个worker各有一份 */
+typedef struct {
+    ngx_str_t nsip;
+    time_t block_cache_time;            /* 客户端block位置缓存时间(秒) */
+    ngx_uint_t block_cache_items;       /* 客户端block位置缓存条数 */
+    ngx_msec_t timeout;                 /* 等待nameserver/dataserver响应的超时 */
+    ngx_array_t *warmup;                /* ngx_str_t, 启动时预热的热点文件列表 */
+
+    ngx_uint_t ready;
+    time_t last_init;
+
+    ngx_http_tfs_latency_t write_latency;   /* 上传耗时, 写时dataserver由nameserver分配, 按集群统计 */
+
+    ngx_uint_t max_inflight;            /* 所有worker上同时处理中的请求数上限, 0为不限 */
+    ngx_atomic_t *inflight;             /* 共享内存中的计数, 见ngx_http_tfs_limit.cpp */
+    ngx_atomic_t *inflight_own;         /* 其中本worker所占的 */
+} ngx_http_tfs_cluster_t;
+
+/* tfs_peers的一致性哈希环, 见ngx_http_tfs_peer.cpp */
+typedef struct ngx_http_tfs_peer_ring_s ngx_http_tfs_peer_ring_t;
+
+typedef struct {
+    ngx_array_t clusters;               /* ngx_http_tfs_cluster_t * */
+    ngx_msec_t warmup_time;             /* 每个worker启动时预热的总时间上限 */
+
+    ngx_array_t cache_zones;            /* ngx_shm_zone_t *, tfs_cache_zone定义的缓存 */
+    ngx_uint_t stats;                   /* 配置了tfs_status */
+    ngx_shm_zone_t *stats_zone;
+    ngx_shm_zone_t *limit_zone;         /* 按nameserver的处理中请求数 */
+
+    size_t buffer_arena;                /* 每个worker缓存的空闲读buffer字节数, 0为不复用 */
+    ngx_flag_t buffer_arena_hugepages;
+    size_t buffer_budget;               /* 所有worker缓冲的文件字节数上限, 0为不限 */
+
+    ngx_array_t *peers;                 /* ngx_str_t, tfs_peers, 也是各节点的upstream名 */
+    ngx_str_t peer_self;
+    ngx_str_t peer_key;                 /* 转发的请求带的X-Tfs-Peer值 */
+    ngx_uint_t peer_load_factor;        /* 转发到一个节点的请求数不超过平均的百分之多少 */
+    time_t peer_fail_timeout;           /* 转发失败后暂停使用该节点的时间 */
+    ngx_http_tfs_peer_ring_t *peer_ring;
+    ngx_shm_zone_t *peer_zone;          /* 按节点的转发中请求数与暂停时间 */
+} ngx_http_tfs_main_conf_t;
+
+typedef struct {
+    ngx_str_t tfs_nsip;         /* 字符串不要在_create_loc_conf中初始化，在_merge_loc_conf给默认值相当初始化 */
+    size_t tfs_rb_buffer_size;
+
+    ngx_shm_zone_t *cache_zone;         /* tfs_cache, 为NULL时不使用缓存 */
+    size_t cache_max_object_size;       /* 超过此大小的文件不进缓存 */
+    ngx_array_t *cache_types;           /* 上传时允许进缓存的Content-Type, NULL为不限 */
+
+    ngx_flag_t precompress;             /* 上传时gzip压缩后保存 */
+    ngx_array_t *precompress_types;     /* 压缩的Content-Type, NULL为默认的文本类型 */
+    size_t precompress_min_length;
+    ngx_int_t precompress_level;
+
+    ngx_uint_t unlink_max_names;        /* 批量删除时一次请求最多的文件数 */
+    ngx_uint_t unlink_concurrency;      /* 批量删除的线程数 */
+    ngx_msec_t unlink_timeout;          /* 批量删除的总时间, 到时返回已处理的部分 */
+
+    time_t block_cache_time;
+    ngx_uint_t block_cache_items;
+    ngx_msec_t timeout;
+    ngx_str_t warmup;
+
+    ngx_uint_t breaker_failures;        /* 连续失败多少次后暂停使用该dataserver, 0为不启用 */
+    time_t breaker_timeout;             /* 暂停多久后再试探 */
+    ngx_msec_t breaker_skip_timeout;    /* 首选dataserver暂停时的超时, 让客户端很快换到其它副本 */
+    ngx_flag_t adaptive_timeout;        /* 按观测到的p99推算超时, tfs_timeout为上限 */
+    ngx_msec_t adaptive_timeout_min;
+
+    ngx_uint_t max_inflight;            /* 每个worker同时处理中的请求数上限, 0为不限 */
+    ngx_uint_t cluster_max_inflight;    /* 同一nameserver在所有worker上的上限 */
+    ngx_uint_t queue_size;              /* 超过上限时排队的请求数 */
+    ngx_msec_t queue_timeout;           /* 排队等待的上限, 含进入handler前已等的时间 */
+
+    ngx_str_t peer_location;            /* 转发给所有者节点的named location, 空为不转发 */
+
+    ngx_uint_t enabled;                 /* 本location配置了tfs_get/tfs_put/tfs_unlink */
+    ngx_http_tfs_cluster_t *cluster;
+} ngx_http_tfs_ns_loc_conf_t;
+
+/* tfs_status输出的缓存统计 */
+typedef struct {
+    ngx_uint_t hits;
+    ngx_uint_t misses;
+    ngx_uint_t inserts;
+    ngx_uint_t evictions;
+    ngx_uint_t count;
+    size_t used;
+} ngx_http_tfs_cache_info_t;
+
+/* 一次读操作的熔断状态, 见ngx_http_tfs_breaker.cpp */
+typedef struct {
+    void *ds;                           /* 首选dataserver, NULL时不统计 */
+    ngx_uint_t max_fails;
+    ngx_msec_t timeout;                 /* 当前每次调用的超时 */
+    ngx_msec_t normal_timeout;          /* 跳过首选dataserver之后恢复的超时 */
+    uint64_t start;
+    uint64_t last;
+    ngx_uint_t slow;                    /* 有一次调用等满了超时 */
+    ngx_uint_t probe;
+    ngx_uint_t skip;                    /* 正用短超时跳过首选dataserver */
+    uint64_t addr;                      /* 本次读的dataserver, 跳过首选时为下一个可用副本 */
+    ngx_log_t *log;
+} ngx_http_tfs_breaker_t;
+
+/* 缓存中与文件内容一起保存的属性 */
+typedef struct {
+    size_t size;
+    time_t mtime;
+} ngx_http_tfs_cache_stat_t;
+
+/* 每个请求的tfs信息, 日志用到$tfs_*变量或排队时需要保留状态时才分配 */
+typedef struct {
+    ngx_str_t name;
+    uint64_t open_time;                 /* 微秒 */
+    uint64_t read_time;
+    uint64_t crc_time;
+    size_t bytes;
+    int ret;
+    ngx_uint_t remote;                  /* 访问了tfs, 缓存命中时为0 */
+    uint64_t dataserver;                /* 读文件的dataserver, 0为未知 */
+
+    ngx_buf_t *pending;                 /* 排队等预算时保留的已读到的文件 */
+    ngx_http_tfs_cache_stat_t pending_st;
+} ngx_http_tfs_ctx_t;
+
+extern ngx_module_t  ngx_http_tfs_module;
+
+/* ngx_http_tfs_client.cpp: 按nameserver登记, 每个worker初始化一次的tfs客户端 */
+ngx_int_t ngx_http_tfs_cluster_add(ngx_conf_t *cf, ngx_http_tfs_ns_loc_conf_t *conf);
+tfs::client::TfsClient* ngx_http_tfs_client(ngx_http_request_t *r, ngx_http_tfs_cluster_t *cl);
+void ngx_http_tfs_client_timeout(ngx_msec_t timeout);
+void ngx_http_tfs_client_pin_timeout(ngx_msec_t timeout);
+ngx_uint_t ngx_http_tfs_dataservers(ngx_http_tfs_cluster_t *cl, uint32_t block_id,
+    uint64_t *ds, ngx_uint_t max);
+uint64_t ngx_http_tfs_dataserver(ngx_http_tfs_cluster_t *cl, uint32_t block_id, uint64_t file_id);
+ngx_int_t ngx_http_tfs_init_process(ngx_cycle_t *cycle);
+void ngx_http_tfs_exit_process(ngx_cycle_t *cycle);
+
+/* ngx_http_tfs_cache.cpp: 共享内存对象缓存, 以tfsname为key */
+char* ngx_http_tfs_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_tfs_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char* ngx_http_tfs_cache_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_tfs_cache_test_type(ngx_http_request_t *r, ngx_array_t *types);
+ngx_buf_t* ngx_http_tfs_cache_get(ngx_shm_zone_t *zone, ngx_str_t *name,
+    ngx_http_request_t *r, ngx_http_tfs_cache_stat_t *st);
+ngx_int_t ngx_http_tfs_cache_put(ngx_shm_zone_t *zone, ngx_str_t *name,
+    u_char *data, ngx_http_tfs_cache_stat_t *st);
+ngx_int_t ngx_http_tfs_cache_delete(ngx_shm_zone_t *zone, ngx_str_t *name);
+void ngx_http_tfs_cache_info(ngx_shm_zone_t *zone, ngx_http_tfs_cache_info_t *info);
+
+/* ngx_http_tfs_buffer.cpp: 按大小分级, 每个worker复用的读buffer */
+ngx_buf_t *ngx_http_tfs_buffer_get(ngx_http_request_t *r, size_t size);
+void ngx_http_tfs_buffer_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf);
+void ngx_http_tfs_buffer_exit_process(ngx_cycle_t *cycle);
+
+/* ngx_http_tfs_breaker.cpp: 按dataserver熔断与自适应超时, 每个worker各自统计 */
+ngx_int_t ngx_http_tfs_breaker_read(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    u_char *tfsname, ngx_http_tfs_breaker_t *br);
+void ngx_http_tfs_breaker_lap(ngx_http_tfs_breaker_t *br, ngx_uint_t sample);
+void ngx_http_tfs_breaker_restore(ngx_http_tfs_breaker_t *br);
+uint64_t ngx_http_tfs_breaker_dataserver(ngx_http_tfs_ns_loc_conf_t *conf, u_char *tfsname,
+    ngx_http_tfs_breaker_t *br);
+void ngx_http_tfs_breaker_read_done(ngx_http_tfs_breaker_t *br, ngx_int_t failed);
+void ngx_http_tfs_breaker_write(ngx_http_tfs_ns_loc_conf_t *conf, ngx_http_tfs_breaker_t *br);
+void ngx_http_tfs_breaker_write_done(ngx_http_tfs_ns_loc_conf_t *conf, ngx_http_tfs_breaker_t *br,
+    ngx_int_t failed);
+
+/* ngx_http_tfs_limit.cpp: 处理中请求数与缓冲字节数的限制, 以及排队 */
+ngx_int_t ngx_http_tfs_limit(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_uint_t priority);
+ngx_int_t ngx_http_tfs_budget_reserve(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    size_t size);
+ngx_int_t ngx_http_tfs_limit_wait(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf);
+void ngx_http_tfs_budget_info(size_t *used, size_t *budget);
+ngx_int_t ngx_http_tfs_limit_add_zone(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf);
+void ngx_http_tfs_limit_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf);
+
+/* ngx_http_tfs_gzip.cpp: 上传时压缩保存, GET时按Accept-Encoding返回 */
+ngx_uint_t ngx_http_tfs_gzip_name(ngx_str_t *name);
+ngx_int_t ngx_http_tfs_gzip_compress(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    u_char *data, size_t len, ngx_str_t *out);
+ngx_uint_t ngx_http_tfs_gzip_accepted(ngx_http_request_t *r);
+ngx_int_t ngx_http_tfs_gzip_response(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_buf_t **pb);
+
+/* ngx_http_tfs_module.cpp与ngx_http_tfs_unlink.cpp: 删除文件, 批量删除在线程中进行 */
+ngx_int_t ngx_http_tfs_unlink_parse(ngx_str_t *name, u_char *tfsname, ngx_uint_t *gzip);
+void ngx_http_tfs_unlink_done(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *cglcf,
+    ngx_str_t *name, u_char *tfsname, ngx_uint_t gzip, int ret);
+ngx_int_t ngx_http_tfs_unlink_send(ngx_http_request_t *r, ngx_buf_t *b);
+ngx_int_t ngx_http_tfs_unlink_batch_start(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_array_t *names, tfs::common::TfsUnlinkType action);
+void ngx_http_tfs_unlink_exit_process(ngx_cycle_t *cycle);
+
+/* ngx_http_tfs_peer.cpp: 前端节点之间按tfsname一致性哈希分担缓存 */
+char* ngx_http_tfs_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_tfs_peer_init(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf);
+ngx_int_t ngx_http_tfs_peer_add_variable(ngx_conf_t *cf);
+ngx_int_t ngx_http_tfs_peer_route(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    u_char *tfsname);
+
+/* ngx_http_tfs_stats.cpp: 共享内存统计与tfs_status, 以及$tfs_*变量 */
+extern ngx_uint_t ngx_http_tfs_stats_enabled;
+char* ngx_http_tfs_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_tfs_stats_add_zone(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf);
+void ngx_http_tfs_stats_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf);
+uint64_t ngx_http_tfs_stats_now();
+uint64_t ngx_http_tfs_stats_lap(uint64_t *t);
+void ngx_http_tfs_stats_observe(ngx_uint_t phase, uint64_t usec);
+void ngx_http_tfs_stats_request(ngx_uint_t op);
+void ngx_http_tfs_stats_bytes(size_t read, size_t written);
+void ngx_http_tfs_stats_error(int code);
+void ngx_http_tfs_stats_crc_error();
+void ngx_http_tfs_stats_rejected();
+void ngx_http_tfs_stats_budget_wait();
+void ngx_http_tfs_stats_arena_get(ngx_uint_t reused);
+void ngx_http_tfs_stats_arena_bytes(size_t bytes);
+void ngx_http_tfs_stats_precompress(size_t in, size_t out);
+void ngx_http_tfs_stats_gunzip();
+void ngx_http_tfs_stats_peer(ngx_uint_t failed);
+void ngx_http_tfs_stats_peer_spilled();
+ngx_int_t ngx_http_tfs_add_variables(ngx_conf_t *cf);
+ngx_int_t ngx_http_tfs_init_module(ngx_cycle_t *cycle);
+ngx_http_tfs_ctx_t* ngx_http_tfs_get_ctx(ngx_http_request_t *r, u_char *name, size_t len);
+ngx_http_tfs_ctx_t* ngx_http_tfs_request_ctx(ngx_http_request_t *r);
+
+#endif /* _NGX_HTTP_TFS_MODULE_H_INCLUDED_ */
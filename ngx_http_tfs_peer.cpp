@@ -0,0 +1,505 @@
+/*
+ * 前端节点之间按tfsname一致性哈希分担缓存
+ *
+ * 每个nginx各自缓存时, 同一热点文件在每个节点上都缓存一份, 节点越多总的命中率越低.
+ * 配置tfs_peers后, 每个tfsname由哈希环(每个节点160个虚拟节点)确定一个所有者:
+ * 所有者自己读tfs并缓存; 其它节点的GET转到tfs_peer_location指定的named location,
+ * 在那里用proxy_pass http://$tfs_peer 经keepalive连接向所有者取. 这样每个文件
+ * 只在一个节点上缓存, 总的缓存容量随节点数增长.
+ *
+ *   tfs_peers node1 node2 node3;     各节点的名字, 也是proxy_pass用的upstream名
+ *   tfs_peer_self node1;             本节点
+ *   tfs_peer_key secret;             转发时带的X-Tfs-Peer头的值, 各节点相同
+ *   tfs_peer_load_factor 125;        百分比, 见下
+ *   tfs_peer_fail_timeout 10s;
+ *   tfs_peer_location @tfs_peer;     location中, off为不转发
+ *
+ * 有界负载: 本节点(所有worker, 计数在共享内存中)记录转发到各节点处理中的请求数,
+ * 以及本节点自己处理中的GET(含其它节点转发来的). 加上这个请求后, 一个节点的数超过
+ * 所有节点平均值的tfs_peer_load_factor%时, 沿哈希环换下一个节点, 本节点也一样,
+ * 热点文件不会压垮一个节点. 各节点都满时本地处理. 因负载没有由所有者处理的计入
+ * tfs_peer_spilled_total.
+ *
+ * X-Tfs-Peer头等于tfs_peer_key的请求是其它节点转发来的, 不再转发; 客户端自己带的
+ * 其它值不起作用. 转发失败时由named location中的error_page回到不带tfs_peer_location
+ * 的location读tfs. 其中连接失败, 超时(502/504)说明节点不可用, tfs_peer_fail_timeout
+ * 内不再转发到该节点; 对方返回500/503(如过载拒绝)只回到本地, 不暂停该节点.
+ * 见nginx.conf.example.
+ * */
+#include "ngx_http_tfs_module.h"
+
+
+#define NGX_HTTP_TFS_PEER_VNODES 160
+#define NGX_HTTP_TFS_PEER_HEADER "X-Tfs-Peer"
+
+typedef struct {
+    uint32_t hash;
+    ngx_uint_t peer;
+} ngx_http_tfs_peer_point_t;
+
+struct ngx_http_tfs_peer_ring_s {
+    ngx_str_t *names;
+    ngx_uint_t npeers;
+    ngx_uint_t self;
+    ngx_http_tfs_peer_point_t *points;  /* 按hash排序 */
+    ngx_uint_t npoints;
+    ngx_int_t var_index;                /* $tfs_peer */
+};
+
+/* 共享内存中每个节点一项 */
+typedef struct {
+    ngx_atomic_t inflight;              /* 本节点转发到该节点处理中的请求数, 本节点的为本地处理中的 */
+    ngx_atomic_t down_until;            /* 转发失败后暂停到此时间(秒) */
+} ngx_http_tfs_peer_node_t;
+
+/* 一次转发或本地处理, 请求结束时归还计数, 转发的再检查是否失败 */
+typedef struct {
+    ngx_http_request_t *r;
+    ngx_http_tfs_peer_node_t *node;
+    ngx_str_t *name;
+    time_t fail_timeout;
+    ngx_uint_t forwarded;
+} ngx_http_tfs_peer_req_t;
+
+static ngx_str_t ngx_http_tfs_peer_zone_name = ngx_string("ngx_http_tfs_peer");
+static ngx_str_t ngx_http_tfs_peer_var_name = ngx_string("tfs_peer");
+
+
+/* tfs_peers node1 node2 ... */
+char *
+ngx_http_tfs_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tfs_main_conf_t *tmcf = (ngx_http_tfs_main_conf_t *) conf;
+    ngx_str_t *value, *name;
+    ngx_uint_t i, j;
+
+    if (tmcf->peers != NULL) {
+        return (char *) "is duplicate";
+    }
+
+    if (cf->args->nelts - 1 > NGX_HTTP_TFS_PEER_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "at most %d tfs_peers", NGX_HTTP_TFS_PEER_MAX);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    tmcf->peers = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_str_t));
+    if (tmcf->peers == NULL) {
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        for (j = 1; j < i; j++) {
+            if (value[j].len == value[i].len
+                && ngx_strncmp(value[j].data, value[i].data, value[i].len) == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate peer \"%V\"", &value[i]);
+                return (char *) NGX_CONF_ERROR;
+            }
+        }
+
+        name = (ngx_str_t *) ngx_array_push(tmcf->peers);
+        if (name == NULL) {
+            return (char *) NGX_CONF_ERROR;
+        }
+
+        *name = value[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+static int ngx_libc_cdecl
+ngx_http_tfs_peer_cmp(const void *one, const void *two)
+{
+    const ngx_http_tfs_peer_point_t *a = (const ngx_http_tfs_peer_point_t *) one;
+    const ngx_http_tfs_peer_point_t *b = (const ngx_http_tfs_peer_point_t *) two;
+
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    }
+
+    return a->peer < b->peer ? -1 : (a->peer > b->peer ? 1 : 0);
+}
+
+static ngx_int_t
+ngx_http_tfs_peer_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t *shpool;
+    size_t size;
+
+    // reload时沿用旧的计数, 节点顺序变了也只是短时间内的负载判断不准
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_tfs_peer_node_t) * NGX_HTTP_TFS_PEER_MAX;
+    shm_zone->data = ngx_slab_alloc(shpool, size);
+    if (shm_zone->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(shm_zone->data, size);
+    shpool->data = shm_zone->data;
+
+    return NGX_OK;
+}
+
+/* init main conf时按tfs_peers建哈希环 */
+ngx_int_t
+ngx_http_tfs_peer_init(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf)
+{
+    u_char buf[NGX_INT_T_LEN + 256], *last;
+    ngx_str_t *names;
+    ngx_uint_t i, j, n;
+    ngx_http_tfs_peer_ring_t *ring;
+
+    if (tmcf->peers == NULL) {
+        return NGX_OK;
+    }
+
+    ring = (ngx_http_tfs_peer_ring_t *) ngx_pcalloc(cf->pool, sizeof(ngx_http_tfs_peer_ring_t));
+    if (ring == NULL) {
+        return NGX_ERROR;
+    }
+
+    names = (ngx_str_t *) tmcf->peers->elts;
+    ring->names = names;
+    ring->npeers = tmcf->peers->nelts;
+
+    for (i = 0; i < ring->npeers; i++) {
+        if (names[i].len == tmcf->peer_self.len
+            && ngx_strncmp(names[i].data, tmcf->peer_self.data, names[i].len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == ring->npeers) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "tfs_peer_self \"%V\" is not one of tfs_peers", &tmcf->peer_self);
+        return NGX_ERROR;
+    }
+
+    // 没有key时任何客户端带上X-Tfs-Peer就能绕过转发
+    if (tmcf->peer_key.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "tfs_peers requires tfs_peer_key");
+        return NGX_ERROR;
+    }
+    ring->self = i;
+
+    ring->npoints = ring->npeers * NGX_HTTP_TFS_PEER_VNODES;
+    ring->points = (ngx_http_tfs_peer_point_t *) ngx_palloc(cf->pool,
+                       ring->npoints * sizeof(ngx_http_tfs_peer_point_t));
+    if (ring->points == NULL) {
+        return NGX_ERROR;
+    }
+
+    // 虚拟节点只由名字决定, 各节点上的环一致, 与tfs_peers中的顺序无关
+    n = 0;
+    for (i = 0; i < ring->npeers; i++) {
+        for (j = 0; j < NGX_HTTP_TFS_PEER_VNODES; j++) {
+            last = ngx_snprintf(buf, sizeof(buf), "%V#%ui", &names[i], j);
+            ring->points[n].hash = ngx_crc32_short(buf, last - buf);
+            ring->points[n].peer = i;
+            n++;
+        }
+    }
+
+    ngx_qsort(ring->points, ring->npoints, sizeof(ngx_http_tfs_peer_point_t),
+              ngx_http_tfs_peer_cmp);
+
+    ring->var_index = ngx_http_get_variable_index(cf, &ngx_http_tfs_peer_var_name);
+    if (ring->var_index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    tmcf->peer_zone = ngx_shared_memory_add(cf, &ngx_http_tfs_peer_zone_name,
+                                            8 * ngx_pagesize, &ngx_http_tfs_module);
+    if (tmcf->peer_zone == NULL) {
+        return NGX_ERROR;
+    }
+    tmcf->peer_zone->init = ngx_http_tfs_peer_init_zone;
+
+    tmcf->peer_ring = ring;
+
+    return NGX_OK;
+}
+
+/* 转发前由ngx_http_tfs_peer_route设置, 其它时候为空 */
+static ngx_int_t
+ngx_http_tfs_variable_peer(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    v->not_found = 1;
+    return NGX_OK;
+}
+
+/* preconfiguration */
+ngx_int_t
+ngx_http_tfs_peer_add_variable(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var;
+
+    var = ngx_http_add_variable(cf, &ngx_http_tfs_peer_var_name, 0);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_tfs_variable_peer;
+
+    return NGX_OK;
+}
+
+/* 带了与tfs_peer_key相同的X-Tfs-Peer头 */
+static ngx_uint_t
+ngx_http_tfs_peer_from_peer(ngx_http_request_t *r, ngx_str_t *key)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    part = &r->headers_in.headers.part;
+    h = (ngx_table_elt_t *) part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return 0;
+            }
+
+            part = part->next;
+            h = (ngx_table_elt_t *) part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == sizeof(NGX_HTTP_TFS_PEER_HEADER) - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) NGX_HTTP_TFS_PEER_HEADER,
+                               sizeof(NGX_HTTP_TFS_PEER_HEADER) - 1) == 0)
+        {
+            if (h[i].value.len == key->len
+                && ngx_strncmp(h[i].value.data, key->data, key->len) == 0)
+            {
+                return 1;
+            }
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "ngx_tfs_mods: " NGX_HTTP_TFS_PEER_HEADER " does not match tfs_peer_key");
+        }
+    }
+}
+
+static ngx_uint_t
+ngx_http_tfs_peer_inflight(ngx_http_tfs_peer_node_t *node)
+{
+    ngx_atomic_int_t n = (ngx_atomic_int_t) node->inflight;
+
+    // reload后节点顺序变化时计数可能短暂为负
+    return n > 0 ? (ngx_uint_t) n : 0;
+}
+
+static void
+ngx_http_tfs_peer_cleanup(void *data)
+{
+    ngx_http_tfs_peer_req_t *pr = (ngx_http_tfs_peer_req_t *) data;
+    ngx_uint_t i;
+    ngx_http_upstream_state_t *state;
+
+    (void) ngx_atomic_fetch_add(&pr->node->inflight, -1);
+
+    if (!pr->forwarded || pr->r->upstream_states == NULL) {
+        return;
+    }
+
+    // 连接失败或超时时upstream记下的是502/504, 请求已由error_page回到本地读tfs.
+    // 对方返回的500/503多是过载拒绝或个别文件的错误, 节点本身可用, 不暂停
+    state = (ngx_http_upstream_state_t *) pr->r->upstream_states->elts;
+    for (i = 0; i < pr->r->upstream_states->nelts; i++) {
+        if (state[i].status == NGX_HTTP_BAD_GATEWAY
+            || state[i].status == NGX_HTTP_GATEWAY_TIME_OUT)
+        {
+            ngx_log_error(NGX_LOG_WARN, pr->r->connection->log, 0,
+                "ngx_tfs_mods: peer %V failed with %ui, not used for %T seconds",
+                pr->name, state[i].status, pr->fail_timeout);
+            pr->node->down_until = ngx_time() + pr->fail_timeout;
+            ngx_http_tfs_stats_peer(1);
+            return;
+        }
+    }
+}
+
+/* 记下由哪个节点处理, 计入它的处理中请求数 */
+static ngx_http_tfs_peer_req_t *
+ngx_http_tfs_peer_track(ngx_http_request_t *r, ngx_http_tfs_main_conf_t *tmcf,
+    ngx_http_tfs_peer_node_t *nodes, ngx_uint_t peer)
+{
+    ngx_pool_cleanup_t *cln;
+    ngx_http_tfs_peer_req_t *pr;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_tfs_peer_req_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    pr = (ngx_http_tfs_peer_req_t *) cln->data;
+    pr->r = r;
+    pr->node = &nodes[peer];
+    pr->name = &tmcf->peer_ring->names[peer];
+    pr->fail_timeout = tmcf->peer_fail_timeout;
+    pr->forwarded = (peer != tmcf->peer_ring->self);
+    cln->handler = ngx_http_tfs_peer_cleanup;
+
+    (void) ngx_atomic_fetch_add(&pr->node->inflight, 1);
+
+    return pr;
+}
+
+/* 排队后重新进入handler时已经决定过 */
+static ngx_uint_t
+ngx_http_tfs_peer_routed(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t *cln;
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_tfs_peer_cleanup) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* 由本节点处理 */
+static ngx_int_t
+ngx_http_tfs_peer_local(ngx_http_request_t *r, ngx_http_tfs_main_conf_t *tmcf,
+    ngx_http_tfs_peer_node_t *nodes)
+{
+    if (ngx_http_tfs_peer_track(r, tmcf, nodes, tmcf->peer_ring->self) == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+ * GET在访问缓存与tfs之前调用. 由本节点处理时返回NGX_DECLINED; 否则已转到
+ * tfs_peer_location, 返回NGX_DONE或错误码, handler直接返回
+ * */
+ngx_int_t
+ngx_http_tfs_peer_route(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf, u_char *tfsname)
+{
+    u_char visited[NGX_HTTP_TFS_PEER_MAX];
+    uint32_t hash;
+    ngx_uint_t lo, hi, mid, k, n, total, bound;
+    time_t now;
+    ngx_uint_t spilled;
+    ngx_http_variable_value_t *v;
+    ngx_http_tfs_main_conf_t *tmcf;
+    ngx_http_tfs_peer_ring_t *ring;
+    ngx_http_tfs_peer_point_t *pt;
+    ngx_http_tfs_peer_node_t *nodes;
+    ngx_http_tfs_peer_req_t *pr;
+
+    if (conf->peer_location.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_get_module_main_conf(r, ngx_http_tfs_module);
+    ring = tmcf->peer_ring;
+    if (ring == NULL || tmcf->peer_zone->data == NULL || ngx_http_tfs_peer_routed(r)) {
+        return NGX_DECLINED;
+    }
+
+    nodes = (ngx_http_tfs_peer_node_t *) tmcf->peer_zone->data;
+
+    // 其它节点转发来的不再转发, 但计入本节点的负载
+    if (ngx_http_tfs_peer_from_peer(r, &tmcf->peer_key)) {
+        return ngx_http_tfs_peer_local(r, tmcf, nodes);
+    }
+
+    // 环上第一个hash不小于文件hash的点, 超过最后一个时回到开头
+    hash = ngx_crc32_short(tfsname, ngx_strlen(tfsname));
+    lo = 0;
+    hi = ring->npoints;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // 加上这个请求后所有节点(含本节点)的平均负载乘以load_factor, 向上取整
+    total = 1;
+    for (k = 0; k < ring->npeers; k++) {
+        total += ngx_http_tfs_peer_inflight(&nodes[k]);
+    }
+    bound = (total * tmcf->peer_load_factor + 100 * ring->npeers - 1) / (100 * ring->npeers);
+
+    now = ngx_time();
+    spilled = 0;
+    ngx_memzero(visited, ring->npeers);
+
+    for (k = 0, n = 0; k < ring->npoints && n < ring->npeers; k++) {
+        pt = &ring->points[(lo + k) % ring->npoints];
+        if (visited[pt->peer]) {
+            continue;
+        }
+        visited[pt->peer] = 1;
+        n++;
+
+        if (pt->peer != ring->self && (time_t) nodes[pt->peer].down_until > now) {
+            continue;
+        }
+
+        if (ngx_http_tfs_peer_inflight(&nodes[pt->peer]) + 1 > bound) {
+            spilled = 1;
+            continue;
+        }
+
+        if (spilled) {
+            ngx_http_tfs_stats_peer_spilled();
+        }
+
+        if (pt->peer == ring->self) {
+            return ngx_http_tfs_peer_local(r, tmcf, nodes);
+        }
+
+        pr = ngx_http_tfs_peer_track(r, tmcf, nodes, pt->peer);
+        if (pr == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_tfs_stats_peer(0);
+
+        // named location中不清除已求值的变量, proxy_pass取到的就是这里设置的值
+        v = &r->variables[ring->var_index];
+        v->len = pr->name->len;
+        v->data = pr->name->data;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "ngx_tfs_mods: %s owned by peer %V", tfsname, pr->name);
+
+        return ngx_http_named_location(r, &conf->peer_location);
+    }
+
+    // 其它节点都暂停, 或所有节点都已满
+    if (spilled) {
+        ngx_http_tfs_stats_peer_spilled();
+    }
+
+    return ngx_http_tfs_peer_local(r, tmcf, nodes);
+}
@@ -0,0 +1,881 @@
+/*
+ * 统计: 各阶段耗时分布, 读写字节数, 按tfs返回码的错误数, 缓存命中情况
+ *
+ * 共享内存中每个worker(按ngx_process_slot)一块计数区, 只由该worker自己写,
+ * 热路径上不加锁也不用原子操作; tfs_status输出时再把所有worker的计数加起来,
+ * 格式为Prometheus text format.
+ *
+ * 另有按请求记录的$tfs_*变量供log_format使用. 只有配置中用到这些变量时
+ * 才分配请求上下文; 既没有tfs_status也没用变量时不取时间.
+ * */
+#include "ngx_http_tfs_module.h"
+#include "fsname.h"
+#include "tbsys.h"
+
+
+#define NGX_HTTP_TFS_STATS_BUCKETS 16
+#define NGX_HTTP_TFS_STATS_ERRORS 32
+
+typedef struct {
+    int code;
+    uint64_t count;
+} ngx_http_tfs_stats_error_t;
+
+typedef struct {
+    uint64_t buckets[NGX_HTTP_TFS_PHASE_MAX][NGX_HTTP_TFS_STATS_BUCKETS];
+    uint64_t sum[NGX_HTTP_TFS_PHASE_MAX];       /* 微秒 */
+    uint64_t requests[NGX_HTTP_TFS_OP_MAX];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    ngx_http_tfs_stats_error_t errors[NGX_HTTP_TFS_STATS_ERRORS];
+    uint64_t errors_other;                      /* errors放不下的返回码 */
+    uint64_t crc_errors;
+    uint64_t rejected;                          /* 准入控制拒绝的请求 */
+    uint64_t budget_waits;                      /* 因tfs_buffer_budget排队的次数 */
+    uint64_t arena_reused;                      /* 读buffer复用/新分配的次数 */
+    uint64_t arena_allocated;
+    uint64_t precompressed;                     /* 上传时压缩保存的文件数 */
+    uint64_t precompress_saved;                 /* 压缩节省的字节数 */
+    uint64_t gunzipped;                         /* 客户端不接受gzip, 解压后返回的次数 */
+    uint64_t peer_forwarded;                    /* 转发给所有者节点的GET */
+    uint64_t peer_failed;                       /* 其中转发失败, 回到本地读tfs的 */
+    uint64_t peer_spilled;                      /* 所有者负载过高, 由其它节点处理的 */
+    uint64_t arena_bytes;                       /* 以下两项为本worker的当前值, worker启动时清零 */
+    uint64_t arena_high_water;
+} ngx_http_tfs_stats_slot_t;
+
+/* 各bucket的上限(微秒), 最后一个为+Inf */
+static const uint64_t ngx_http_tfs_stats_bounds[NGX_HTTP_TFS_STATS_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+static const char *ngx_http_tfs_stats_le[NGX_HTTP_TFS_STATS_BUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "2.5", "5", "+Inf"
+};
+
+static const char *ngx_http_tfs_phase_names[NGX_HTTP_TFS_PHASE_MAX] = {
+    "open", "fstat", "read", "crc", "write", "close", "send"
+};
+
+static const char *ngx_http_tfs_op_names[NGX_HTTP_TFS_OP_MAX] = {
+    "get", "put", "unlink"
+};
+
+static ngx_str_t ngx_http_tfs_stats_zone_name = ngx_string("ngx_http_tfs_stats");
+
+static ngx_http_tfs_stats_slot_t *ngx_http_tfs_stats_slot;     /* 本worker的计数区 */
+
+ngx_uint_t ngx_http_tfs_stats_enabled;                         /* 需要取时间 */
+static ngx_uint_t ngx_http_tfs_variables_used;                  /* 配置中用到了$tfs_*变量 */
+
+static ngx_int_t ngx_http_tfs_variable_name(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tfs_variable_time(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tfs_variable_dataserver(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tfs_variable_block_id(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tfs_variable_bytes(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tfs_variable_ret(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_http_variable_t ngx_http_tfs_vars[] = {
+
+    { ngx_string("tfs_name"), NULL, ngx_http_tfs_variable_name,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_open_time"), NULL, ngx_http_tfs_variable_time,
+      offsetof(ngx_http_tfs_ctx_t, open_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_read_time"), NULL, ngx_http_tfs_variable_time,
+      offsetof(ngx_http_tfs_ctx_t, read_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_crc_time"), NULL, ngx_http_tfs_variable_time,
+      offsetof(ngx_http_tfs_ctx_t, crc_time), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_dataserver"), NULL, ngx_http_tfs_variable_dataserver,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_block_id"), NULL, ngx_http_tfs_variable_block_id,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_bytes"), NULL, ngx_http_tfs_variable_bytes,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tfs_ret"), NULL, ngx_http_tfs_variable_ret,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+uint64_t
+ngx_http_tfs_stats_now()
+{
+    struct timeval tv;
+
+    if (!ngx_http_tfs_stats_enabled) {
+        return 0;
+    }
+
+    ngx_gettimeofday(&tv);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* 返回从*t到现在的微秒数, 并把*t更新为现在; 未开启统计时为0 */
+uint64_t
+ngx_http_tfs_stats_lap(uint64_t *t)
+{
+    uint64_t now, elapsed;
+
+    if (*t == 0) {
+        return 0;
+    }
+
+    now = ngx_http_tfs_stats_now();
+    elapsed = now > *t ? now - *t : 0;
+    *t = now;
+
+    return elapsed;
+}
+
+void
+ngx_http_tfs_stats_observe(ngx_uint_t phase, uint64_t usec)
+{
+    ngx_uint_t i;
+    ngx_http_tfs_stats_slot_t *slot = ngx_http_tfs_stats_slot;
+
+    if (slot == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NGX_HTTP_TFS_STATS_BUCKETS - 1; i++) {
+        if (usec <= ngx_http_tfs_stats_bounds[i]) {
+            break;
+        }
+    }
+
+    slot->buckets[phase][i]++;
+    slot->sum[phase] += usec;
+}
+
+void
+ngx_http_tfs_stats_request(ngx_uint_t op)
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->requests[op]++;
+    }
+}
+
+void
+ngx_http_tfs_stats_bytes(size_t read, size_t written)
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->bytes_read += read;
+        ngx_http_tfs_stats_slot->bytes_written += written;
+    }
+}
+
+void
+ngx_http_tfs_stats_crc_error()
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->crc_errors++;
+    }
+}
+
+void
+ngx_http_tfs_stats_rejected()
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->rejected++;
+    }
+}
+
+void
+ngx_http_tfs_stats_budget_wait()
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->budget_waits++;
+    }
+}
+
+void
+ngx_http_tfs_stats_arena_get(ngx_uint_t reused)
+{
+    if (ngx_http_tfs_stats_slot == NULL) {
+        return;
+    }
+
+    if (reused) {
+        ngx_http_tfs_stats_slot->arena_reused++;
+    } else {
+        ngx_http_tfs_stats_slot->arena_allocated++;
+    }
+}
+
+void
+ngx_http_tfs_stats_precompress(size_t in, size_t out)
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->precompressed++;
+        ngx_http_tfs_stats_slot->precompress_saved += in - out;
+    }
+}
+
+void
+ngx_http_tfs_stats_gunzip()
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->gunzipped++;
+    }
+}
+
+void
+ngx_http_tfs_stats_peer(ngx_uint_t failed)
+{
+    if (ngx_http_tfs_stats_slot == NULL) {
+        return;
+    }
+
+    if (failed) {
+        ngx_http_tfs_stats_slot->peer_failed++;
+    } else {
+        ngx_http_tfs_stats_slot->peer_forwarded++;
+    }
+}
+
+void
+ngx_http_tfs_stats_peer_spilled()
+{
+    if (ngx_http_tfs_stats_slot) {
+        ngx_http_tfs_stats_slot->peer_spilled++;
+    }
+}
+
+void
+ngx_http_tfs_stats_arena_bytes(size_t bytes)
+{
+    ngx_http_tfs_stats_slot_t *slot = ngx_http_tfs_stats_slot;
+
+    if (slot == NULL) {
+        return;
+    }
+
+    slot->arena_bytes = bytes;
+    if (bytes > slot->arena_high_water) {
+        slot->arena_high_water = bytes;
+    }
+}
+
+void
+ngx_http_tfs_stats_error(int code)
+{
+    ngx_uint_t i;
+    ngx_http_tfs_stats_slot_t *slot = ngx_http_tfs_stats_slot;
+
+    if (slot == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NGX_HTTP_TFS_STATS_ERRORS; i++) {
+        if (slot->errors[i].count == 0) {
+            slot->errors[i].code = code;
+        }
+
+        if (slot->errors[i].code == code) {
+            slot->errors[i].count++;
+            return;
+        }
+    }
+
+    slot->errors_other++;
+}
+
+static ngx_int_t
+ngx_http_tfs_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t *shpool;
+    size_t size;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_tfs_stats_slot_t) * NGX_MAX_PROCESSES;
+    shm_zone->data = ngx_slab_alloc(shpool, size);
+    if (shm_zone->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(shm_zone->data, size);
+    shpool->data = shm_zone->data;
+
+    return NGX_OK;
+}
+
+/* 在init_main_conf中调用, 只有配置了tfs_status时才分配 */
+ngx_int_t
+ngx_http_tfs_stats_add_zone(ngx_conf_t *cf, ngx_http_tfs_main_conf_t *tmcf)
+{
+    size_t size;
+
+    if (!tmcf->stats) {
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_tfs_stats_slot_t) * NGX_MAX_PROCESSES + 8 * ngx_pagesize;
+
+    tmcf->stats_zone = ngx_shared_memory_add(cf, &ngx_http_tfs_stats_zone_name, size,
+                                             &ngx_http_tfs_module);
+    if (tmcf->stats_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmcf->stats_zone->init = ngx_http_tfs_stats_init_zone;
+
+    return NGX_OK;
+}
+
+void
+ngx_http_tfs_stats_init_process(ngx_cycle_t *cycle, ngx_http_tfs_main_conf_t *tmcf)
+{
+    ngx_http_tfs_stats_slot_t *slots;
+
+    if (tmcf->stats_zone == NULL || tmcf->stats_zone->data == NULL) {
+        return;
+    }
+
+    // 计数不清零: 旧worker退出后留下的计数仍计入总数, 各项只增不减
+    slots = (ngx_http_tfs_stats_slot_t *) tmcf->stats_zone->data;
+    ngx_http_tfs_stats_slot = &slots[ngx_process_slot];
+    ngx_http_tfs_stats_slot->arena_bytes = 0;
+    ngx_http_tfs_stats_slot->arena_high_water = 0;
+    ngx_http_tfs_stats_enabled = 1;
+}
+
+static ngx_int_t
+ngx_http_tfs_status_handler(ngx_http_request_t *r)
+{
+    size_t size;
+    ngx_int_t rc;
+    ngx_uint_t i, j, p, n, found;
+    size_t budget_used, budget;
+    uint64_t cumulative;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+    ngx_shm_zone_t **zones;
+    ngx_http_tfs_stats_slot_t *slots, total;
+    ngx_http_tfs_stats_error_t errors[NGX_HTTP_TFS_STATS_ERRORS * 4];
+    ngx_http_tfs_cache_info_t info;
+    ngx_http_tfs_main_conf_t *tmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_get_module_main_conf(r, ngx_http_tfs_module);
+    if (tmcf->stats_zone == NULL || tmcf->stats_zone->data == NULL) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    // 汇总所有worker的计数, 各slot由其worker无锁写入, 这里读到的是近似一致的快照
+    ngx_memzero(&total, sizeof(total));
+    n = 0;
+    slots = (ngx_http_tfs_stats_slot_t *) tmcf->stats_zone->data;
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        for (p = 0; p < NGX_HTTP_TFS_PHASE_MAX; p++) {
+            for (j = 0; j < NGX_HTTP_TFS_STATS_BUCKETS; j++) {
+                total.buckets[p][j] += slots[i].buckets[p][j];
+            }
+            total.sum[p] += slots[i].sum[p];
+        }
+
+        for (j = 0; j < NGX_HTTP_TFS_OP_MAX; j++) {
+            total.requests[j] += slots[i].requests[j];
+        }
+
+        total.bytes_read += slots[i].bytes_read;
+        total.bytes_written += slots[i].bytes_written;
+        total.errors_other += slots[i].errors_other;
+        total.crc_errors += slots[i].crc_errors;
+        total.rejected += slots[i].rejected;
+        total.budget_waits += slots[i].budget_waits;
+        total.arena_reused += slots[i].arena_reused;
+        total.arena_allocated += slots[i].arena_allocated;
+        total.precompressed += slots[i].precompressed;
+        total.precompress_saved += slots[i].precompress_saved;
+        total.gunzipped += slots[i].gunzipped;
+        total.peer_forwarded += slots[i].peer_forwarded;
+        total.peer_failed += slots[i].peer_failed;
+        total.peer_spilled += slots[i].peer_spilled;
+        total.arena_bytes += slots[i].arena_bytes;
+        total.arena_high_water += slots[i].arena_high_water;
+
+        for (j = 0; j < NGX_HTTP_TFS_STATS_ERRORS && slots[i].errors[j].count; j++) {
+            for (found = 0; found < n; found++) {
+                if (errors[found].code == slots[i].errors[j].code) {
+                    break;
+                }
+            }
+
+            if (found == n) {
+                if (n == NGX_HTTP_TFS_STATS_ERRORS * 4) {
+                    total.errors_other += slots[i].errors[j].count;
+                    continue;
+                }
+                errors[n].code = slots[i].errors[j].code;
+                errors[n].count = 0;
+                n++;
+            }
+
+            errors[found].count += slots[i].errors[j].count;
+        }
+    }
+
+    size = NGX_HTTP_TFS_PHASE_MAX * (NGX_HTTP_TFS_STATS_BUCKETS + 2) * 96
+           + NGX_HTTP_TFS_OP_MAX * 64 + (n + 1) * 64
+           + tmcf->cache_zones.nelts * 6 * (96 + 64)
+           + 4096 + 1536;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last,
+        "# HELP tfs_phase_duration_seconds Time spent in each phase of a tfs request.\n"
+        "# TYPE tfs_phase_duration_seconds histogram\n",
+        sizeof("# HELP tfs_phase_duration_seconds Time spent in each phase of a tfs request.\n"
+               "# TYPE tfs_phase_duration_seconds histogram\n") - 1);
+
+    for (p = 0; p < NGX_HTTP_TFS_PHASE_MAX; p++) {
+        cumulative = 0;
+        for (j = 0; j < NGX_HTTP_TFS_STATS_BUCKETS; j++) {
+            cumulative += total.buckets[p][j];
+            b->last = ngx_sprintf(b->last,
+                "tfs_phase_duration_seconds_bucket{phase=\"%s\",le=\"%s\"} %uL\n",
+                ngx_http_tfs_phase_names[p], ngx_http_tfs_stats_le[j], cumulative);
+        }
+
+        b->last = ngx_sprintf(b->last,
+            "tfs_phase_duration_seconds_sum{phase=\"%s\"} %uL.%06uL\n"
+            "tfs_phase_duration_seconds_count{phase=\"%s\"} %uL\n",
+            ngx_http_tfs_phase_names[p], total.sum[p] / 1000000, total.sum[p] % 1000000,
+            ngx_http_tfs_phase_names[p], cumulative);
+    }
+
+    b->last = ngx_sprintf(b->last, "# TYPE tfs_requests_total counter\n");
+    for (j = 0; j < NGX_HTTP_TFS_OP_MAX; j++) {
+        b->last = ngx_sprintf(b->last, "tfs_requests_total{op=\"%s\"} %uL\n",
+                              ngx_http_tfs_op_names[j], total.requests[j]);
+    }
+
+    b->last = ngx_sprintf(b->last,
+        "# TYPE tfs_read_bytes_total counter\n"
+        "tfs_read_bytes_total %uL\n"
+        "# TYPE tfs_written_bytes_total counter\n"
+        "tfs_written_bytes_total %uL\n"
+        "# TYPE tfs_errors_total counter\n",
+        total.bytes_read, total.bytes_written);
+
+    for (i = 0; i < n; i++) {
+        b->last = ngx_sprintf(b->last, "tfs_errors_total{code=\"%d\"} %uL\n",
+                              errors[i].code, errors[i].count);
+    }
+    b->last = ngx_sprintf(b->last, "tfs_errors_total{code=\"other\"} %uL\n"
+                          "# TYPE tfs_crc_errors_total counter\n"
+                          "tfs_crc_errors_total %uL\n"
+                          "# TYPE tfs_rejected_total counter\n"
+                          "tfs_rejected_total %uL\n",
+                          total.errors_other, total.crc_errors, total.rejected);
+
+    b->last = ngx_sprintf(b->last,
+        "# TYPE tfs_buffer_arena_gets_total counter\n"
+        "tfs_buffer_arena_gets_total{result=\"reused\"} %uL\n"
+        "tfs_buffer_arena_gets_total{result=\"allocated\"} %uL\n"
+        "# HELP tfs_buffer_arena_bytes Read buffers held by the workers, in use or free.\n"
+        "# TYPE tfs_buffer_arena_bytes gauge\n"
+        "tfs_buffer_arena_bytes %uL\n"
+        "# HELP tfs_buffer_arena_high_water_bytes Sum of the per-worker peaks of tfs_buffer_arena_bytes.\n"
+        "# TYPE tfs_buffer_arena_high_water_bytes gauge\n"
+        "tfs_buffer_arena_high_water_bytes %uL\n",
+        total.arena_reused, total.arena_allocated, total.arena_bytes, total.arena_high_water);
+
+    ngx_http_tfs_budget_info(&budget_used, &budget);
+    b->last = ngx_sprintf(b->last,
+        "# TYPE tfs_buffer_budget_waits_total counter\n"
+        "tfs_buffer_budget_waits_total %uL\n"
+        "# TYPE tfs_buffer_budget_used_bytes gauge\n"
+        "tfs_buffer_budget_used_bytes %uz\n"
+        "# TYPE tfs_buffer_budget_bytes gauge\n"
+        "tfs_buffer_budget_bytes %uz\n",
+        total.budget_waits, budget_used, budget);
+
+    b->last = ngx_sprintf(b->last,
+        "# TYPE tfs_precompressed_total counter\n"
+        "tfs_precompressed_total %uL\n"
+        "# HELP tfs_precompress_saved_bytes_total Bytes saved by storing uploads gzip-compressed.\n"
+        "# TYPE tfs_precompress_saved_bytes_total counter\n"
+        "tfs_precompress_saved_bytes_total %uL\n"
+        "# HELP tfs_gunzip_total Compressed files decompressed for clients without gzip support.\n"
+        "# TYPE tfs_gunzip_total counter\n"
+        "tfs_gunzip_total %uL\n",
+        total.precompressed, total.precompress_saved, total.gunzipped);
+
+    b->last = ngx_sprintf(b->last,
+        "# HELP tfs_peer_forwarded_total GETs forwarded to the owner node in tfs_peers.\n"
+        "# TYPE tfs_peer_forwarded_total counter\n"
+        "tfs_peer_forwarded_total %uL\n"
+        "# TYPE tfs_peer_failures_total counter\n"
+        "tfs_peer_failures_total %uL\n"
+        "# HELP tfs_peer_spilled_total GETs not handled by their owner because it was over tfs_peer_load_factor.\n"
+        "# TYPE tfs_peer_spilled_total counter\n"
+        "tfs_peer_spilled_total %uL\n",
+        total.peer_forwarded, total.peer_failed, total.peer_spilled);
+
+    zones = (ngx_shm_zone_t **) tmcf->cache_zones.elts;
+    for (i = 0; i < tmcf->cache_zones.nelts; i++) {
+        ngx_http_tfs_cache_info(zones[i], &info);
+
+        b->last = ngx_sprintf(b->last,
+            "tfs_cache_hits_total{zone=\"%V\"} %uL\n"
+            "tfs_cache_misses_total{zone=\"%V\"} %uL\n"
+            "tfs_cache_inserts_total{zone=\"%V\"} %uL\n"
+            "tfs_cache_evictions_total{zone=\"%V\"} %uL\n"
+            "tfs_cache_bytes{zone=\"%V\"} %uz\n"
+            "tfs_cache_objects{zone=\"%V\"} %ui\n",
+            &zones[i]->shm.name, (uint64_t) info.hits,
+            &zones[i]->shm.name, (uint64_t) info.misses,
+            &zones[i]->shm.name, (uint64_t) info.inserts,
+            &zones[i]->shm.name, (uint64_t) info.evictions,
+            &zones[i]->shm.name, info.used,
+            &zones[i]->shm.name, info.count);
+    }
+
+    r->headers_out.content_type.len = sizeof("text/plain; version=0.0.4") - 1;
+    r->headers_out.content_type.data = (u_char *) "text/plain; version=0.0.4";
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->memory = 1;
+    b->last_buf = 1;
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+char *
+ngx_http_tfs_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_tfs_main_conf_t  *tmcf;
+
+    clcf = reinterpret_cast<ngx_http_core_loc_conf_t*>(
+                ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+    clcf->handler = ngx_http_tfs_status_handler;
+
+    tmcf = (ngx_http_tfs_main_conf_t *) ngx_http_conf_get_module_main_conf(cf, ngx_http_tfs_module);
+    tmcf->stats = 1;
+
+    return NGX_CONF_OK;
+}
+
+/* 取请求的ctx, 没有时分配 */
+ngx_http_tfs_ctx_t *
+ngx_http_tfs_request_ctx(ngx_http_request_t *r)
+{
+    ngx_http_tfs_ctx_t *ctx;
+
+    ctx = (ngx_http_tfs_ctx_t *) ngx_http_get_module_ctx(r, ngx_http_tfs_module);
+    if (ctx == NULL) {
+        ctx = (ngx_http_tfs_ctx_t *) ngx_pcalloc(r->pool, sizeof(ngx_http_tfs_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ngx_http_set_ctx(r, ctx, ngx_http_tfs_module);
+    }
+
+    return ctx;
+}
+
+/* 处理tfs请求时调用, 日志中不用$tfs_*变量时返回NULL, 调用方据此跳过记录 */
+ngx_http_tfs_ctx_t *
+ngx_http_tfs_get_ctx(ngx_http_request_t *r, u_char *name, size_t len)
+{
+    ngx_http_tfs_ctx_t *ctx;
+
+    if (!ngx_http_tfs_variables_used) {
+        return NULL;
+    }
+
+    ctx = ngx_http_tfs_request_ctx(r);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (name != NULL && len > 0) {
+        ctx->name.data = (u_char *) ngx_pnalloc(r->pool, len + 1);
+        if (ctx->name.data != NULL) {
+            ngx_cpystrn(ctx->name.data, name, len + 1);
+            ctx->name.len = len;
+        }
+    }
+
+    return ctx;
+}
+
+static ngx_http_tfs_ctx_t *
+ngx_http_tfs_variable_ctx(ngx_http_request_t *r, ngx_http_variable_value_t *v)
+{
+    ngx_http_tfs_ctx_t *ctx;
+
+    ctx = (ngx_http_tfs_ctx_t *) ngx_http_get_module_ctx(r, ngx_http_tfs_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+    }
+
+    return ctx;
+}
+
+static ngx_int_t
+ngx_http_tfs_variable_name(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL || ctx->name.len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ctx->name.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ctx->name.data;
+
+    return NGX_OK;
+}
+
+/* 以秒为单位, 精确到微秒, 如0.000350 */
+static ngx_int_t
+ngx_http_tfs_variable_time(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    uint64_t usec;
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(r->pool, NGX_INT64_LEN + 8);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    usec = *(uint64_t *) ((char *) ctx + data);
+
+    v->len = ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* 读文件时在handler中记下, 这里只格式化; 缓存命中和上传时没有 */
+static ngx_int_t
+ngx_http_tfs_variable_dataserver(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    if (ctx->dataserver == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    std::string addr = tbsys::CNetUtil::addrToString(ctx->dataserver);
+
+    p = (u_char *) ngx_pnalloc(r->pool, addr.length());
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memcpy(p, addr.c_str(), addr.length());
+
+    v->len = addr.length();
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_tfs_variable_block_id(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    if (ctx->name.len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    tfs::common::FSName fsname((const char *) ctx->name.data);
+    if (!fsname.is_valid()) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(r->pool, NGX_INT32_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uD", (uint32_t) fsname.get_block_id()) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_tfs_variable_bytes(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uz", ctx->bytes) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_tfs_variable_ret(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_http_tfs_ctx_t *ctx = ngx_http_tfs_variable_ctx(r, v);
+
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(r->pool, NGX_INT32_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%d", ctx->ret) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/* preconfiguration */
+ngx_int_t
+ngx_http_tfs_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_tfs_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return ngx_http_tfs_peer_add_variable(cf);
+}
+
+/*
+ * 配置解析完后看log_format等是否引用(索引)了$tfs_*变量, 没有引用时请求中
+ * 完全不分配上下文. 在master中执行, worker fork后继承.
+ * */
+ngx_int_t
+ngx_http_tfs_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t i;
+    ngx_http_variable_t *v;
+    ngx_http_core_main_conf_t *cmcf;
+
+    ngx_http_tfs_variables_used = 0;
+    ngx_http_tfs_stats_enabled = 0;
+
+    cmcf = (ngx_http_core_main_conf_t *) ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
+    if (cmcf == NULL) {
+        return NGX_OK;
+    }
+
+    v = (ngx_http_variable_t *) cmcf->variables.elts;
+    for (i = 0; i < cmcf->variables.nelts; i++) {
+        // $tfs_peer由proxy_pass引用, 与请求的tfs信息无关
+        if (v[i].name.len > sizeof("tfs_") - 1
+            && ngx_strncmp(v[i].name.data, "tfs_", sizeof("tfs_") - 1) == 0
+            && !(v[i].name.len == sizeof("tfs_peer") - 1
+                 && ngx_strncmp(v[i].name.data, "tfs_peer", sizeof("tfs_peer") - 1) == 0))
+        {
+            ngx_http_tfs_variables_used = 1;
+            ngx_http_tfs_stats_enabled = 1;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
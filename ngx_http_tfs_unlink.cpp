@@ -0,0 +1,427 @@
+/*
+ * 批量删除在几个线程中执行
+ *
+ * 一个批量删除请求最多有tfs_unlink_max_names个文件, 每个都要访问一次nameserver和
+ * dataserver. 在worker中顺序删除时, 整个批次期间worker上的其它请求都在等待.
+ * 这里把文件名复制到独立分配的内存, 起tfs_unlink_concurrency个线程从中取名字删除,
+ * worker定时检查是否都已完成, 完成后在worker中做统计, 清缓存并返回结果.
+ *
+ *   tfs_unlink_concurrency 8;   一个批次最多同时删除的文件数
+ *   tfs_unlink_timeout 10s;     批次的总时间, 到时线程不再取新的名字, 正在删除的做完
+ *
+ * 超时时只返回已处理的文件, 并带X-Tfs-Unlink-Remaining头给出未处理的个数, 客户端
+ * 对结果中没有的名字重试. 客户端断开时线程同样不再取新的名字.
+ *
+ * 线程由worker join, 批次在join之前挂在本worker的队列上, 请求先结束的也由定时检查
+ * join后释放. worker退出时先join所有线程(最多等正在进行的一次删除)再销毁TfsClient.
+ *
+ * 线程中只调用TfsClient::unlink, 不记日志也不写统计. TfsClient的超时是进程内全局的,
+ * worker在GET/PUT前按nameserver, 熔断和自适应超时不断改它. 有批次的线程在运行时,
+ * 超时固定为这些批次所在nameserver的tfs_timeout中最大的, 不再随请求改变, 所以
+ * 删除不会用到tfs_breaker_skip_timeout之类很短的超时; 代价是这段时间内本worker的
+ * 读取也用这个超时, 熔断时的快速换副本和自适应超时暂不生效.
+ * */
+#include "ngx_http_tfs_module.h"
+#include <pthread.h>
+#include <signal.h>
+
+
+using namespace tfs::client;
+using namespace tfs::common;
+
+#define NGX_HTTP_TFS_UNLINK_POLL 10         /* 检查批次是否完成的间隔, 毫秒 */
+#define NGX_HTTP_TFS_UNLINK_REMAINING "X-Tfs-Unlink-Remaining"
+
+typedef struct {
+    ngx_str_t name;                     /* 请求中的名字, 指向请求体 */
+    u_char tfsname[NGX_HTTP_TFS_NAME_LEN + 1];  /* 传给tfs的名字, 不带后缀 */
+    ngx_uint_t gzip;
+    ngx_uint_t valid;
+    int ret;
+    int64_t file_size;
+    volatile ngx_uint_t done;
+} ngx_http_tfs_unlink_item_t;
+
+typedef struct ngx_http_tfs_unlink_req_s ngx_http_tfs_unlink_req_t;
+
+/* 线程与请求共用, 用ngx_alloc分配, 由worker在join线程后释放 */
+typedef struct {
+    ngx_queue_t queue;                  /* 线程未join时在ngx_http_tfs_unlink_batches中 */
+    ngx_http_tfs_unlink_req_t *ur;      /* 请求已结束时为NULL */
+    pthread_t tids[NGX_HTTP_TFS_UNLINK_MAX_THREADS];
+    ngx_uint_t nthreads;
+    ngx_uint_t joined;
+    ngx_atomic_t next;                  /* 下一个待删除的下标 */
+    ngx_atomic_t running;               /* 还在运行的线程数 */
+    volatile ngx_uint_t abandoned;      /* 请求已结束或worker退出 */
+    uint64_t deadline;                  /* 微秒 */
+    ngx_msec_t timeout;                 /* 所在nameserver的tfs_timeout */
+    TfsUnlinkType action;
+    char *nsip;                         /* 复制在items之后 */
+    ngx_uint_t n;
+    ngx_http_tfs_unlink_item_t items[1];
+} ngx_http_tfs_unlink_batch_t;
+
+/* 请求pool中的部分, 请求结束时放弃批次 */
+struct ngx_http_tfs_unlink_req_s {
+    ngx_http_request_t *r;
+    ngx_http_tfs_ns_loc_conf_t *conf;
+    ngx_http_tfs_unlink_batch_t *batch;
+};
+
+
+static ngx_queue_t ngx_http_tfs_unlink_batches;
+static ngx_event_t ngx_http_tfs_unlink_event;           /* 定时检查各批次的线程是否已退出 */
+
+
+static uint64_t
+ngx_http_tfs_unlink_now()
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* 固定TfsClient的超时为还有线程的各批次中最大的, 没有批次时恢复按请求设置 */
+static void
+ngx_http_tfs_unlink_pin_timeout(ngx_msec_t timeout)
+{
+    ngx_queue_t *q;
+    ngx_http_tfs_unlink_batch_t *batch;
+
+    if (ngx_http_tfs_unlink_batches.next != NULL) {
+        for (q = ngx_queue_head(&ngx_http_tfs_unlink_batches);
+             q != ngx_queue_sentinel(&ngx_http_tfs_unlink_batches);
+             q = ngx_queue_next(q))
+        {
+            batch = ngx_queue_data(q, ngx_http_tfs_unlink_batch_t, queue);
+            timeout = ngx_max(timeout, batch->timeout);
+        }
+    }
+
+    ngx_http_tfs_client_pin_timeout(timeout);
+}
+
+/* 线程都已退出或即将退出, 不会等太久 */
+static void
+ngx_http_tfs_unlink_join(ngx_http_tfs_unlink_batch_t *batch)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < batch->nthreads; i++) {
+        pthread_join(batch->tids[i], NULL);
+    }
+
+    ngx_queue_remove(&batch->queue);
+    batch->joined = 1;
+}
+
+static void *
+ngx_http_tfs_unlink_thread(void *data)
+{
+    ngx_atomic_uint_t i;
+    ngx_http_tfs_unlink_item_t *it;
+    ngx_http_tfs_unlink_batch_t *batch = (ngx_http_tfs_unlink_batch_t *) data;
+    TfsClient *tfsclient = TfsClient::Instance();
+
+    for ( ;; ) {
+        if (batch->abandoned || ngx_http_tfs_unlink_now() >= batch->deadline) {
+            break;
+        }
+
+        i = ngx_atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->n) {
+            break;
+        }
+
+        it = &batch->items[i];
+        if (it->valid) {
+            it->ret = tfsclient->unlink(it->file_size, (const char *) it->tfsname,
+                                        it->gzip ? NGX_HTTP_TFS_GZIP_SUFFIX : NULL,
+                                        batch->nsip, batch->action);
+        }
+
+        // 结果写完后再置done, worker看到done时结果已可见
+        ngx_memory_barrier();
+        it->done = 1;
+    }
+
+    // 之后不再访问批次
+    (void) ngx_atomic_fetch_add(&batch->running, -1);
+
+    return NULL;
+}
+
+static void
+ngx_http_tfs_unlink_cleanup(void *data)
+{
+    ngx_http_tfs_unlink_req_t *ur = (ngx_http_tfs_unlink_req_t *) data;
+    ngx_http_tfs_unlink_batch_t *batch = ur->batch;
+
+    if (batch == NULL) {
+        return;
+    }
+
+    // 线程还未join的, 由定时检查join后释放
+    if (batch->joined) {
+        ngx_free(batch);
+    } else {
+        batch->abandoned = 1;
+        batch->ur = NULL;
+    }
+    ur->batch = NULL;
+}
+
+/* 所有线程都已退出, 在worker中统计, 清缓存, 输出结果 */
+static ngx_int_t
+ngx_http_tfs_unlink_finish(ngx_http_tfs_unlink_req_t *ur)
+{
+    ngx_uint_t i, remaining;
+    ngx_str_t name;
+    ngx_buf_t *b;
+    ngx_table_elt_t *h;
+    ngx_http_request_t *r = ur->r;
+    ngx_http_tfs_unlink_batch_t *batch = ur->batch;
+    ngx_http_tfs_unlink_item_t *it;
+
+    b = ngx_create_temp_buf(r->pool, batch->n * (NGX_HTTP_TFS_NAME_LEN + 2 * NGX_INT64_LEN + 3));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memory_barrier();
+
+    remaining = 0;
+    for (i = 0; i < batch->n; i++) {
+        it = &batch->items[i];
+
+        if (!it->done) {
+            remaining++;
+            continue;
+        }
+
+        if (it->valid) {
+            ngx_http_tfs_unlink_done(r, ur->conf, &it->name, it->tfsname, it->gzip, it->ret);
+        }
+
+        // 名字过长的不会被删除, 输出时截断以免超出预分配的buffer
+        name = it->name;
+        if (name.len > NGX_HTTP_TFS_NAME_LEN) {
+            name.len = NGX_HTTP_TFS_NAME_LEN;
+        }
+        b->last = ngx_sprintf(b->last, "%V %i %L\n", &name, (ngx_int_t) it->ret, it->file_size);
+    }
+
+    if (remaining) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "ngx_tfs_mods: tfs_unlink_timeout reached, %ui of %ui names not processed",
+            remaining, batch->n);
+
+        h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->value.data = (u_char *) ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+        if (h->value.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->hash = 1;
+        ngx_str_set(&h->key, NGX_HTTP_TFS_UNLINK_REMAINING);
+        h->value.len = ngx_sprintf(h->value.data, "%ui", remaining) - h->value.data;
+    }
+
+    return ngx_http_tfs_unlink_send(r, b);
+}
+
+static void
+ngx_http_tfs_unlink_poll(ngx_event_t *ev)
+{
+    ngx_queue_t *q, *next;
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+    ngx_http_tfs_unlink_req_t *ur;
+    ngx_http_tfs_unlink_batch_t *batch;
+
+    for (q = ngx_queue_head(&ngx_http_tfs_unlink_batches);
+         q != ngx_queue_sentinel(&ngx_http_tfs_unlink_batches);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        batch = ngx_queue_data(q, ngx_http_tfs_unlink_batch_t, queue);
+
+        if (batch->running) {
+            continue;
+        }
+
+        ngx_http_tfs_unlink_join(batch);
+
+        ur = batch->ur;
+        if (ur == NULL) {
+            ngx_free(batch);
+            continue;
+        }
+
+        // 批次此后由请求的cleanup释放
+        r = ur->r;
+        c = r->connection;
+
+        ngx_http_finalize_request(r, ngx_http_tfs_unlink_finish(ur));
+        ngx_http_run_posted_requests(c);
+    }
+
+    ngx_http_tfs_unlink_pin_timeout(0);
+
+    if (!ngx_queue_empty(&ngx_http_tfs_unlink_batches)) {
+        ngx_add_timer(ev, NGX_HTTP_TFS_UNLINK_POLL);
+    }
+}
+
+/*
+ * 在读完请求体后调用, names为各文件名. 返回NGX_DONE时线程已开始删除,
+ * 完成后由定时检查结束请求; 其它为应返回的状态码
+ * */
+ngx_int_t
+ngx_http_tfs_unlink_batch_start(ngx_http_request_t *r, ngx_http_tfs_ns_loc_conf_t *conf,
+    ngx_array_t *names, TfsUnlinkType action)
+{
+    int err;
+    size_t size;
+    ngx_uint_t i, nthreads;
+    ngx_str_t *name;
+    sigset_t set, old;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_tfs_unlink_req_t *ur;
+    ngx_http_tfs_unlink_batch_t *batch;
+    ngx_http_tfs_unlink_item_t *it;
+
+    size = sizeof(ngx_http_tfs_unlink_batch_t)
+           + (names->nelts - 1) * sizeof(ngx_http_tfs_unlink_item_t)
+           + conf->cluster->nsip.len + 1;
+    batch = (ngx_http_tfs_unlink_batch_t *) ngx_alloc(size, r->connection->log);
+    if (batch == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_memzero(batch, size);
+
+    batch->action = action;
+    batch->n = names->nelts;
+    batch->deadline = ngx_http_tfs_unlink_now() + (uint64_t) conf->unlink_timeout * 1000;
+    batch->timeout = conf->cluster->timeout;
+    batch->nsip = (char *) &batch->items[batch->n];
+    ngx_cpystrn((u_char *) batch->nsip, conf->cluster->nsip.data, conf->cluster->nsip.len + 1);
+
+    name = (ngx_str_t *) names->elts;
+    for (i = 0; i < batch->n; i++) {
+        it = &batch->items[i];
+        it->name = name[i];
+        it->ret = TFS_ERROR;
+        it->valid = (ngx_http_tfs_unlink_parse(&name[i], it->tfsname, &it->gzip) == NGX_OK);
+    }
+
+    // 请求先于线程结束时由cleanup放弃批次, 线程只用批次中的内容
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_tfs_unlink_req_t));
+    if (cln == NULL) {
+        ngx_free(batch);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ur = (ngx_http_tfs_unlink_req_t *) cln->data;
+    ngx_memzero(ur, sizeof(ngx_http_tfs_unlink_req_t));
+    ur->r = r;
+    ur->conf = conf;
+    ur->batch = batch;
+    cln->handler = ngx_http_tfs_unlink_cleanup;
+
+    // 没有线程时由cleanup直接释放
+    batch->joined = 1;
+
+    nthreads = ngx_min(conf->unlink_concurrency, batch->n);
+
+    // 在线程开始前固定超时
+    ngx_http_tfs_unlink_pin_timeout(batch->timeout);
+
+    // 信号只由worker的主线程处理
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+
+    for (i = 0; i < nthreads; i++) {
+        (void) ngx_atomic_fetch_add(&batch->running, 1);
+
+        err = pthread_create(&batch->tids[i], NULL, ngx_http_tfs_unlink_thread, batch);
+        if (err != 0) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, err,
+                "ngx_tfs_mods: pthread_create() for batch unlink failed");
+            (void) ngx_atomic_fetch_add(&batch->running, -1);
+            break;
+        }
+        batch->nthreads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (batch->nthreads == 0) {
+        ngx_http_tfs_unlink_pin_timeout(0);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    batch->ur = ur;
+    batch->joined = 0;
+
+    if (ngx_http_tfs_unlink_batches.next == NULL) {
+        ngx_queue_init(&ngx_http_tfs_unlink_batches);
+    }
+    ngx_queue_insert_tail(&ngx_http_tfs_unlink_batches, &batch->queue);
+
+    if (!ngx_http_tfs_unlink_event.timer_set) {
+        ngx_http_tfs_unlink_event.handler = ngx_http_tfs_unlink_poll;
+        ngx_http_tfs_unlink_event.log = ngx_cycle->log;
+        ngx_add_timer(&ngx_http_tfs_unlink_event, NGX_HTTP_TFS_UNLINK_POLL);
+    }
+
+    // 与读取请求体一样, 增加引用计数后返回NGX_DONE, 等待期间检测客户端断开
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_DONE;
+}
+
+/* worker退出时在销毁TfsClient前调用, 等各线程结束正在进行的删除 */
+void
+ngx_http_tfs_unlink_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_t *q;
+    ngx_http_tfs_unlink_batch_t *batch;
+
+    if (ngx_http_tfs_unlink_batches.next == NULL) {
+        return;
+    }
+
+    for (q = ngx_queue_head(&ngx_http_tfs_unlink_batches);
+         q != ngx_queue_sentinel(&ngx_http_tfs_unlink_batches);
+         q = ngx_queue_next(q))
+    {
+        batch = ngx_queue_data(q, ngx_http_tfs_unlink_batch_t, queue);
+        batch->abandoned = 1;
+    }
+
+    while (!ngx_queue_empty(&ngx_http_tfs_unlink_batches)) {
+        batch = ngx_queue_data(ngx_queue_head(&ngx_http_tfs_unlink_batches),
+                               ngx_http_tfs_unlink_batch_t, queue);
+
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+            "ngx_tfs_mods: waiting for %ui batch unlink threads", batch->nthreads);
+        ngx_http_tfs_unlink_join(batch);
+
+        // 请求的pool此后不会再销毁, 批次在这里释放
+        if (batch->ur) {
+            batch->ur->batch = NULL;
+        }
+        ngx_free(batch);
+    }
+
+    ngx_http_tfs_client_pin_timeout(0);
+}
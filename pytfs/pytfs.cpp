@@ -17,6 +17,19 @@
 // tfs2.0 版本接口变化比较大，文件操作的open，write类接口直接把tfs_前辍去除了
 static const char* __SUPPORT__ = "support tfs-stable-2.0";
 #include <Python.h>
+#include <pthread.h>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <list>
+#include <map>
+#include <string>
 
 #include "tfs_client_api.h"
 #include "func.h"
@@ -26,26 +39,108 @@ using namespace tfs::client;
 using namespace tfs::common;
 using namespace std;
 
-//每次发送数据大小
+//每次发送数据大小, 可用set_chunk_size或环境变量PYTFS_CHUNK_SIZE调整, 见bench/pytfs_bench.py
 static Py_ssize_t WROTE_PRE_ONE = 1 * 1024 * 1024;
+// 按4K对齐(get_file的O_DIRECT要求), 限制在4K到64M之间
+#define CHUNK_ALIGN 4096
+#define CHUNK_MAX (64 * 1024 * 1024)
+
+// 读buffer按64K/256K/2M分级复用, 避免每次get都new/delete整个文件大小的内存;
+// 更大的文件仍直接new. 空闲buffer的链表指针放在buffer开头
+#define BUFFER_CLASSES 3
+static const int64_t buffer_sizes[BUFFER_CLASSES] = {64 * 1024, 256 * 1024, 2 * 1024 * 1024};
+static char* buffer_free[BUFFER_CLASSES];
+static int64_t buffer_max = 32 * 1024 * 1024;   // 空闲链表中最多留的字节数
+static int64_t buffer_cached = 0;
+static int64_t buffer_total = 0;                // 借出的与空闲的合计
+static int64_t buffer_high_water = 0;
+static int64_t buffer_reused = 0;
+static int64_t buffer_allocated = 0;
+// 读写tfs时已释放GIL, 空闲链表和计数要自己加锁
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define NS_ADDR_LEN 64
 
 typedef struct {
     PyObject_HEAD
     PyObject *dict;                 /* Python attributes dictionary */
     TfsClient *tfs_handle;
     int fd;                         /* tfs file fd,when call open to return */
+    char ns_addr[NS_ADDR_LEN];      /* init时的nameserver, 每次调用都带上, 各对象可连不同集群 */
 } TfsClientObject;
 
 static PyObject *ErrorObject = NULL;
 static PyTypeObject *p_TfsClient_Type = NULL;
 
+// TfsClient::Instance()是进程内唯一的, 只初始化一次, 不随Python对象析构;
+// 各集群的连接与block缓存由tfs按nameserver地址分别维护.
+// fork后子进程中的tfs后台线程已不存在, 不能继续使用父进程初始化过的client
+static pid_t client_pid = 0;                     // 初始化tfs client的进程
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CLIENT_NS(self) ((self)->ns_addr[0] ? (self)->ns_addr : (const char*)NULL)
+
+// 在本进程中初始化tfs client, 已初始化时直接返回. 出错时设置异常返回-1
+static int _client_init(TfsClientObject *self)
+{
+	pid_t pid = getpid();
+	int ret = TFS_SUCCESS;
+
+	if (client_pid == pid)
+		return 0;
+
+	if (0 != client_pid) {
+		PyErr_Format(ErrorObject, "tfs client was initialized in process %d before fork, "
+				"use init(..., lazy = True) in the parent", (int)client_pid);
+		return -1;
+	}
+
+	if (0 == self->ns_addr[0]) {
+		PyErr_SetString(ErrorObject, "call init() first");
+		return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&client_mutex);
+	if (client_pid != pid) {
+		ret = self->tfs_handle->initialize(self->ns_addr);
+		if (TFS_SUCCESS == ret)
+			client_pid = pid;
+	}
+	pthread_mutex_unlock(&client_mutex);
+	Py_END_ALLOW_THREADS
+
+	if (TFS_SUCCESS != ret) {
+		TBSYS_LOG(ERROR, "connect to name_server[%s] failed.", self->ns_addr);
+		PyErr_Format(ErrorObject, "connect to name_server[%s] failed, ret = %d", self->ns_addr, ret);
+		return -1;
+	}
+	return 0;
+}
+
+static void _client_destroy(void)
+{
+	if (client_pid == getpid())
+		TfsClient::Instance()->destroy();
+}
+
+// fork时其他线程可能正持有这些锁, 子进程中重新初始化
+static void _client_atfork_child(void)
+{
+	pthread_mutex_init(&client_mutex, NULL);
+	pthread_mutex_init(&buffer_mutex, NULL);
+}
+
 static const char module_doc [] =
 "This module implements an interface to the tfs client library.\n"
 "version() -> tuple.  Return version information.\n"
-"注意：非线程安全, 且没实现delete等接口\n not safe in multi threading\n"
+"调用tfs时会释放GIL, 多个线程可共用一个TfsClient, 但同一个fd不能在多个线程中同时使用\n"
+"blocking tfs calls release the GIL; do not share one fd between threads\n"
 ">>> import pytfs\n"
 ">>> tfs = pytfs.TfsClient()\n"
 ">>> tfs.init('127.0.0.1:8018')\n"
+">>> tfs2 = pytfs.TfsClient(); tfs2.init('10.0.0.2:8108') # another cluster, used independently\n"
+">>> tfs.init('127.0.0.1:8018', 300, 500, True) # lazy, connect on first use (init before fork)\n"
 ">>> tfs.open(None, pytfs.WRITE_MODE, None) # return fd\n"
 ">>> tfs.write('abcd')\n"
 ">>> tfs.close() #end write and return T1XXXXXXX\n"
@@ -53,8 +148,20 @@ static const char module_doc [] =
 ">>> tfs.read(fd, count) #return count stream from file\n"
 ">>> tfs.close()#end read\n"
 "#or you can use the easy function:\n"
-">>> tfs.put(stream) # put a new file to tfs.\n"
+">>> tfs.put(stream) # put a new file to tfs, stream can be str/bytearray/memoryview/mmap.\n"
 ">>> tfs.get('T1xxxxxxx') # get a file from tfs.\n"
+">>> tfs.readinto('T1xxxxxxx', bytearray(size)) # read into a writable buffer, return size.\n"
+">>> tfs.unlink('T1xxxxxxx') # delete a file, return file size.\n"
+">>> tfs.unlink_many(['T1xxxxxxx', 'T1yyyyyyy']) # [(ret, file_size), ...]\n"
+">>> with tfs.open_file('T1xxxxxxx') as f: shutil.copyfileobj(f, out) # stream a large file\n"
+">>> tfs.put_file('/path/to/file') # (tfsname, size, bytes_per_second)\n"
+">>> tfs.get_file('T1xxxxxxx', '/path/to/file') # (size, bytes_per_second)\n"
+">>> tfs.get_many(['T1xxxxxxx', 'T1yyyyyyy'], 8) # [str or None, ...], 8 threads\n"
+">>> tfs.put_many([stream1, stream2], 8) # [tfsname or False, ...]\n"
+">>> e = tfs.executor(64); e.get('T1xxxxxxx') # job id, e.completed() when e.fileno() is readable\n"
+">>> pytfs.buffer_stats() # reuse of read buffers\n"
+">>> pytfs.set_chunk_size(4 << 20) # bytes per tfs read/write call, see bench/pytfs_bench.py\n"
+">>> pytfs.set_cache(64 << 20, '/dev/shm/pytfs.cache') # cache get() in process and across processes\n"
 ;
 static const char *tfsclient_doc = module_doc;
 
@@ -100,6 +207,85 @@ do_pytfs_setloglevel(PyObject *self, PyObject *args)
 	return Py_None;
 }
 
+static Py_ssize_t _chunk_size(PY_LONG_LONG size)
+{
+	if (size < CHUNK_ALIGN)
+		return CHUNK_ALIGN;
+	if (size > CHUNK_MAX)
+		return CHUNK_MAX;
+	return (Py_ssize_t)((size + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN);
+}
+
+static char pytfs_set_chunk_size_doc [] = "set_chunk_size(bytes) default = 1M;\n"
+		"每次调用tfs read/write的最大字节数, 按4K对齐, 范围4K到64M\n"
+		"-> return 之前的大小\n";
+static PyObject *
+do_pytfs_set_chunk_size(PyObject *self, PyObject *args)
+{
+	PY_LONG_LONG size = 0;
+	Py_ssize_t old = WROTE_PRE_ONE;
+
+	if (!PyArg_ParseTuple(args, "L:set_chunk_size", &size))
+		return NULL;
+
+	// 已在读写的调用每段重新取值, 不需要加锁
+	WROTE_PRE_ONE = _chunk_size(size);
+	return PyInt_FromSsize_t(old);
+}
+
+static char pytfs_buffer_stats_doc [] = "buffer_stats() -> dict\n"
+		"读buffer复用的统计: reused/allocated为复用与新分配的次数, \n"
+		"bytes/high_water为当前与最高占用, cached为空闲待复用的字节数\n";
+static PyObject *
+do_pytfs_buffer_stats(PyObject *self, PyObject *args)
+{
+	PY_LONG_LONG reused, allocated, total, high_water, cached;
+
+	pthread_mutex_lock(&buffer_mutex);
+	reused = buffer_reused;
+	allocated = buffer_allocated;
+	total = buffer_total;
+	high_water = buffer_high_water;
+	cached = buffer_cached;
+	pthread_mutex_unlock(&buffer_mutex);
+
+	return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L}",
+			"reused", reused,
+			"allocated", allocated,
+			"bytes", total,
+			"high_water", high_water,
+			"cached", cached);
+}
+
+static char pytfs_set_buffer_arena_doc [] = "set_buffer_arena(max_bytes) default = 32M;\n"
+		"最多保留多少字节的空闲读buffer供复用, 0为不保留\n"
+		"-> return None\n";
+static PyObject *
+do_pytfs_set_buffer_arena(PyObject *self, PyObject *args)
+{
+	PY_LONG_LONG max_bytes = 0;
+
+	if (!PyArg_ParseTuple(args, "L:set_buffer_arena", &max_bytes))
+		return NULL;
+
+	pthread_mutex_lock(&buffer_mutex);
+	buffer_max = max_bytes > 0 ? max_bytes : 0;
+	// 多出的空闲buffer立即释放
+	for (int i = 0; i < BUFFER_CLASSES; i++) {
+		while (buffer_free[i] != NULL && buffer_cached > buffer_max) {
+			char* buffer = buffer_free[i];
+			buffer_free[i] = *(char**)buffer;
+			buffer_cached -= buffer_sizes[i];
+			buffer_total -= buffer_sizes[i];
+			delete[] buffer;
+		}
+	}
+	pthread_mutex_unlock(&buffer_mutex);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 // 构造函数
 static char tfsclient_new_doc [] = "Create new instances of Class TfsClient. \n"
 		"you must call init() to initialize it.\n";
@@ -116,6 +302,8 @@ tfsclient_new(PyObject *dummy)
 	self->tfs_handle = TfsClient::Instance();
 	if (self->tfs_handle == NULL)
 		goto error;
+	self->fd = 0;
+	self->ns_addr[0] = '\0';
 
 	self->dict = PyDict_New();
 	if(self->dict == NULL)
@@ -136,7 +324,7 @@ _tfsclient_dealloc(TfsClientObject *self)
 {
     PyObject_GC_UnTrack(self);
     Py_TRASHCAN_SAFE_BEGIN(self)
-    self->tfs_handle->destroy();
+    // 不再destroy共用的client, 其他对象还在用; 进程退出时由_client_destroy释放
     self->tfs_handle = NULL;
     Py_XDECREF(self->dict); 
     PyObject_GC_Del(self);
@@ -146,9 +334,7 @@ _tfsclient_dealloc(TfsClientObject *self)
 static int
 _tfsclient_clear(TfsClientObject *self)
 {
-	self->tfs_handle->destroy();
-    self->tfs_handle = NULL;
-    Py_XDECREF(self->dict); 
+    Py_CLEAR(self->dict);
     return 0;
 }
 
@@ -159,30 +345,38 @@ _tfsclient_traverse(TfsClientObject *self, visitproc visit, void *arg)
 }
 
 static char tfsclient_initialize_doc [] =
-	"tfsclient.init('127.0.0.1:8108', cacheTimeBySeconds = 300, cacheItems = 500) -> True or False";
+	"tfsclient.init('127.0.0.1:8108', cacheTimeBySeconds = 300, cacheItems = 500, lazy = False) -> True or False\n"
+	"可以创建多个TfsClient分别init到不同的集群. 进程内第一次init时初始化tfs client, 之后的只记录地址.\n"
+	"lazy为True时推迟到第一次读写时才初始化, 先init再fork出多个worker时使用";
 static PyObject *
 tfsclient_initialize(TfsClientObject *self, PyObject *args)
 {
 	const char *ns_ip_port = NULL;
 	int cache_time = 300;
 	int cache_items = 500;
-	int ret = 0;
+	PyObject *lazy = Py_False;
 
-	if (!PyArg_ParseTuple(args, "s|ii", &ns_ip_port, &cache_time, &cache_items))
+	if (!PyArg_ParseTuple(args, "s|iiO", &ns_ip_port, &cache_time, &cache_items, &lazy))
 		goto error;
 
-	if (NULL == ns_ip_port){
+	if (NULL == ns_ip_port || strlen(ns_ip_port) >= NS_ADDR_LEN){
 		PyErr_SetString(PyExc_TypeError, "invalid arguments to initialize.");
-		goto error;
+		return NULL;
 	}
+	strcpy(self->ns_addr, ns_ip_port);
 
+	if (PyObject_IsTrue(lazy))
+		goto done;
 
-	ret = self->tfs_handle->initialize(ns_ip_port);
-	if (TFS_SUCCESS != ret) {
-		TBSYS_LOG(ERROR, "connect to name_server[%s] failed.", ns_ip_port);
+	if (0 != _client_init(self)) {
+		// fork后使用等调用错误抛异常, 连接失败仍返回False
+		if (client_pid != 0)
+			return NULL;
+		PyErr_Clear();
 		goto error;
 	}
 
+done:
 	Py_INCREF(Py_True);
 	return Py_True;
 
@@ -210,6 +404,9 @@ tfsclient_open(TfsClientObject *self, PyObject *args)
     int fd = 0;
     int mode ;
 
+    if (0 != _client_init(self))
+        return NULL;
+
     if (!PyArg_ParseTuple(args, "OOi:open", &ofname, &osuffix, &mode)){
         PyErr_SetString(PyExc_TypeError, "invalid arguments to open");
         goto error;
@@ -224,7 +421,9 @@ tfsclient_open(TfsClientObject *self, PyObject *args)
     }
 
     // TODO: 没处理appKey参数, 大文件要appKey
-    fd = self->tfs_handle->open(file_name, suffix,(const char*)NULL, mode);
+    Py_BEGIN_ALLOW_THREADS
+    fd = self->tfs_handle->open(file_name, suffix, CLIENT_NS(self), mode);
+    Py_END_ALLOW_THREADS
     if (fd > 0)
     {
         self->fd = fd;
@@ -235,6 +434,471 @@ error:
 	return Py_BuildValue("i", 0);
 }
 
+static int _buffer_class(int64_t size)
+{
+	for (int i = 0; i < BUFFER_CLASSES; i++) {
+		if (size <= buffer_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+char* _buffer_alloc(int64_t size)
+{
+	int cls = _buffer_class(size);
+	char* buffer = NULL;
+
+	if (cls < 0)
+		return new char[size];
+
+	pthread_mutex_lock(&buffer_mutex);
+	if (NULL != buffer_free[cls]) {
+		buffer = buffer_free[cls];
+		buffer_free[cls] = *(char**)buffer;
+		buffer_cached -= buffer_sizes[cls];
+		buffer_reused++;
+		pthread_mutex_unlock(&buffer_mutex);
+		return buffer;
+	}
+
+	buffer_allocated++;
+	buffer_total += buffer_sizes[cls];
+	if (buffer_total > buffer_high_water)
+		buffer_high_water = buffer_total;
+	pthread_mutex_unlock(&buffer_mutex);
+
+	// new放在锁外, 失败时抛异常, 不会回到这里
+	return new char[buffer_sizes[cls]];
+}
+
+// size须与_buffer_alloc时相同
+void _buffer_free(char* buffer, int64_t size)
+{
+	int cls = _buffer_class(size);
+
+	if (cls < 0) {
+		delete[] buffer;
+		return;
+	}
+
+	pthread_mutex_lock(&buffer_mutex);
+	if (buffer_cached + buffer_sizes[cls] > buffer_max) {
+		buffer_total -= buffer_sizes[cls];
+		pthread_mutex_unlock(&buffer_mutex);
+		delete[] buffer;
+		return;
+	}
+
+	*(char**)buffer = buffer_free[cls];
+	buffer_free[cls] = buffer;
+	buffer_cached += buffer_sizes[cls];
+	pthread_mutex_unlock(&buffer_mutex);
+}
+
+// 文件缓存, 用set_cache()开启. tfs文件名对应的内容不变, 直接以文件名为key:
+// 1) 进程内按字节数限制的LRU, 命中时直接返回缓存的str对象
+// 2) 可选的共享内存(tmpfs上的文件mmap), 同一台机器上的进程共用, 按写入顺序环形淘汰
+// 都只在持有GIL时访问
+#define CACHE_SHM_MAGIC 0x70746663
+#define CACHE_SHM_NAME_LEN 64
+#define CACHE_SHM_PROBE 8
+#define CACHE_SHM_SLOT_BYTES (16 * 1024)    // 每个索引槽对应的平均文件大小
+
+typedef struct {
+	PyObject *data;
+	string name;
+} cache_entry_t;
+
+typedef list<cache_entry_t> cache_lru_t;
+
+static cache_lru_t cache_lru;                       // 头部为最近使用
+static map<string, cache_lru_t::iterator> cache_index;
+static int64_t cache_max = 0;
+static int64_t cache_bytes = 0;
+static int64_t cache_hits = 0;
+static int64_t cache_shm_hits = 0;
+static int64_t cache_misses = 0;
+
+typedef struct {
+	char name[CACHE_SHM_NAME_LEN];
+	uint64_t pos;                       /* 在数据区中的绝对写入位置 */
+	uint64_t size;
+} cache_slot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t nslots;
+	uint64_t data_size;
+	uint64_t write_pos;                 /* 只增不减, 取模后为数据区中的偏移 */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	pthread_mutex_t mutex;              /* 进程间共享, 持锁进程退出时可恢复 */
+} cache_shm_t;
+
+static cache_shm_t *cache_shm = NULL;
+static size_t cache_shm_size = 0;
+
+#define CACHE_SHM_SLOTS(shm) ((cache_slot_t*)((char*)(shm) + sizeof(cache_shm_t)))
+#define CACHE_SHM_DATA(shm) ((char*)CACHE_SHM_SLOTS(shm) + (shm)->nslots * sizeof(cache_slot_t))
+
+static uint32_t _cache_hash(const char *name)
+{
+	uint32_t h = 5381;
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+static int _cache_shm_lock()
+{
+	int rc = pthread_mutex_lock(&cache_shm->mutex);
+	if (EOWNERDEAD == rc) {
+		// 持锁的进程异常退出, 数据可能只写了一半, 清空索引
+		memset(CACHE_SHM_SLOTS(cache_shm), 0, cache_shm->nslots * sizeof(cache_slot_t));
+		pthread_mutex_consistent(&cache_shm->mutex);
+		rc = 0;
+	}
+	return rc;
+}
+
+static cache_slot_t *_cache_shm_find(const char *name)
+{
+	cache_slot_t *slots = CACHE_SHM_SLOTS(cache_shm);
+	cache_slot_t *slot = NULL;
+	uint32_t h = _cache_hash(name);
+
+	for (int i = 0; i < CACHE_SHM_PROBE; i++) {
+		slot = &slots[(h + i) % cache_shm->nslots];
+		if (0 != slot->size && 0 == strcmp(slot->name, name)
+				&& cache_shm->write_pos - slot->pos <= cache_shm->data_size)
+			return slot;
+	}
+	return NULL;
+}
+
+static PyObject *_cache_shm_get(const char *name)
+{
+	PyObject *pString = NULL;
+	cache_slot_t *slot = NULL;
+
+	if (NULL == cache_shm || strlen(name) >= CACHE_SHM_NAME_LEN || 0 != _cache_shm_lock())
+		return NULL;
+
+	slot = _cache_shm_find(name);
+	if (NULL != slot) {
+		pString = PyString_FromStringAndSize(CACHE_SHM_DATA(cache_shm) + slot->pos % cache_shm->data_size, slot->size);
+		if (NULL == pString)
+			PyErr_Clear();
+	}
+	if (NULL != pString)
+		cache_shm->hits++;
+	else
+		cache_shm->misses++;
+	pthread_mutex_unlock(&cache_shm->mutex);
+	return pString;
+}
+
+static void _cache_shm_put(const char *name, const char *data, uint64_t size)
+{
+	cache_slot_t *slots = NULL;
+	cache_slot_t *slot = NULL;
+	uint64_t offset = 0;
+	uint32_t h = 0;
+
+	if (NULL == cache_shm || strlen(name) >= CACHE_SHM_NAME_LEN)
+		return;
+	if (0 == size || size > cache_shm->data_size / 8 || 0 != _cache_shm_lock())
+		return;
+
+	slots = CACHE_SHM_SLOTS(cache_shm);
+	if (NULL != _cache_shm_find(name))
+		goto done;
+
+	// 数据不跨过数据区末尾, 放不下时从头开始写
+	offset = cache_shm->write_pos % cache_shm->data_size;
+	if (offset + size > cache_shm->data_size)
+		cache_shm->write_pos += cache_shm->data_size - offset;
+
+	// 优先用空的或已被覆盖的槽, 都不是时替换第一个
+	h = _cache_hash(name);
+	slot = &slots[h % cache_shm->nslots];
+	for (int i = 0; i < CACHE_SHM_PROBE; i++) {
+		cache_slot_t *s = &slots[(h + i) % cache_shm->nslots];
+		if (0 == s->size || cache_shm->write_pos + size - s->pos > cache_shm->data_size) {
+			slot = s;
+			break;
+		}
+	}
+
+	memcpy(CACHE_SHM_DATA(cache_shm) + cache_shm->write_pos % cache_shm->data_size, data, size);
+	strcpy(slot->name, name);
+	slot->pos = cache_shm->write_pos;
+	slot->size = size;
+	cache_shm->write_pos += size;
+	cache_shm->inserts++;
+
+done:
+	pthread_mutex_unlock(&cache_shm->mutex);
+}
+
+static void _cache_shm_remove(const char *name)
+{
+	cache_slot_t *slot = NULL;
+
+	if (NULL == cache_shm || strlen(name) >= CACHE_SHM_NAME_LEN || 0 != _cache_shm_lock())
+		return;
+	slot = _cache_shm_find(name);
+	if (NULL != slot)
+		slot->size = 0;
+	pthread_mutex_unlock(&cache_shm->mutex);
+}
+
+// 打开或创建共享缓存文件, 已存在时沿用其大小
+static int _cache_shm_open(const char *path, int64_t size)
+{
+	struct stat st;
+	cache_shm_t *shm = NULL;
+	pthread_mutexattr_t attr;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+	if (fd < 0)
+		return -1;
+
+	// 只在创建时加文件锁, 防止多个进程同时初始化
+	if (0 != flock(fd, LOCK_EX) || 0 != fstat(fd, &st))
+		goto error;
+
+	if (st.st_size < (off_t)sizeof(cache_shm_t)) {
+		if (size < (int64_t)(sizeof(cache_shm_t) + 1024 * 1024) || 0 != ftruncate(fd, size))
+			goto error;
+		st.st_size = size;
+	}
+
+	shm = (cache_shm_t*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == shm) {
+		shm = NULL;
+		goto error;
+	}
+
+	if (CACHE_SHM_MAGIC != shm->magic) {
+		memset(shm, 0, sizeof(cache_shm_t));
+		shm->nslots = st.st_size / CACHE_SHM_SLOT_BYTES;
+		shm->data_size = st.st_size - sizeof(cache_shm_t) - shm->nslots * sizeof(cache_slot_t);
+		memset(CACHE_SHM_SLOTS(shm), 0, shm->nslots * sizeof(cache_slot_t));
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&shm->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		shm->magic = CACHE_SHM_MAGIC;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+	cache_shm = shm;
+	cache_shm_size = st.st_size;
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static void _cache_shm_close()
+{
+	if (NULL != cache_shm)
+		munmap(cache_shm, cache_shm_size);
+	cache_shm = NULL;
+	cache_shm_size = 0;
+}
+
+static void _cache_evict(int64_t max_bytes)
+{
+	while (cache_bytes > max_bytes && !cache_lru.empty()) {
+		cache_entry_t &entry = cache_lru.back();
+		cache_bytes -= PyString_GET_SIZE(entry.data);
+		cache_index.erase(entry.name);
+		Py_DECREF(entry.data);
+		cache_lru.pop_back();
+	}
+}
+
+#define CACHE_KEY_LEN (NS_ADDR_LEN + TFS_FILE_LEN + 64)
+
+// 不同集群的文件名可能相同, 缓存的key带上nameserver地址. 文件名过长时返回NULL, 不缓存
+static const char *_cache_key(TfsClientObject *self, const char *name, char *key)
+{
+	int n = snprintf(key, CACHE_KEY_LEN, "%s/%s", self->ns_addr, name);
+	return n < CACHE_KEY_LEN ? key : NULL;
+}
+
+// 命中时返回新引用, 未开启或未命中返回NULL
+static PyObject *_cache_get(const char *name)
+{
+	map<string, cache_lru_t::iterator>::iterator it;
+	PyObject *pString = NULL;
+
+	if (NULL == name || (0 == cache_max && NULL == cache_shm))
+		return NULL;
+
+	it = cache_index.find(name);
+	if (it != cache_index.end()) {
+		cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+		cache_hits++;
+		Py_INCREF(it->second->data);
+		return it->second->data;
+	}
+
+	pString = _cache_shm_get(name);
+	if (NULL == pString) {
+		cache_misses++;
+		return NULL;
+	}
+
+	cache_shm_hits++;
+	if (PyString_GET_SIZE(pString) <= cache_max / 8) {
+		cache_entry_t entry;
+		entry.data = pString;
+		entry.name = name;
+		Py_INCREF(pString);
+		cache_lru.push_front(entry);
+		cache_index[name] = cache_lru.begin();
+		cache_bytes += PyString_GET_SIZE(pString);
+		_cache_evict(cache_max);
+	}
+	return pString;
+}
+
+static void _cache_put(const char *name, PyObject *pString)
+{
+	Py_ssize_t size = PyString_GET_SIZE(pString);
+
+	if (NULL == name)
+		return;
+
+	// 单个文件最多占LRU的1/8
+	if (0 < size && size <= cache_max / 8 && cache_index.find(name) == cache_index.end()) {
+		cache_entry_t entry;
+		entry.data = pString;
+		entry.name = name;
+		Py_INCREF(pString);
+		cache_lru.push_front(entry);
+		cache_index[name] = cache_lru.begin();
+		cache_bytes += size;
+		_cache_evict(cache_max);
+	}
+	_cache_shm_put(name, PyString_AS_STRING(pString), size);
+}
+
+static void _cache_remove(const char *name)
+{
+	map<string, cache_lru_t::iterator>::iterator it;
+
+	if (NULL == name || (0 == cache_max && NULL == cache_shm))
+		return;
+
+	it = cache_index.find(name);
+	if (it != cache_index.end()) {
+		cache_bytes -= PyString_GET_SIZE(it->second->data);
+		Py_DECREF(it->second->data);
+		cache_lru.erase(it->second);
+		cache_index.erase(it);
+	}
+	_cache_shm_remove(name);
+}
+
+static char pytfs_set_cache_doc [] = "set_cache(max_bytes, shm_path = None, shm_size = 64M)\n"
+		"开启get的文件缓存: 进程内最多缓存max_bytes字节(LRU), 0为不缓存;\n"
+		"shm_path为tmpfs上的文件(如/dev/shm/pytfs.cache)时, 同一台机器上的进程共用其中shm_size字节的缓存.\n"
+		"文件已存在时沿用其大小. 只缓存单个不超过缓存1/8的文件\n"
+		"-> return None\n";
+static PyObject *
+do_pytfs_set_cache(PyObject *self, PyObject *args)
+{
+	PY_LONG_LONG max_bytes = 0;
+	PY_LONG_LONG shm_size = 64 * 1024 * 1024;
+	const char *shm_path = NULL;
+
+	if (!PyArg_ParseTuple(args, "L|zL:set_cache", &max_bytes, &shm_path, &shm_size))
+		return NULL;
+
+	cache_max = max_bytes > 0 ? max_bytes : 0;
+	_cache_evict(cache_max);
+
+	_cache_shm_close();
+	if (NULL != shm_path && 0 != _cache_shm_open(shm_path, shm_size))
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)shm_path);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static char pytfs_cache_stats_doc [] = "cache_stats() -> dict\n"
+		"hits/shm_hits/misses为本进程在LRU, 共享缓存中命中与都未命中的次数, bytes/items为LRU占用;\n"
+		"开启共享缓存时shm_*为所有进程合计\n";
+static PyObject *
+do_pytfs_cache_stats(PyObject *self, PyObject *args)
+{
+	PyObject *stats = Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L}",
+			"hits", (PY_LONG_LONG)cache_hits,
+			"shm_hits", (PY_LONG_LONG)cache_shm_hits,
+			"misses", (PY_LONG_LONG)cache_misses,
+			"bytes", (PY_LONG_LONG)cache_bytes,
+			"items", (PY_LONG_LONG)cache_lru.size(),
+			"max_bytes", (PY_LONG_LONG)cache_max);
+	PyObject *shm = NULL;
+
+	if (NULL == stats || NULL == cache_shm || 0 != _cache_shm_lock())
+		return stats;
+
+	shm = Py_BuildValue("{s:K,s:K,s:K,s:K}",
+			"shm_total_hits", (unsigned PY_LONG_LONG)cache_shm->hits,
+			"shm_total_misses", (unsigned PY_LONG_LONG)cache_shm->misses,
+			"shm_inserts", (unsigned PY_LONG_LONG)cache_shm->inserts,
+			"shm_data_size", (unsigned PY_LONG_LONG)cache_shm->data_size);
+	pthread_mutex_unlock(&cache_shm->mutex);
+
+	if (NULL == shm || 0 != PyDict_Update(stats, shm))
+		Py_CLEAR(stats);
+	Py_XDECREF(shm);
+	return stats;
+}
+
+static char pytfs_cache_clear_doc [] = "cache_clear(), 清空本进程的LRU缓存, 不影响共享缓存\n"
+		"-> return None\n";
+static PyObject *
+do_pytfs_cache_clear(PyObject *self, PyObject *args)
+{
+	_cache_evict(0);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// 取得obj的数据: str, bytearray, memoryview等用新的buffer接口, 2.x的mmap, array只有旧接口.
+// 成功返回0, 用完后PyBuffer_Release; 期间obj被引用, 可以释放GIL读写
+static int _get_buffer(PyObject *obj, Py_buffer *view, int writable)
+{
+	void *buff = NULL;
+	Py_ssize_t len = 0;
+
+	if (PyUnicode_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError, "unicode is not supported, encode it first");
+		return -1;
+	}
+
+	if (PyObject_CheckBuffer(obj))
+		return PyObject_GetBuffer(obj, view, writable ? PyBUF_WRITABLE : PyBUF_SIMPLE);
+
+	if (writable) {
+		if (0 != PyObject_AsWriteBuffer(obj, &buff, &len))
+			return -1;
+	} else if (0 != PyObject_AsReadBuffer(obj, (const void**)&buff, &len)) {
+		return -1;
+	}
+	return PyBuffer_FillInfo(view, obj, buff, len, !writable, PyBUF_SIMPLE);
+}
+
 Py_ssize_t _write_buffer(TfsClient* tfsclient, int fd, const char* buff, Py_ssize_t len)
 {
 	Py_ssize_t left = len;
@@ -247,42 +911,54 @@ Py_ssize_t _write_buffer(TfsClient* tfsclient, int fd, const char* buff, Py_ssiz
 		// 将buffer中的数据写入tfs
 		ret = tfsclient->write(fd, (char*) ((buff + wrote)),
 				wrote_size);
-		if (ret >= left) {
-			break;
-		} else if (ret < 0) {
+		if (ret <= 0) {
 			TBSYS_LOG(ERROR, "write file error. ret = %d", ret);
 			break;
-		} else {
-			// 若ret>0，则ret为实际写入的数据量
-			wrote += ret;
-			left -= ret;
 		}
+		// ret为实际写入的数据量
+		wrote += ret;
+		left -= ret;
 	}
 	return wrote;
 }
 
 static int _tfs_write(TfsClientObject *self, int fd, PyObject* stream)
 {
-    char *buff = NULL;
+    Py_buffer view;
     Py_ssize_t ret = 0;
-    Py_ssize_t len = 0;
 
-    if (0 != PyString_AsStringAndSize(stream, &buff, &len)){
+    if (self->fd <= 0 && fd <= 0){
+    	TBSYS_LOG(ERROR, "didn't call function open.");
+    	return -2;
+    }
+
+    if (0 != _get_buffer(stream, &view, 0))
+        return -1;
+
+    if (0 == view.len){
         TBSYS_LOG(ERROR, "string is empty to write.");
+        PyBuffer_Release(&view);
         return -1;
     }
 
-    if (self->fd <= 0 && fd <= 0){
-    	TBSYS_LOG(ERROR, "didn't call function open.");
-    	return -2;
+    // 直接从调用者的buffer写入tfs, 不拷贝
+    Py_BEGIN_ALLOW_THREADS
+    ret = _write_buffer(self->tfs_handle, fd, (const char*)view.buf, view.len);
+    Py_END_ALLOW_THREADS
+    if (ret != view.len){
+        TBSYS_LOG(ERROR, "write data error, wrote = %d", (int)ret);
+        ret = -1;
+    } else {
+        ret = 0;
     }
-    ret = _write_buffer(self->tfs_handle, fd, buff, len);
-    return ret > 0 ? 0:ret;
+    PyBuffer_Release(&view);
+    return ret;
 }
 
 static char tfsclient_write_doc [] =
-    "tfs.write(fd, str)\n"
-    "must call open first. len(str) <= (2 * 1024 * 1024) well be better.\n"
+    "tfs.write(fd, data)\n"
+    "must call open first. data可以是str, bytearray, memoryview, mmap等支持buffer接口的对象.\n"
+    "len(data) <= (2 * 1024 * 1024) well be better.\n"
     "return True if write success else return False";
 static PyObject *
 tfsclient_write(TfsClientObject *self, PyObject *args)
@@ -290,31 +966,30 @@ tfsclient_write(TfsClientObject *self, PyObject *args)
     PyObject *stream = NULL;
     int fd = 0;
 
-    if (!PyArg_ParseTuple(args, "iO", &fd, &stream) && !PyString_Check(stream) && fd <= 0){
-        PyErr_SetString(PyExc_TypeError, "invalid arguments to write.");
-        goto error;
-    }
+    if (!PyArg_ParseTuple(args, "iO:write", &fd, &stream))
+        return NULL;
 
-    if (_tfs_write(self, fd, stream) > 0){
+    if (0 == _tfs_write(self, fd, stream)){
         Py_INCREF(Py_True);
         return Py_True;
     }
+    if (PyErr_Occurred())
+        return NULL;
 
-error:
     Py_INCREF(Py_False);
     return Py_False;
 }
 
 static char tfsclient_read_doc [] =
     "read(fd, count)\n"
-    "must call open() first. \n"
+    "must call open() first. 从当前位置顺序读最多count个字节, count <= 0时读整个文件\n"
 	"tfs 提供接口参数来看，不可随机读，只能从头读count个字节，不能从任意位置读。\n"
-	"故不建议使用此接口";
+	"大文件请用open_file()返回的TfsFile";
 static PyObject *
 tfsclient_read(TfsClientObject *self, PyObject *args)
 {
     int fd = 0;
-    int64_t count = 0;
+    PY_LONG_LONG count = 0;
 	int read_size = 0;
 	int64_t read = 0;
 	int64_t left = 0;
@@ -323,44 +998,48 @@ tfsclient_read(TfsClientObject *self, PyObject *args)
     char* buffer = NULL;
     PyObject *pString = NULL;
 
-    if (!PyArg_ParseTuple(args, "ii", &fd, &count) && fd >= 0 && count >= 0){
-        PyErr_SetString(PyExc_TypeError, "invalid arguments to write.");
-        goto error;
-    }
+    if (!PyArg_ParseTuple(args, "iL:read", &fd, &count))
+        return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     file_length = self->tfs_handle->get_file_length(fd);
+    Py_END_ALLOW_THREADS
     if (file_length <=0 ){
     	TBSYS_LOG(ERROR, "get file length fail, length = %d", file_length);
     	goto error;
     }
 
-    count = file_length > count ? file_length: count;
-    buffer = new char[count];
+    // 以前取的是两者中大的, count不起作用, 总是读出整个文件
+    if (count <= 0 || count > file_length)
+        count = file_length;
+    buffer = _buffer_alloc(count);
     if (NULL == buffer){
     	goto error;
     }
 
     left = count;
 
+	Py_BEGIN_ALLOW_THREADS
 	while (read < count) {
 		read_size = left > WROTE_PRE_ONE ? WROTE_PRE_ONE : left;
 		ret = self->tfs_handle->read(fd, buffer + read, read_size);
-		if (ret < 0) {
+		if (ret <= 0) {
 			break;
 		} else {
 			read += ret;
 			left -= ret;
 		}
 	}
+	Py_END_ALLOW_THREADS
 
 	if (ret < 0) {
 		TBSYS_LOG(ERROR, "read file error! ret = %d", ret);
-		delete[] buffer;
+		_buffer_free(buffer, count);
 		goto error;
 	}
 
 	pString = (PyObject*) (PyString_FromStringAndSize(buffer, read));
-    delete []buffer;
+    _buffer_free(buffer, count);
     buffer = NULL;
     return pString;
 error:
@@ -385,7 +1064,9 @@ tfsclient_close(TfsClientObject *self, PyObject *args)
         return Py_BuildValue(""); // return None
     }
 
+	Py_BEGIN_ALLOW_THREADS
 	ret = self->tfs_handle->close(fd, ret_tfs_name, TFS_FILE_LEN);
+	Py_END_ALLOW_THREADS
 	if (TFS_SUCCESS != ret) {
 		TBSYS_LOG(ERROR, "close fail. ret = %d", ret);
 		return Py_BuildValue(""); // return None
@@ -397,7 +1078,7 @@ tfsclient_close(TfsClientObject *self, PyObject *args)
 static char tfsclient_unlink_doc [] =
     "unlink('Txxxxx', 'suffix', pytfs.DELETE) \n"
     "pytfs.DELETE, / UNDELETE / CONCEAL / REVEAL \n"
-	"return file_size, which was delete.\n";
+	"return file_size, which was delete. error->False\n";
 
 static PyObject *
 tfsclient_unlink(TfsClientObject *self, PyObject *args)
@@ -405,144 +1086,237 @@ tfsclient_unlink(TfsClientObject *self, PyObject *args)
     const char *file_name = NULL;
     const char  *suffix = NULL;
     PyObject *ofname = NULL;
-    PyObject *osuffix = NULL;
+    PyObject *osuffix = Py_None;
     int64_t file_size = 0;
-    int ret = 0;;
-    TfsUnlinkType action = DELETE;
+    int ret = 0;
+    int action = DELETE;
+    char key[CACHE_KEY_LEN];
 
-    if (!PyArg_ParseTuple(args, "OOi:open", &ofname, &action, &osuffix)){
+    if (0 != _client_init(self))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, "O|Oi:unlink", &ofname, &osuffix, &action)){
         PyErr_SetString(PyExc_TypeError, "invalid arguments to unlink");
-        return Py_BuildValue("i", 0);
+        return NULL;
     }
 
     file_name = _check_str_obj(ofname);
     suffix = _check_str_obj(osuffix);
+    if (NULL == file_name){
+        PyErr_SetString(PyExc_TypeError, "invalid file name to unlink");
+        return NULL;
+    }
 
-    ret = self->tfs_handle->unlink(file_size, file_name, suffix, action);
-    if (ret > 0)
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->tfs_handle->unlink(file_size, file_name, suffix, CLIENT_NS(self), (TfsUnlinkType)action);
+    Py_END_ALLOW_THREADS
+    _cache_remove(_cache_key(self, file_name, key));
+    if (TFS_SUCCESS != ret)
     {
-    	return Py_BuildValue("i", 0);
+        TBSYS_LOG(ERROR, "error to unlink %s. ret = %d", file_name, ret);
+        Py_INCREF(Py_False);
+        return Py_False;
     }
 
-    TBSYS_LOG(ERROR, "error to unlink. ret = %d", ret);
-	return Py_BuildValue("i", file_size);
+    return Py_BuildValue("L", (PY_LONG_LONG)file_size);
 }
 
-static char tfsclient_put_doc [] =
-    "put(file_bin_stream_as_str)\n create a new file and save to tfs.\n "
-    "Return success -> tfsname; error->False";
+static char tfsclient_unlink_many_doc [] =
+    "unlink_many(['Txxxxx', ...], suffix = None, pytfs.DELETE) \n"
+    "批量删除, 按顺序返回每个文件的结果列表: [(ret, file_size), ...]\n"
+    "ret为tfs的返回码, 0为成功\n";
+
 static PyObject *
-tfsclient_put(TfsClientObject *self, PyObject *args)
+tfsclient_unlink_many(TfsClientObject *self, PyObject *args)
 {
-    char *buff = NULL;
-    long int nBufLen = 0;
-    PyObject *obj = NULL;
-;
-    int fd = 0;
-    char ret_tfs_name[TFS_FILE_LEN];
-    ret_tfs_name[0] = '\0';
-    int ret;
+    const char *file_name = NULL;
+    const char  *suffix = NULL;
+    PyObject *onames = NULL;
+    PyObject *osuffix = Py_None;
+    PyObject *seq = NULL;
+    PyObject *result = NULL;
+    int64_t file_size = 0;
+    Py_ssize_t i, n;
+    int ret = 0;
+    int action = DELETE;
+    char key[CACHE_KEY_LEN];
 
-    if (!PyArg_ParseTuple(args, "O:put", &obj) && !PyString_Check(obj)){
-    	PyErr_SetString(PyExc_TypeError, "invalid arguments to put");
-        TBSYS_LOG(ERROR, "invalid arguments to put");
-        goto error;
+    if (0 != _client_init(self))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, "O|Oi:unlink_many", &onames, &osuffix, &action)){
+        PyErr_SetString(PyExc_TypeError, "invalid arguments to unlink_many");
+        return NULL;
     }
 
-    if (Py_None == obj)
-    	return Py_BuildValue("");
+    seq = PySequence_Fast(onames, "unlink_many expects a sequence of tfs names");
+    if (NULL == seq)
+        return NULL;
 
-	if (PyString_Check(obj))
-	{
-		if (0 == PyString_Size(obj) || 0 != PyString_AsStringAndSize(obj, &buff, &nBufLen))
-			return Py_BuildValue("");
-	}
+    suffix = _check_str_obj(osuffix);
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (NULL == result){
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++){
+        file_size = 0;
+        file_name = _check_str_obj(PySequence_Fast_GET_ITEM(seq, i));
+        if (NULL == file_name){
+            ret = TFS_ERROR;
+        } else {
+            // file_name指向seq中的str, seq持有引用
+            Py_BEGIN_ALLOW_THREADS
+            ret = self->tfs_handle->unlink(file_size, file_name, suffix, CLIENT_NS(self), (TfsUnlinkType)action);
+            Py_END_ALLOW_THREADS
+            _cache_remove(_cache_key(self, file_name, key));
+            if (TFS_SUCCESS != ret)
+                TBSYS_LOG(ERROR, "error to unlink %s. ret = %d", file_name, ret);
+        }
+        PyList_SET_ITEM(result, i, Py_BuildValue("(iL)", ret, (PY_LONG_LONG)file_size));
+    }
+
+    Py_DECREF(seq);
+    return result;
+}
+
+// 新建文件写入len字节并提交, 成功返回0, tfs文件名写入ret_tfs_name. 不涉及Python对象
+int _put_buffer(TfsClient* tfsclient, const char* ns_addr, const char* buff, Py_ssize_t len, char* ret_tfs_name)
+{
+	int ret = 0;
+	Py_ssize_t wrote = 0;
 
 	// TODO: 没处理Key参数, 大文件要appKey
-	self->fd = fd = self->tfs_handle->open((char*)NULL, NULL, NULL, T_WRITE);
+	int fd = tfsclient->open((char*)NULL, NULL, ns_addr, T_WRITE);
 	if (fd <= 0){
 		TBSYS_LOG(ERROR, "error to open tfs file ret = %d", fd);
-		self->fd = 0;
-		goto error;
+		return -1;
 	}
 
-	ret  =_write_buffer(self->tfs_handle, fd, buff, nBufLen);
+	wrote = _write_buffer(tfsclient, fd, buff, len);
 
 	// 读写失败
-	if (ret < 0)
+	if (wrote != len)
 	{
-	  TBSYS_LOG(ERROR, "write data error, ret = %d", ret);
-	  goto error;
+	  TBSYS_LOG(ERROR, "write data error, ret = %d", (int)wrote);
+	  return -1;
 	}
 
 	// 提交写入
-	ret = self->tfs_handle->close(fd, ret_tfs_name, TFS_FILE_LEN);
-
+	ret = tfsclient->close(fd, ret_tfs_name, TFS_FILE_LEN);
 	if (ret != TFS_SUCCESS) // 提交失败
 	{
 		TBSYS_LOG(ERROR, "write remote file failed, ret = %d", ret);
-		goto error;
+		return -1;
 	}
+	return 0;
+}
 
-	return Py_BuildValue("s", ret_tfs_name);
+static char tfsclient_put_doc [] =
+    "put(data)\n create a new file and save to tfs.\n "
+    "data可以是str, bytearray, memoryview, mmap等支持buffer接口的对象, 直接从中写入, 不拷贝.\n "
+    "Return success -> tfsname; error->False";
+static PyObject *
+tfsclient_put(TfsClientObject *self, PyObject *args)
+{
+    PyObject *obj = NULL;
+    Py_buffer view;
+    char ret_tfs_name[TFS_FILE_LEN];
+    ret_tfs_name[0] = '\0';
+    int ret;
 
-error:
-    Py_INCREF(Py_False);
-    return Py_False;
+    if (0 != _client_init(self))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, "O:put", &obj)){
+        TBSYS_LOG(ERROR, "invalid arguments to put");
+        return NULL;
+    }
+
+    if (Py_None == obj)
+    	return Py_BuildValue("");
+
+    if (0 != _get_buffer(obj, &view, 0))
+    	return NULL;
+
+    if (0 == view.len) {
+    	PyBuffer_Release(&view);
+    	return Py_BuildValue("");
+    }
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = _put_buffer(self->tfs_handle, CLIENT_NS(self), (const char*)view.buf, view.len, ret_tfs_name);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&view);
+
+	if (0 != ret) {
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+	return Py_BuildValue("s", ret_tfs_name);
 }
 
-char* _read_buffer(TfsClient* tfsclent, int fd, int64_t& ret_length) {
+// 打开文件并取得大小与crc, 失败时返回值<=0, fd已关闭. 不涉及Python对象, 可在释放GIL时调用
+int _open_stat(TfsClient* tfsclient, const char* ns_addr, const char* tfsname, TfsFileStat* fstat)
+{
 	int ret = 0;
-	int read_size = 0;
-	int64_t left = 0;
-	uint32_t crc = 0;
-	TfsFileStat fstat;
-	char* buffer = NULL;
-	ret_length = 0;
+	int fd = tfsclient->open(tfsname, NULL, ns_addr, T_READ);
+
+	if (fd <= 0) {
+		TBSYS_LOG(ERROR, "tfs.open failed, ret = %d", fd);
+		return fd;
+	}
 
-	// 获得文件属性
-	ret = tfsclent->fstat(fd, &fstat);
-	if (ret != TFS_SUCCESS || fstat.size_ <= 0) {
+	ret = tfsclient->fstat(fd, fstat);
+	if (ret != TFS_SUCCESS || fstat->size_ <= 0) {
 		TBSYS_LOG(ERROR, "ret = %d, tfs.fstat failed", ret);
-		return NULL;
+		tfsclient->close(fd);
+		return 0;
 	}
+	return fd;
+}
 
-	buffer = new char[fstat.size_];
-	left = fstat.size_;
-	while (ret_length < fstat.size_) {
-		read_size = left > WROTE_PRE_ONE ? WROTE_PRE_ONE : left;
-		ret = tfsclent->read(fd, buffer + ret_length, read_size);
-		if (ret < 0) {
+// 读size字节到buffer并校验crc, 成功返回0
+int _read_into(TfsClient* tfsclient, int fd, char* buffer, int64_t size, uint32_t file_crc)
+{
+	int ret = 0;
+	int read_size = 0;
+	int64_t length = 0;
+	uint32_t crc = 0;
+
+	while (length < size) {
+		read_size = size - length > WROTE_PRE_ONE ? WROTE_PRE_ONE : size - length;
+		ret = tfsclient->read(fd, buffer + length, read_size);
+		if (ret <= 0) {
 			break;
-		} else {
-			crc = Func::crc(crc, (buffer + ret_length), ret); // 对读取的文件计算crc值
-			ret_length += ret;
-			left -= ret;
 		}
+		crc = Func::crc(crc, (buffer + length), ret); // 对读取的文件计算crc值
+		length += ret;
 	}
 
-	if (ret < 0 || crc != fstat.crc_) {
+	if (length != size || crc != file_crc) {
 		TBSYS_LOG(ERROR, "ret = %d, crc not math, crc = %d, fstat.crc_ = %d",
-				ret, crc, fstat.crc_);
-		delete[] buffer;
-		buffer = NULL;
+				ret, crc, file_crc);
+		return -1;
 	}
-	return buffer;
+	return 0;
 }
 
 static char tfsclient_get_doc [] =
-    "get(tfsname)\n create a new file and save to tfs.\n Return str";
+    "get(tfsname)\n read a file from tfs.\n Return str; error->None";
 static PyObject *
 tfsclient_get(TfsClientObject *self, PyObject *args)
 {
 	int fd = 0;
     char *tfsname = NULL;
-	char* buffer = NULL;
 	int ret = 0;
-	int64_t ret_length = 0;
     PyObject *obj = NULL;
     PyObject *pString = NULL;
     Py_ssize_t len = 0;
+    TfsFileStat fstat;
+    char key[CACHE_KEY_LEN];
 
     if (!PyArg_ParseTuple(args, "O:get", &obj) && !PyString_Check(obj)) {
     	TBSYS_LOG(ERROR, "invalid arguments to get");
@@ -554,28 +1328,44 @@ tfsclient_get(TfsClientObject *self, PyObject *args)
         goto error;
     }
 
-    fd = self->tfs_handle->open(tfsname, NULL, T_READ, NULL);
+    // 命中缓存时不需要tfs client, fork出的子进程也可以用
+    pString = _cache_get(_cache_key(self, tfsname, key));
+    if (NULL != pString)
+    	return pString;
+
+    if (0 != _client_init(self))
+    	return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    fd = _open_stat(self->tfs_handle, CLIENT_NS(self), tfsname, &fstat);
+    Py_END_ALLOW_THREADS
     if (fd <= 0){
-    	TBSYS_LOG(ERROR, "tfs.open failed, ret = %d", fd);
     	goto error;
     }
 
-    buffer = _read_buffer(self->tfs_handle, fd, ret_length);
-    if (NULL == buffer | 0 == ret_length)
-    {
-    	goto error;
+    // 按fstat的大小直接分配结果, tfs读到其中, 不再经过中间buffer和拷贝
+    pString = PyString_FromStringAndSize(NULL, fstat.size_);
+    if (NULL == pString) {
+    	Py_BEGIN_ALLOW_THREADS
+    	self->tfs_handle->close(fd);
+    	Py_END_ALLOW_THREADS
+    	return NULL;
     }
 
-	ret = self->tfs_handle->close(fd);
-	if (ret < 0) {
-		TBSYS_LOG(ERROR, "close remote file error! ret = %d", ret);
-		delete[] buffer;
+    // pString还未交给调用者, 释放GIL期间没有别的线程能访问
+    Py_BEGIN_ALLOW_THREADS
+    ret = _read_into(self->tfs_handle, fd, PyString_AS_STRING(pString), fstat.size_, fstat.crc_);
+    if (self->tfs_handle->close(fd) < 0 && 0 == ret) {
+    	TBSYS_LOG(ERROR, "close remote file error!");
+    	ret = -1;
+    }
+    Py_END_ALLOW_THREADS
+
+	if (0 != ret) {
+		Py_DECREF(pString);
 		goto error;
 	}
-
-	pString = (PyObject*) (PyString_FromStringAndSize(buffer, ret_length));
-    delete []buffer;
-    buffer = NULL;
+	_cache_put(_cache_key(self, tfsname, key), pString);
     return pString;
 
 error:
@@ -583,6 +1373,1407 @@ error:
     return Py_None;
 }
 
+static char tfsclient_readinto_doc [] =
+    "readinto(tfsname, buffer)\n"
+    "把文件直接读入可写的buffer(bytearray, memoryview, mmap等), 不产生中间拷贝.\n"
+    "读的过程中不要在其他线程中改变buffer的大小或关闭mmap.\n"
+    "Return file size; error->None; buffer小于文件时抛ValueError";
+static PyObject *
+tfsclient_readinto(TfsClientObject *self, PyObject *args)
+{
+	int fd = 0;
+	int ret = 0;
+	const char *tfsname = NULL;
+	PyObject *obj = NULL;
+	PyObject *result = NULL;
+	Py_buffer view;
+	TfsFileStat fstat;
+
+	if (0 != _client_init(self))
+		return NULL;
+
+	if (!PyArg_ParseTuple(args, "sO:readinto", &tfsname, &obj))
+		return NULL;
+
+	if (0 != _get_buffer(obj, &view, 1))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = _open_stat(self->tfs_handle, CLIENT_NS(self), tfsname, &fstat);
+	Py_END_ALLOW_THREADS
+	if (fd <= 0) {
+		Py_INCREF(Py_None);
+		result = Py_None;
+		goto done;
+	}
+
+	if (fstat.size_ > view.len) {
+		Py_BEGIN_ALLOW_THREADS
+		self->tfs_handle->close(fd);
+		Py_END_ALLOW_THREADS
+		PyErr_Format(PyExc_ValueError, "buffer too small: %lld < %lld",
+				(PY_LONG_LONG)view.len, (PY_LONG_LONG)fstat.size_);
+		goto done;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = _read_into(self->tfs_handle, fd, (char*)view.buf, fstat.size_, fstat.crc_);
+	if (self->tfs_handle->close(fd) < 0 && 0 == ret) {
+		TBSYS_LOG(ERROR, "close remote file error!");
+		ret = -1;
+	}
+	Py_END_ALLOW_THREADS
+
+	if (0 != ret) {
+		Py_INCREF(Py_None);
+		result = Py_None;
+	} else {
+		result = Py_BuildValue("L", (PY_LONG_LONG)fstat.size_);
+	}
+
+done:
+	PyBuffer_Release(&view);
+	return result;
+}
+
+// TfsFile: 只读的流式文件对象, 按需用pread读取, 内存占用只有读缓冲区与每次read的结果
+#define FILE_BUFFER_SIZE (1024 * 1024)
+#define FILE_ITER_SIZE (64 * 1024)
+
+typedef struct {
+    PyObject_HEAD
+    TfsClientObject *client;        /* 保持TfsClient不被析构 */
+    TfsClient *tfs_handle;
+    int fd;
+    char name[TFS_FILE_LEN];
+    int64_t size;
+    int64_t pos;
+    uint32_t file_crc;
+    uint32_t crc;                   /* 从头顺序读时累计的crc */
+    int64_t crc_pos;
+    char *buffer;                   /* 预读缓冲区, buffer_size为0时不预读 */
+    int64_t buffer_size;
+    int64_t buf_start;
+    int64_t buf_len;
+} TfsFileObject;
+
+// 从offset读最多一段到dst, 返回读到的字节数. 读到文件尾时校验crc, 不符返回-1
+static int64_t _file_pread(TfsFileObject *f, char *dst, int64_t n, int64_t offset)
+{
+	int64_t ret = 0;
+
+	if (n > WROTE_PRE_ONE)
+		n = WROTE_PRE_ONE;
+	if (n > f->size - offset)
+		n = f->size - offset;
+	if (n <= 0)
+		return 0;
+
+	ret = f->tfs_handle->pread(f->fd, dst, n, offset);
+	if (ret < 0) {
+		TBSYS_LOG(ERROR, "pread %s error, ret = %d", f->name, (int)ret);
+		return ret;
+	}
+
+	if (ret > 0 && offset == f->crc_pos) {
+		f->crc = Func::crc(f->crc, dst, ret);
+		f->crc_pos += ret;
+		if (f->crc_pos == f->size && f->crc != f->file_crc) {
+			TBSYS_LOG(ERROR, "%s crc not math, crc = %u, fstat.crc_ = %u",
+					f->name, f->crc, f->file_crc);
+			return -1;
+		}
+	}
+	return ret;
+}
+
+// 从当前位置读n字节到dst, 返回读到的字节数, 出错返回<0. 不涉及Python对象
+static int64_t _file_read(TfsFileObject *f, char *dst, int64_t n)
+{
+	int64_t done = 0;
+	int64_t ret = 0;
+
+	while (done < n && f->pos < f->size) {
+		if (f->pos >= f->buf_start && f->pos < f->buf_start + f->buf_len) {
+			ret = f->buf_start + f->buf_len - f->pos;
+			if (ret > n - done)
+				ret = n - done;
+			memcpy(dst + done, f->buffer + (f->pos - f->buf_start), ret);
+		} else if (f->buffer_size == 0 || n - done >= f->buffer_size) {
+			// 大块的读直接读入dst, 不经过缓冲区
+			ret = _file_pread(f, dst + done, n - done, f->pos);
+			if (ret <= 0)
+				return ret < 0 ? ret : done;
+		} else {
+			ret = _file_pread(f, f->buffer, f->buffer_size, f->pos);
+			if (ret <= 0)
+				return ret < 0 ? ret : done;
+			f->buf_start = f->pos;
+			f->buf_len = ret;
+			continue;
+		}
+		f->pos += ret;
+		done += ret;
+	}
+	return done;
+}
+
+static int _file_check(TfsFileObject *f)
+{
+	if (f->fd <= 0) {
+		PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+_file_read_string(TfsFileObject *f, int64_t n)
+{
+	PyObject *pString = NULL;
+	int64_t ret = 0;
+
+	if (n < 0 || n > f->size - f->pos)
+		n = f->size > f->pos ? f->size - f->pos : 0;
+
+	pString = PyString_FromStringAndSize(NULL, n);
+	if (NULL == pString || 0 == n)
+		return pString;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = _file_read(f, PyString_AS_STRING(pString), n);
+	Py_END_ALLOW_THREADS
+
+	if (ret < 0) {
+		Py_DECREF(pString);
+		return PyErr_Format(PyExc_IOError, "read %s failed, ret = %d", f->name, (int)ret);
+	}
+	if (ret < n)
+		_PyString_Resize(&pString, ret);
+	return pString;
+}
+
+static char tfsfile_read_doc [] =
+    "read([size]) -> str, 读最多size个字节, 不传或<0时读到文件尾, 到文件尾时返回''";
+static PyObject *
+tfsfile_read(TfsFileObject *f, PyObject *args)
+{
+	PY_LONG_LONG n = -1;
+
+	if (!PyArg_ParseTuple(args, "|L:read", &n) || 0 != _file_check(f))
+		return NULL;
+	return _file_read_string(f, n);
+}
+
+static char tfsfile_readinto_doc [] =
+    "readinto(buffer) -> 读入的字节数, buffer为bytearray, memoryview, mmap等";
+static PyObject *
+tfsfile_readinto(TfsFileObject *f, PyObject *args)
+{
+	PyObject *obj = NULL;
+	Py_buffer view;
+	int64_t ret = 0;
+
+	if (!PyArg_ParseTuple(args, "O:readinto", &obj) || 0 != _file_check(f))
+		return NULL;
+
+	if (0 != _get_buffer(obj, &view, 1))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = _file_read(f, (char*)view.buf, view.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&view);
+
+	if (ret < 0)
+		return PyErr_Format(PyExc_IOError, "read %s failed, ret = %d", f->name, (int)ret);
+	return Py_BuildValue("L", (PY_LONG_LONG)ret);
+}
+
+static char tfsfile_seek_doc [] =
+    "seek(offset, whence = 0), whence同os.SEEK_SET/SEEK_CUR/SEEK_END";
+static PyObject *
+tfsfile_seek(TfsFileObject *f, PyObject *args)
+{
+	PY_LONG_LONG offset = 0;
+	int whence = 0;
+	int64_t pos = 0;
+
+	if (!PyArg_ParseTuple(args, "L|i:seek", &offset, &whence) || 0 != _file_check(f))
+		return NULL;
+
+	switch (whence) {
+	case 0: pos = offset; break;
+	case 1: pos = f->pos + offset; break;
+	case 2: pos = f->size + offset; break;
+	default:
+		PyErr_SetString(PyExc_ValueError, "invalid whence");
+		return NULL;
+	}
+	if (pos < 0) {
+		PyErr_SetString(PyExc_IOError, "negative seek position");
+		return NULL;
+	}
+
+	f->pos = pos;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+tfsfile_tell(TfsFileObject *f)
+{
+	if (0 != _file_check(f))
+		return NULL;
+	return Py_BuildValue("L", (PY_LONG_LONG)f->pos);
+}
+
+static void _file_close(TfsFileObject *f)
+{
+	int fd = f->fd;
+
+	if (fd <= 0)
+		return;
+	f->fd = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	f->tfs_handle->close(fd);
+	Py_END_ALLOW_THREADS
+
+	delete[] f->buffer;
+	f->buffer = NULL;
+	f->buf_len = 0;
+}
+
+static PyObject *
+tfsfile_close(TfsFileObject *f)
+{
+	_file_close(f);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+tfsfile_enter(TfsFileObject *f)
+{
+	if (0 != _file_check(f))
+		return NULL;
+	Py_INCREF(f);
+	return (PyObject*)f;
+}
+
+static PyObject *
+tfsfile_exit(TfsFileObject *f, PyObject *args)
+{
+	_file_close(f);
+	Py_INCREF(Py_False);
+	return Py_False;
+}
+
+static PyObject *
+tfsfile_iternext(TfsFileObject *f)
+{
+	PyObject *chunk = NULL;
+
+	if (0 != _file_check(f))
+		return NULL;
+
+	chunk = _file_read_string(f, f->buffer_size > 0 ? f->buffer_size : FILE_ITER_SIZE);
+	if (NULL != chunk && 0 == PyString_GET_SIZE(chunk)) {
+		Py_DECREF(chunk);
+		return NULL;
+	}
+	return chunk;
+}
+
+static void
+tfsfile_dealloc(TfsFileObject *f)
+{
+	_file_close(f);
+	Py_XDECREF(f->client);
+	PyObject_Del(f);
+}
+
+static PyObject *
+tfsfile_get_name(TfsFileObject *f, void *closure)
+{
+	return Py_BuildValue("s", f->name);
+}
+
+static PyObject *
+tfsfile_get_size(TfsFileObject *f, void *closure)
+{
+	return Py_BuildValue("L", (PY_LONG_LONG)f->size);
+}
+
+static PyObject *
+tfsfile_get_closed(TfsFileObject *f, void *closure)
+{
+	return PyBool_FromLong(f->fd <= 0);
+}
+
+static PyMethodDef tfsfile_methods[] = {
+    {"read", (PyCFunction)tfsfile_read, METH_VARARGS, tfsfile_read_doc},
+    {"readinto", (PyCFunction)tfsfile_readinto, METH_VARARGS, tfsfile_readinto_doc},
+    {"seek", (PyCFunction)tfsfile_seek, METH_VARARGS, tfsfile_seek_doc},
+    {"tell", (PyCFunction)tfsfile_tell, METH_NOARGS, "tell() -> 当前位置"},
+    {"close", (PyCFunction)tfsfile_close, METH_NOARGS, "close(), 可重复调用"},
+    {"__enter__", (PyCFunction)tfsfile_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)tfsfile_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef tfsfile_getset[] = {
+    {(char*)"name", (getter)tfsfile_get_name, NULL, (char*)"tfs文件名", NULL},
+    {(char*)"size", (getter)tfsfile_get_size, NULL, (char*)"文件大小", NULL},
+    {(char*)"closed", (getter)tfsfile_get_closed, NULL, NULL, NULL},
+    {NULL}
+};
+
+static const char tfsfile_doc [] =
+"TfsFile, 由TfsClient.open_file()返回的只读文件对象.\n"
+"支持read(n), readinto, seek/tell, 按块迭代与with, 可用于shutil.copyfileobj.\n"
+"从头顺序读到文件尾时校验crc, 不符时抛IOError. 不要在多个线程中同时使用同一个TfsFile\n";
+
+static PyTypeObject TfsFile_Type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "pytfs.TfsFile",            /* tp_name */
+    sizeof(TfsFileObject),      /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)tfsfile_dealloc,    /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    PyObject_GenericGetAttr,    /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    tfsfile_doc,                /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    PyObject_SelfIter,          /* tp_iter */
+    (iternextfunc)tfsfile_iternext, /* tp_iternext */
+    tfsfile_methods,            /* tp_methods */
+    0,                          /* tp_members */
+    tfsfile_getset,             /* tp_getset */
+};
+
+static char tfsclient_open_file_doc [] =
+    "open_file(tfsname, buffer_size = 1M) -> TfsFile\n"
+    "打开文件流式读取, buffer_size为预读缓冲区大小, 0为不预读. 文件不存在时抛IOError";
+static PyObject *
+tfsclient_open_file(TfsClientObject *self, PyObject *args)
+{
+	const char *tfsname = NULL;
+	PY_LONG_LONG buffer_size = FILE_BUFFER_SIZE;
+	TfsFileObject *f = NULL;
+	TfsFileStat fstat;
+	int fd = 0;
+
+	if (0 != _client_init(self))
+		return NULL;
+
+	if (!PyArg_ParseTuple(args, "s|L:open_file", &tfsname, &buffer_size))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = _open_stat(self->tfs_handle, CLIENT_NS(self), tfsname, &fstat);
+	Py_END_ALLOW_THREADS
+	if (fd <= 0)
+		return PyErr_Format(PyExc_IOError, "open %s failed, ret = %d", tfsname, fd);
+
+	f = PyObject_New(TfsFileObject, &TfsFile_Type);
+	if (NULL == f) {
+		self->tfs_handle->close(fd);
+		return NULL;
+	}
+
+	Py_INCREF(self);
+	f->client = self;
+	f->tfs_handle = self->tfs_handle;
+	f->fd = fd;
+	snprintf(f->name, TFS_FILE_LEN, "%s", tfsname);
+	f->size = fstat.size_;
+	f->pos = 0;
+	f->file_crc = fstat.crc_;
+	f->crc = 0;
+	f->crc_pos = 0;
+	f->buffer_size = buffer_size > 0 ? buffer_size : 0;
+	f->buf_start = 0;
+	f->buf_len = 0;
+	f->buffer = NULL;
+	if (f->buffer_size > 0)
+		f->buffer = new (std::nothrow) char[f->buffer_size];
+	if (f->buffer_size > 0 && NULL == f->buffer) {
+		Py_DECREF(f);
+		return PyErr_NoMemory();
+	}
+	return (PyObject*)f;
+}
+
+// put_file/get_file: 本地文件与tfs之间直接传输, 数据不经过Python对象, 全程释放GIL.
+// 返回0成功, -1为tfs出错, -2为本地文件出错(errno存入err)
+#define FILE_DIRECT_ALIGN 4096
+
+static double _now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int _put_file(TfsClient* tfsclient, const char* ns_addr, const char* path, char* ret_tfs_name, int64_t* size, int* err)
+{
+	struct stat st;
+	void *data = NULL;
+	int ret = 0;
+	int fd = open(path, O_RDONLY);
+
+	*size = 0;
+	if (fd < 0 || 0 != fstat(fd, &st)) {
+		*err = errno;
+		if (fd >= 0)
+			close(fd);
+		return -2;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		*err = EINVAL;
+		return -2;
+	}
+
+	*size = st.st_size;
+	if (0 == st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	// 映射整个文件直接交给tfs写, 按顺序预读
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == data) {
+		*err = errno;
+		close(fd);
+		return -2;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	ret = _put_buffer(tfsclient, ns_addr, (const char*)data, st.st_size, ret_tfs_name);
+
+	munmap(data, st.st_size);
+	// 上传的文件多半不会再读, 不占page cache
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	return ret;
+}
+
+static int _get_file(TfsClient* tfsclient, const char* ns_addr, const char* tfsname, const char* path, int direct,
+		int64_t* size, int* err)
+{
+	TfsFileStat fstat;
+	char *buffer = NULL;
+	int64_t done = 0;
+	int64_t chunk = 0;
+	int64_t ret = 0;
+	uint32_t crc = 0;
+	int rc = 0;
+	int local = -1;
+	int tfs_fd = 0;
+	// buffer按此大小分配, 不受中途set_chunk_size影响
+	int64_t chunk_size = WROTE_PRE_ONE;
+
+	*size = 0;
+	tfs_fd = _open_stat(tfsclient, ns_addr, tfsname, &fstat);
+	if (tfs_fd <= 0)
+		return -1;
+
+	local = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (local < 0 && direct && EINVAL == errno) {
+		// tmpfs等不支持O_DIRECT
+		direct = 0;
+		local = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (local < 0) {
+		*err = errno;
+		tfsclient->close(tfs_fd);
+		return -2;
+	}
+	posix_fadvise(local, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// O_DIRECT要求buffer与每次写的长度按块对齐
+	if (0 != posix_memalign((void**)&buffer, FILE_DIRECT_ALIGN, chunk_size)) {
+		*err = ENOMEM;
+		rc = -2;
+		goto done;
+	}
+
+	while (done < fstat.size_) {
+		chunk = fstat.size_ - done > chunk_size ? chunk_size : fstat.size_ - done;
+		for (ret = 0; ret < chunk; ) {
+			int64_t n = tfsclient->read(tfs_fd, buffer + ret, chunk - ret);
+			if (n <= 0) {
+				TBSYS_LOG(ERROR, "read %s error, ret = %d", tfsname, (int)n);
+				rc = -1;
+				goto done;
+			}
+			ret += n;
+		}
+		crc = Func::crc(crc, buffer, chunk);
+
+		// 最后不满一块的部分去掉O_DIRECT再写
+		if (direct && 0 != chunk % FILE_DIRECT_ALIGN) {
+			fcntl(local, F_SETFL, fcntl(local, F_GETFL) & ~O_DIRECT);
+			direct = 0;
+		}
+		for (ret = 0; ret < chunk; ) {
+			ssize_t n = write(local, buffer + ret, chunk - ret);
+			if (n < 0) {
+				if (EINTR == errno)
+					continue;
+				*err = errno;
+				rc = -2;
+				goto done;
+			}
+			ret += n;
+		}
+		done += chunk;
+	}
+
+	if (crc != fstat.crc_) {
+		TBSYS_LOG(ERROR, "%s crc not math, crc = %u, fstat.crc_ = %u", tfsname, crc, fstat.crc_);
+		rc = -1;
+	}
+
+done:
+	free(buffer);
+	tfsclient->close(tfs_fd);
+	if (0 == rc) {
+		// 写回后不再占page cache
+		fdatasync(local);
+		posix_fadvise(local, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	if (0 != close(local) && 0 == rc) {
+		*err = errno;
+		rc = -2;
+	}
+	if (0 != rc)
+		unlink(path);           // 不留下不完整的文件
+	*size = done;
+	return rc;
+}
+
+static char tfsclient_put_file_doc [] =
+    "put_file(path)\n 把本地文件mmap后直接写入tfs, 不读入Python内存.\n"
+    "Return success -> (tfsname, size, bytes_per_second); 空文件->None; tfs出错->False;\n"
+    "本地文件出错时抛IOError";
+static PyObject *
+tfsclient_put_file(TfsClientObject *self, PyObject *args)
+{
+	const char *path = NULL;
+	char ret_tfs_name[TFS_FILE_LEN];
+	int64_t size = 0;
+	double start = 0, elapsed = 0;
+	int err = 0;
+	int ret = 0;
+
+	if (0 != _client_init(self))
+		return NULL;
+
+	ret_tfs_name[0] = '\0';
+	if (!PyArg_ParseTuple(args, "s:put_file", &path))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	start = _now();
+	ret = _put_file(self->tfs_handle, CLIENT_NS(self), path, ret_tfs_name, &size, &err);
+	elapsed = _now() - start;
+	Py_END_ALLOW_THREADS
+
+	if (-2 == ret) {
+		errno = err;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+	}
+	if (0 != ret) {
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+	if (0 == size)
+		return Py_BuildValue("");
+	return Py_BuildValue("(sLd)", ret_tfs_name, (PY_LONG_LONG)size,
+			elapsed > 0 ? size / elapsed : 0.0);
+}
+
+static char tfsclient_get_file_doc [] =
+    "get_file(tfsname, path, direct = False)\n 把tfs文件直接写入本地文件path, 不经过Python内存.\n"
+    "direct为True时用O_DIRECT写, 不经过page cache. 失败时删除path.\n"
+    "Return success -> (size, bytes_per_second); tfs出错或crc不符->False; 本地文件出错时抛IOError";
+static PyObject *
+tfsclient_get_file(TfsClientObject *self, PyObject *args)
+{
+	const char *tfsname = NULL;
+	const char *path = NULL;
+	PyObject *odirect = Py_False;
+	int64_t size = 0;
+	double start = 0, elapsed = 0;
+	int direct = 0;
+	int err = 0;
+	int ret = 0;
+
+	if (0 != _client_init(self))
+		return NULL;
+
+	if (!PyArg_ParseTuple(args, "ss|O:get_file", &tfsname, &path, &odirect))
+		return NULL;
+	direct = PyObject_IsTrue(odirect);
+
+	Py_BEGIN_ALLOW_THREADS
+	start = _now();
+	ret = _get_file(self->tfs_handle, CLIENT_NS(self), tfsname, path, direct, &size, &err);
+	elapsed = _now() - start;
+	Py_END_ALLOW_THREADS
+
+	if (-2 == ret) {
+		errno = err;
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+	}
+	if (0 != ret) {
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+	return Py_BuildValue("(Ld)", (PY_LONG_LONG)size, elapsed > 0 ? size / elapsed : 0.0);
+}
+
+// get_many/put_many: 每次调用起concurrency-1个线程, 与调用线程一起按顺序领取下标执行,
+// 全部完成后返回. 执行期间调用线程已释放GIL
+#define BATCH_CONCURRENCY 8
+#define BATCH_MAX_CONCURRENCY 64
+
+typedef void (*batch_handler_pt)(void *data, Py_ssize_t i);
+
+typedef struct {
+	pthread_mutex_t mutex;
+	Py_ssize_t next;
+	Py_ssize_t n;
+	batch_handler_pt handler;
+	void *data;
+} batch_t;
+
+static void *_batch_worker(void *arg)
+{
+	batch_t *batch = (batch_t*)arg;
+	Py_ssize_t i;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&batch->mutex);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
+		if (i >= batch->n)
+			break;
+		batch->handler(batch->data, i);
+	}
+	return NULL;
+}
+
+// 须在释放GIL后调用; 线程创建失败时由已有线程做完剩下的项
+static void _batch_run(Py_ssize_t n, int concurrency, batch_handler_pt handler, void *data)
+{
+	pthread_t tids[BATCH_MAX_CONCURRENCY];
+	batch_t batch;
+	int i, started = 0;
+
+	pthread_mutex_init(&batch.mutex, NULL);
+	batch.next = 0;
+	batch.n = n;
+	batch.handler = handler;
+	batch.data = data;
+
+	if (concurrency > n)
+		concurrency = (int)n;
+	for (i = 1; i < concurrency; i++) {
+		if (0 != pthread_create(&tids[started], NULL, _batch_worker, &batch)) {
+			TBSYS_LOG(WARN, "pthread_create failed, run with %d threads", started + 1);
+			break;
+		}
+		started++;
+	}
+
+	_batch_worker(&batch);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&batch.mutex);
+}
+
+static int _batch_concurrency(int concurrency)
+{
+	if (concurrency < 1)
+		return 1;
+	return concurrency > BATCH_MAX_CONCURRENCY ? BATCH_MAX_CONCURRENCY : concurrency;
+}
+
+typedef struct {
+	TfsClient *tfs_handle;
+	const char *ns_addr;
+	const char **names;
+	PyObject **results;
+} batch_get_t;
+
+static void _batch_get(void *data, Py_ssize_t i)
+{
+	batch_get_t *b = (batch_get_t*)data;
+	PyGILState_STATE gstate;
+	PyObject *pString = NULL;
+	TfsFileStat fstat;
+	int ret = 0;
+	int fd = 0;
+
+	// 未给文件名或已从缓存取得
+	if (NULL == b->names[i] || NULL != b->results[i])
+		return;
+
+	fd = _open_stat(b->tfs_handle, b->ns_addr, b->names[i], &fstat);
+	if (fd <= 0)
+		return;
+
+	// 只在分配结果时短暂拿GIL, 读仍直接读入字符串
+	gstate = PyGILState_Ensure();
+	pString = PyString_FromStringAndSize(NULL, fstat.size_);
+	if (NULL == pString)
+		PyErr_Clear();
+	PyGILState_Release(gstate);
+
+	if (NULL == pString) {
+		b->tfs_handle->close(fd);
+		return;
+	}
+
+	ret = _read_into(b->tfs_handle, fd, PyString_AS_STRING(pString), fstat.size_, fstat.crc_);
+	if (b->tfs_handle->close(fd) < 0 && 0 == ret) {
+		TBSYS_LOG(ERROR, "close remote file error!");
+		ret = -1;
+	}
+
+	if (0 != ret) {
+		gstate = PyGILState_Ensure();
+		Py_DECREF(pString);
+		PyGILState_Release(gstate);
+		return;
+	}
+	b->results[i] = pString;
+}
+
+static char tfsclient_get_many_doc [] =
+    "get_many(['Txxxxx', ...], concurrency = 8)\n"
+    "用concurrency个线程并发读取, 按顺序返回结果列表, 失败的项为None\n";
+static PyObject *
+tfsclient_get_many(TfsClientObject *self, PyObject *args)
+{
+    PyObject *onames = NULL;
+    PyObject *seq = NULL;
+    PyObject *result = NULL;
+    PyObject *item = NULL;
+    int concurrency = BATCH_CONCURRENCY;
+    batch_get_t b;
+    Py_ssize_t i, n;
+    char key[CACHE_KEY_LEN];
+
+    if (0 != _client_init(self))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, "O|i:get_many", &onames, &concurrency))
+        return NULL;
+
+    // names指向seq中的str, seq持有引用直到结束
+    seq = PySequence_Fast(onames, "get_many expects a sequence of tfs names");
+    if (NULL == seq)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    b.tfs_handle = self->tfs_handle;
+    b.ns_addr = CLIENT_NS(self);
+    b.names = PyMem_New(const char *, n + 1);
+    b.results = PyMem_New(PyObject *, n + 1);
+    if (NULL == b.names || NULL == b.results) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        b.names[i] = _check_str_obj(PySequence_Fast_GET_ITEM(seq, i));
+        b.results[i] = NULL == b.names[i] ? NULL : _cache_get(_cache_key(self, b.names[i], key));
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    _batch_run(n, _batch_concurrency(concurrency), _batch_get, &b);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < n; i++) {
+        if (NULL != b.results[i])
+            _cache_put(_cache_key(self, b.names[i], key), b.results[i]);
+    }
+
+    result = PyList_New(n);
+    for (i = 0; i < n; i++) {
+        item = b.results[i];
+        if (NULL == item) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        }
+        if (NULL == result) {
+            Py_DECREF(item);
+            continue;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+
+done:
+    PyMem_Free(b.names);
+    PyMem_Free(b.results);
+    Py_DECREF(seq);
+    return result;
+}
+
+typedef struct {
+	TfsClient *tfs_handle;
+	const char *ns_addr;
+	Py_buffer *views;
+	int *rets;
+	char (*names)[TFS_FILE_LEN];
+} batch_put_t;
+
+static void _batch_put(void *data, Py_ssize_t i)
+{
+	batch_put_t *b = (batch_put_t*)data;
+
+	if (0 != b->rets[i])
+		return;
+
+	b->rets[i] = _put_buffer(b->tfs_handle, b->ns_addr, (const char*)b->views[i].buf, b->views[i].len, b->names[i]);
+}
+
+static char tfsclient_put_many_doc [] =
+    "put_many([data, ...], concurrency = 8)\n"
+    "用concurrency个线程并发写入, data同put, 按顺序返回结果列表:\n"
+    "成功为tfsname, 失败为False, data为None或空时为None\n";
+static PyObject *
+tfsclient_put_many(TfsClientObject *self, PyObject *args)
+{
+    PyObject *odatas = NULL;
+    PyObject *seq = NULL;
+    PyObject *result = NULL;
+    PyObject *obj = NULL;
+    PyObject *item = NULL;
+    int concurrency = BATCH_CONCURRENCY;
+    batch_put_t b;
+    Py_ssize_t i, n;
+
+    if (0 != _client_init(self))
+        return NULL;
+
+    // rets: 0待写入, 1为None或空, 2取不到buffer; 写入后0成功, -1失败
+    if (!PyArg_ParseTuple(args, "O|i:put_many", &odatas, &concurrency))
+        return NULL;
+
+    seq = PySequence_Fast(odatas, "put_many expects a sequence of buffers");
+    if (NULL == seq)
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    b.tfs_handle = self->tfs_handle;
+    b.ns_addr = CLIENT_NS(self);
+    b.views = PyMem_New(Py_buffer, n + 1);
+    b.rets = PyMem_New(int, n + 1);
+    b.names = (char (*)[TFS_FILE_LEN]) PyMem_Malloc((n + 1) * TFS_FILE_LEN);
+    if (NULL == b.views || NULL == b.rets || NULL == b.names) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        obj = PySequence_Fast_GET_ITEM(seq, i);
+        b.names[i][0] = '\0';
+        b.rets[i] = 0;
+        if (Py_None == obj) {
+            b.rets[i] = 1;
+        } else if (0 != _get_buffer(obj, &b.views[i], 0)) {
+            PyErr_Clear();
+            b.rets[i] = 2;
+        } else if (0 == b.views[i].len) {
+            PyBuffer_Release(&b.views[i]);
+            b.rets[i] = 1;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    _batch_run(n, _batch_concurrency(concurrency), _batch_put, &b);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(n);
+    for (i = 0; i < n; i++) {
+        if (0 == b.rets[i] || -1 == b.rets[i])
+            PyBuffer_Release(&b.views[i]);
+
+        if (0 == b.rets[i]) {
+            item = Py_BuildValue("s", b.names[i]);
+        } else {
+            item = 1 == b.rets[i] ? Py_None : Py_False;
+            Py_INCREF(item);
+        }
+        if (NULL == result || NULL == item) {
+            Py_XDECREF(item);
+            continue;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    if (NULL != result && PyErr_Occurred()) {
+        Py_DECREF(result);
+        result = NULL;
+    }
+
+done:
+    PyMem_Free(b.views);
+    PyMem_Free(b.rets);
+    PyMem_Free(b.names);
+    Py_DECREF(seq);
+    return result;
+}
+
+// TfsExecutor: 常驻的concurrency个线程执行get/put/stat, 完成时写eventfd通知.
+// 事件循环监听fileno()可读后调用completed()取结果, 见pytfs_async.py
+#define EXECUTOR_CONCURRENCY 64
+#define EXECUTOR_MAX_CONCURRENCY 1024
+
+enum { JOB_GET, JOB_PUT, JOB_STAT };
+
+typedef struct tfs_job_s tfs_job_t;
+
+struct tfs_job_s {
+	tfs_job_t *next;
+	long id;
+	int op;
+	int ret;
+	char *name;                     /* get/stat的文件名, strdup */
+	Py_buffer view;                 /* put的数据 */
+	PyObject *result;               /* get读入的字符串 */
+	TfsFileStat stat;
+	char ret_tfs_name[TFS_FILE_LEN];
+};
+
+typedef struct {
+	PyObject_HEAD
+	TfsClientObject *client;
+	TfsClient *tfs_handle;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	tfs_job_t *pending;             /* 待执行, 按提交顺序 */
+	tfs_job_t **pending_tail;
+	tfs_job_t *done;                /* 已完成, 顺序不定 */
+	pthread_t *threads;
+	int nthreads;
+	int efd;
+	int stopping;
+	long next_id;
+	pid_t pid;                      /* 创建线程的进程, fork后子进程中不可用 */
+} TfsExecutorObject;
+
+static void _job_run(TfsExecutorObject *e, tfs_job_t *job)
+{
+	PyGILState_STATE gstate;
+	TfsFileStat fstat;
+	int fd = 0;
+
+	switch (job->op) {
+	case JOB_GET:
+		fd = _open_stat(e->tfs_handle, CLIENT_NS(e->client), job->name, &fstat);
+		if (fd <= 0)
+			break;
+
+		gstate = PyGILState_Ensure();
+		job->result = PyString_FromStringAndSize(NULL, fstat.size_);
+		if (NULL == job->result)
+			PyErr_Clear();
+		PyGILState_Release(gstate);
+
+		if (NULL != job->result)
+			job->ret = _read_into(e->tfs_handle, fd, PyString_AS_STRING(job->result), fstat.size_, fstat.crc_);
+		if (e->tfs_handle->close(fd) < 0)
+			job->ret = -1;
+		if (0 != job->ret && NULL != job->result) {
+			gstate = PyGILState_Ensure();
+			Py_CLEAR(job->result);
+			PyGILState_Release(gstate);
+		}
+		break;
+
+	case JOB_PUT:
+		job->ret = _put_buffer(e->tfs_handle, CLIENT_NS(e->client), (const char*)job->view.buf, job->view.len, job->ret_tfs_name);
+		break;
+
+	case JOB_STAT:
+		job->ret = e->tfs_handle->stat_file(&job->stat, job->name, NULL, NORMAL_STAT, CLIENT_NS(e->client));
+		break;
+	}
+}
+
+static void *_executor_worker(void *arg)
+{
+	TfsExecutorObject *e = (TfsExecutorObject*)arg;
+	tfs_job_t *job = NULL;
+	uint64_t one = 1;
+
+	for ( ;; ) {
+		pthread_mutex_lock(&e->mutex);
+		while (NULL == e->pending && !e->stopping)
+			pthread_cond_wait(&e->cond, &e->mutex);
+		if (e->stopping) {
+			pthread_mutex_unlock(&e->mutex);
+			break;
+		}
+		job = e->pending;
+		e->pending = job->next;
+		if (NULL == e->pending)
+			e->pending_tail = &e->pending;
+		pthread_mutex_unlock(&e->mutex);
+
+		job->ret = -1;
+		_job_run(e, job);
+
+		pthread_mutex_lock(&e->mutex);
+		job->next = e->done;
+		e->done = job;
+		pthread_mutex_unlock(&e->mutex);
+
+		if (write(e->efd, &one, sizeof(one)) < 0)
+			TBSYS_LOG(ERROR, "write eventfd failed, errno = %d", errno);
+	}
+	return NULL;
+}
+
+// 须持有GIL
+static void _job_free(tfs_job_t *job)
+{
+	if (JOB_PUT == job->op)
+		PyBuffer_Release(&job->view);
+	Py_XDECREF(job->result);
+	free(job->name);
+	PyMem_Free(job);
+}
+
+static PyObject *
+_job_result(tfs_job_t *job)
+{
+	if (0 != job->ret) {
+		if (JOB_PUT == job->op) {
+			Py_INCREF(Py_False);
+			return Py_False;
+		}
+		return Py_BuildValue("");
+	}
+
+	switch (job->op) {
+	case JOB_GET:
+		Py_INCREF(job->result);
+		return job->result;
+	case JOB_PUT:
+		return Py_BuildValue("s", job->ret_tfs_name);
+	default:
+		return Py_BuildValue("{s:L,s:I,s:i,s:i,s:i}",
+				"size", (PY_LONG_LONG)job->stat.size_,
+				"crc", (unsigned int)job->stat.crc_,
+				"create_time", job->stat.create_time_,
+				"modify_time", job->stat.modify_time_,
+				"flag", job->stat.flag_);
+	}
+}
+
+// 停止线程, 未执行的任务丢弃. 当前正在执行的任务做完后线程才退出
+static void _executor_close(TfsExecutorObject *e)
+{
+	tfs_job_t *job = NULL;
+	int i;
+
+	if (e->efd < 0) {
+		PyMem_Free(e->threads);
+		e->threads = NULL;
+		return;
+	}
+
+	// fork出的子进程中没有这些线程, mutex也可能停在加锁状态, 只释放内存
+	if (e->pid != getpid()) {
+		pthread_mutex_init(&e->mutex, NULL);
+		e->nthreads = 0;
+	}
+
+	pthread_mutex_lock(&e->mutex);
+	e->stopping = 1;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->mutex);
+
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < e->nthreads; i++)
+		pthread_join(e->threads[i], NULL);
+	Py_END_ALLOW_THREADS
+
+	while (NULL != e->pending) {
+		job = e->pending;
+		e->pending = job->next;
+		_job_free(job);
+	}
+	while (NULL != e->done) {
+		job = e->done;
+		e->done = job->next;
+		_job_free(job);
+	}
+	e->pending_tail = &e->pending;
+
+	close(e->efd);
+	e->efd = -1;
+	PyMem_Free(e->threads);
+	e->threads = NULL;
+	e->nthreads = 0;
+}
+
+static PyObject *
+_executor_submit(TfsExecutorObject *e, int op, PyObject *args, const char *format)
+{
+	tfs_job_t *job = NULL;
+	const char *name = NULL;
+	PyObject *obj = NULL;
+	long id;
+
+	if (e->efd < 0) {
+		PyErr_SetString(PyExc_ValueError, "executor is closed");
+		return NULL;
+	}
+	if (e->pid != getpid()) {
+		PyErr_SetString(PyExc_ValueError, "executor was created before fork, create a new one in this process");
+		return NULL;
+	}
+
+	if (JOB_PUT == op ? !PyArg_ParseTuple(args, format, &obj) : !PyArg_ParseTuple(args, format, &name))
+		return NULL;
+
+	job = (tfs_job_t*) PyMem_Malloc(sizeof(tfs_job_t));
+	if (NULL == job)
+		return PyErr_NoMemory();
+	memset(job, 0, sizeof(tfs_job_t));
+	job->op = op;
+
+	if (JOB_PUT == op) {
+		if (0 != _get_buffer(obj, &job->view, 0)) {
+			PyMem_Free(job);
+			return NULL;
+		}
+	} else if (NULL == (job->name = strdup(name))) {
+		PyMem_Free(job);
+		return PyErr_NoMemory();
+	}
+
+	pthread_mutex_lock(&e->mutex);
+	id = job->id = e->next_id++;
+	*e->pending_tail = job;
+	e->pending_tail = &job->next;
+	pthread_cond_signal(&e->cond);
+	pthread_mutex_unlock(&e->mutex);
+
+	return PyInt_FromLong(id);
+}
+
+static PyObject *
+tfsexecutor_get(TfsExecutorObject *e, PyObject *args)
+{
+	return _executor_submit(e, JOB_GET, args, "s:get");
+}
+
+static PyObject *
+tfsexecutor_put(TfsExecutorObject *e, PyObject *args)
+{
+	return _executor_submit(e, JOB_PUT, args, "O:put");
+}
+
+static PyObject *
+tfsexecutor_stat(TfsExecutorObject *e, PyObject *args)
+{
+	return _executor_submit(e, JOB_STAT, args, "s:stat");
+}
+
+static PyObject *
+tfsexecutor_fileno(TfsExecutorObject *e)
+{
+	return PyInt_FromLong(e->efd);
+}
+
+static PyObject *
+tfsexecutor_completed(TfsExecutorObject *e)
+{
+	tfs_job_t *job = NULL;
+	tfs_job_t *done = NULL;
+	PyObject *list = NULL;
+	PyObject *item = NULL;
+	uint64_t count = 0;
+
+	if (e->efd < 0)
+		return PyList_New(0);
+
+	// eventfd是非阻塞的, 没有完成的任务时返回EAGAIN
+	if (read(e->efd, &count, sizeof(count)) < 0 && EAGAIN != errno)
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	pthread_mutex_lock(&e->mutex);
+	done = e->done;
+	e->done = NULL;
+	pthread_mutex_unlock(&e->mutex);
+
+	list = PyList_New(0);
+	while (NULL != done) {
+		job = done;
+		done = job->next;
+		if (NULL != list) {
+			item = _job_result(job);
+			item = NULL == item ? NULL : Py_BuildValue("(lN)", job->id, item);
+			if (NULL == item || 0 != PyList_Append(list, item))
+				Py_CLEAR(list);
+			Py_XDECREF(item);
+		}
+		_job_free(job);
+	}
+	return list;
+}
+
+static PyObject *
+tfsexecutor_close(TfsExecutorObject *e)
+{
+	_executor_close(e);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static void
+tfsexecutor_dealloc(TfsExecutorObject *e)
+{
+	_executor_close(e);
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->mutex);
+	Py_XDECREF(e->client);
+	PyObject_Del(e);
+}
+
+static PyMethodDef tfsexecutor_methods[] = {
+    {"get", (PyCFunction)tfsexecutor_get, METH_VARARGS, "get(tfsname) -> job id, 结果为str或None"},
+    {"put", (PyCFunction)tfsexecutor_put, METH_VARARGS, "put(data) -> job id, 结果为tfsname或False"},
+    {"stat", (PyCFunction)tfsexecutor_stat, METH_VARARGS, "stat(tfsname) -> job id, 结果为dict或None"},
+    {"fileno", (PyCFunction)tfsexecutor_fileno, METH_NOARGS, "fileno() -> 有任务完成时可读的eventfd"},
+    {"completed", (PyCFunction)tfsexecutor_completed, METH_NOARGS, "completed() -> [(job id, result), ...]"},
+    {"close", (PyCFunction)tfsexecutor_close, METH_NOARGS, "close(), 停止线程, 丢弃未执行的任务"},
+    {NULL, NULL, 0, NULL}
+};
+
+static const char tfsexecutor_doc [] =
+"TfsExecutor, 由TfsClient.executor(concurrency)返回.\n"
+"get/put/stat提交任务后立即返回job id, 任务在concurrency个线程中执行,\n"
+"完成时fileno()可读, 调用completed()取得结果. asyncio中用pytfs_async.AsyncTfsClient\n";
+
+static PyTypeObject TfsExecutor_Type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "pytfs.TfsExecutor",        /* tp_name */
+    sizeof(TfsExecutorObject),  /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)tfsexecutor_dealloc,    /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    PyObject_GenericGetAttr,    /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    tfsexecutor_doc,            /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    tfsexecutor_methods,        /* tp_methods */
+};
+
+static char tfsclient_executor_doc [] =
+    "executor(concurrency = 64) -> TfsExecutor, 最多同时执行concurrency个tfs操作";
+static PyObject *
+tfsclient_executor(TfsClientObject *self, PyObject *args)
+{
+	TfsExecutorObject *e = NULL;
+	int concurrency = EXECUTOR_CONCURRENCY;
+	int i;
+
+	if (0 != _client_init(self))
+		return NULL;
+
+	if (!PyArg_ParseTuple(args, "|i:executor", &concurrency))
+		return NULL;
+	if (concurrency < 1 || concurrency > EXECUTOR_MAX_CONCURRENCY)
+		return PyErr_Format(PyExc_ValueError, "concurrency must be in [1, %d]", EXECUTOR_MAX_CONCURRENCY);
+
+	e = PyObject_New(TfsExecutorObject, &TfsExecutor_Type);
+	if (NULL == e)
+		return NULL;
+
+	Py_INCREF(self);
+	e->client = self;
+	e->tfs_handle = self->tfs_handle;
+	pthread_mutex_init(&e->mutex, NULL);
+	pthread_cond_init(&e->cond, NULL);
+	e->pending = NULL;
+	e->pending_tail = &e->pending;
+	e->done = NULL;
+	e->stopping = 0;
+	e->next_id = 1;
+	e->pid = getpid();
+	e->nthreads = 0;
+	e->threads = PyMem_New(pthread_t, concurrency);
+	e->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (NULL == e->threads || e->efd < 0) {
+		if (e->efd < 0)
+			PyErr_SetFromErrno(PyExc_OSError);
+		else
+			PyErr_NoMemory();
+		Py_DECREF(e);
+		return NULL;
+	}
+
+	for (i = 0; i < concurrency; i++) {
+		if (0 != pthread_create(&e->threads[i], NULL, _executor_worker, e))
+			break;
+		e->nthreads++;
+	}
+	if (0 == e->nthreads) {
+		Py_DECREF(e);
+		return PyErr_Format(PyExc_OSError, "pthread_create failed");
+	}
+	if (e->nthreads < concurrency)
+		TBSYS_LOG(WARN, "executor started %d of %d threads", e->nthreads, concurrency);
+	return (PyObject*)e;
+}
+
 static PyMethodDef pytfsobject_methods[] = {
     {"init", (PyCFunction)tfsclient_initialize, METH_VARARGS, tfsclient_initialize_doc},
     {"open", (PyCFunction)tfsclient_open, METH_VARARGS, tfsclient_open_doc},
@@ -591,7 +2782,15 @@ static PyMethodDef pytfsobject_methods[] = {
     {"read", (PyCFunction)tfsclient_read, METH_VARARGS, tfsclient_read_doc},
     {"put", (PyCFunction)tfsclient_put, METH_VARARGS, tfsclient_put_doc},
     {"get", (PyCFunction)tfsclient_get, METH_VARARGS, tfsclient_get_doc},
+    {"readinto", (PyCFunction)tfsclient_readinto, METH_VARARGS, tfsclient_readinto_doc},
+    {"open_file", (PyCFunction)tfsclient_open_file, METH_VARARGS, tfsclient_open_file_doc},
+    {"put_file", (PyCFunction)tfsclient_put_file, METH_VARARGS, tfsclient_put_file_doc},
+    {"get_file", (PyCFunction)tfsclient_get_file, METH_VARARGS, tfsclient_get_file_doc},
     {"unlink", (PyCFunction)tfsclient_unlink, METH_VARARGS, tfsclient_unlink_doc},
+    {"unlink_many", (PyCFunction)tfsclient_unlink_many, METH_VARARGS, tfsclient_unlink_many_doc},
+    {"get_many", (PyCFunction)tfsclient_get_many, METH_VARARGS, tfsclient_get_many_doc},
+    {"put_many", (PyCFunction)tfsclient_put_many, METH_VARARGS, tfsclient_put_many_doc},
+    {"executor", (PyCFunction)tfsclient_executor, METH_VARARGS, tfsclient_executor_doc},
     {NULL, NULL, 0, NULL}
 };
 
@@ -601,6 +2800,12 @@ static PyMethodDef pytfsMethods[] =
    {"TfsClient", (PyCFunction)tfsclient_new, METH_NOARGS, tfsclient_new_doc},
    {"version", (PyCFunction)do_pytfs_version, METH_VARARGS, pytfs_version_doc},
    {"setloglevel", (PyCFunction)do_pytfs_setloglevel, METH_VARARGS, pytfs_setloglevel_doc},
+   {"set_chunk_size", (PyCFunction)do_pytfs_set_chunk_size, METH_VARARGS, pytfs_set_chunk_size_doc},
+   {"buffer_stats", (PyCFunction)do_pytfs_buffer_stats, METH_NOARGS, pytfs_buffer_stats_doc},
+   {"set_buffer_arena", (PyCFunction)do_pytfs_set_buffer_arena, METH_VARARGS, pytfs_set_buffer_arena_doc},
+   {"set_cache", (PyCFunction)do_pytfs_set_cache, METH_VARARGS, pytfs_set_cache_doc},
+   {"cache_stats", (PyCFunction)do_pytfs_cache_stats, METH_NOARGS, pytfs_cache_stats_doc},
+   {"cache_clear", (PyCFunction)do_pytfs_cache_clear, METH_NOARGS, pytfs_cache_clear_doc},
    {NULL, NULL}
 };
 static int
@@ -674,10 +2879,18 @@ extern "C"
     {	// default log level is ERROR
 
     	TBSYS_LOGGER.setLogLevel("ERROR");
+    	// get_many的线程在分配结果时要拿GIL
+    	PyEval_InitThreads();
+    	pthread_atfork(NULL, NULL, _client_atfork_child);
+    	Py_AtExit(_client_destroy);
+    	if (NULL != getenv("PYTFS_CHUNK_SIZE"))
+    		WROTE_PRE_ONE = _chunk_size(atoll(getenv("PYTFS_CHUNK_SIZE")));
 
     	Pytfs_Type.ob_type = &PyType_Type;
     	p_TfsClient_Type = &Pytfs_Type;
     	Pytfs_Type.tp_methods = pytfsobject_methods;
+    	if (PyType_Ready(&TfsFile_Type) < 0 || PyType_Ready(&TfsExecutor_Type) < 0)
+    		return;
 
     	PyObject *module, *mods_dict;
 
@@ -690,6 +2903,10 @@ extern "C"
 	    ErrorObject = PyErr_NewException("pytfs.TfsError", NULL, NULL);
 	    assert(ErrorObject != NULL);
 	    PyDict_SetItemString(mods_dict, "TfsError", ErrorObject);
+	    Py_INCREF(&TfsFile_Type);
+	    PyDict_SetItemString(mods_dict, "TfsFile", (PyObject*)&TfsFile_Type);
+	    Py_INCREF(&TfsExecutor_Type);
+	    PyDict_SetItemString(mods_dict, "TfsExecutor", (PyObject*)&TfsExecutor_Type);
 
 	    //for tfs_open
 	    PyDict_SetItemString(mods_dict, "READ", PyInt_FromLong(T_READ));
@@ -0,0 +1,58 @@
+#coding:utf8
+'''
+asyncio接口: tfs操作在pytfs.TfsExecutor的线程中执行, 完成后通过eventfd唤醒事件循环.
+
+    client = pytfs.TfsClient()
+    client.init('127.0.0.1:8108')
+    atfs = pytfs_async.AsyncTfsClient(client, concurrency = 256)
+    data = yield From(atfs.aget('T1xxxxxxx'))       # trollius
+    data = yield from atfs.aget('T1xxxxxxx')        # asyncio
+
+aget/aput/astat返回Future, 结果与TfsClient.get/put及TfsExecutor.stat相同.
+同时在执行的操作最多concurrency个, 其余在TfsExecutor中排队.
+'''
+try:
+    import asyncio
+except ImportError:
+    import trollius as asyncio
+
+
+class AsyncTfsClient(object):
+
+    def __init__(self, client, concurrency=64, loop=None):
+        self._loop = loop or asyncio.get_event_loop()
+        self._executor = client.executor(concurrency)
+        self._futures = {}
+        self._loop.add_reader(self._executor.fileno(), self._complete)
+
+    def _submit(self, submit, arg):
+        future = asyncio.Future(loop=self._loop)
+        self._futures[submit(arg)] = future
+        return future
+
+    def aget(self, tfsname):
+        return self._submit(self._executor.get, tfsname)
+
+    def aput(self, data):
+        return self._submit(self._executor.put, data)
+
+    def astat(self, tfsname):
+        return self._submit(self._executor.stat, tfsname)
+
+    def _complete(self):
+        for job, result in self._executor.completed():
+            future = self._futures.pop(job, None)
+            # 已取消的Future丢弃结果, tfs操作本身无法中途取消
+            if future is not None and not future.done():
+                future.set_result(result)
+
+    def close(self):
+        '''停止线程, 未完成的Future被取消'''
+        if self._executor is None:
+            return
+        self._loop.remove_reader(self._executor.fileno())
+        self._executor.close()
+        self._executor = None
+        for future in self._futures.values():
+            future.cancel()
+        self._futures.clear()
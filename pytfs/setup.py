@@ -48,6 +48,10 @@ sources = [
     "pytfs.cpp",
 ]
 
+# 压测用, 链接bench/ngx_http_tfs_mock.cpp代替真实的tfs读写, 见bench/pytfs_bench.py
+if os.environ.get('PYTFS_MOCK') == 'YES':
+    sources.append("../bench/ngx_http_tfs_mock.cpp")
+
 module1 = Extension(name = PACKAGE,
                     define_macros = [],
                     include_dirs = include_dirs,
@@ -59,7 +63,7 @@ try:
       version = VERSION,
       description = 'tfs client libs for Python',
       ext_modules = [module1],
-#      py_modules = ['pytfs.cpp'],
+      py_modules = ['pytfs_async'],
 )
 except:
  _help()
@@ -1,4 +1,10 @@
 #utf-8
+import threading
+import shutil
+import StringIO
+import os
+import tempfile
+import select
 import pytfs
 
 print "testing ",pytfs.version()
@@ -27,6 +33,203 @@ def main(svr):
     d =  t.read(fd, 4 * 1024 * 1024)
     assert d == data, d
     print "case 3 read file %s success" % tfsname
+
+    assert t.unlink(tfsname) == len(data), 'unlink fail'
+    assert t.get(tfsname) is None, 'get deleted file'
+    print "case 4 unlink file %s success" % tfsname
+
+    names = [t.put(data[:1024]) for i in range(3)]
+    assert all(names), 'put fail'
+    assert t.unlink_many(names) == [(0, 1024)] * 3, 'unlink_many fail'
+    print "case 5 unlink_many %d files success" % len(names)
+
+    tfsname = t.put(data[:100 * 1024])
+    assert tfsname, 'put fail'
+    before = pytfs.buffer_stats()
+    for i in range(3):
+        fd = t.open(tfsname, "", pytfs.READ)
+        assert t.read(fd, 100 * 1024) == data[:100 * 1024], 'read data not match'
+        t.close(fd)
+    after = pytfs.buffer_stats()
+    assert after['reused'] - before['reused'] >= 2, after
+    assert after['bytes'] <= after['high_water'], after
+    t.unlink(tfsname)
+    print "case 6 read buffers reused", after
+
+    tfsname = t.put(data)
+    assert tfsname, 'put fail'
+    results = []
+    def worker():
+        results.append(t.get(tfsname) == data)
+    threads = [threading.Thread(target=worker) for i in range(4)]
+    for th in threads:
+        th.start()
+    for th in threads:
+        th.join()
+    assert results == [True] * 4, results
+    t.unlink(tfsname)
+    print "case 7 get from %d threads success" % len(threads)
+
+    tfsname = t.put(data)
+    assert tfsname, 'put fail'
+    buf = bytearray(len(data) + 10)
+    assert t.readinto(tfsname, buf) == len(data), 'readinto fail'
+    assert buf[:len(data)] == data, 'readinto data not match'
+    try:
+        t.readinto(tfsname, bytearray(10))
+        assert False, 'readinto small buffer'
+    except ValueError:
+        pass
+    t.unlink(tfsname)
+    print "case 8 readinto bytearray success"
+
+    ba = bytearray(data)
+    tfsname = t.put(ba)
+    assert tfsname, 'put bytearray fail'
+    assert t.get(tfsname) == data, 'get data not match'
+    t.unlink(tfsname)
+    tfsname = t.put(memoryview(ba)[1024:])
+    assert tfsname, 'put memoryview fail'
+    assert t.get(tfsname) == data[1024:], 'get data not match'
+    t.unlink(tfsname)
+    fd = t.open("", "", pytfs.WRITE)
+    assert t.write(fd, ba), 'write bytearray fail'
+    tfsname = t.close(fd)
+    assert t.get(tfsname) == data, 'get data not match'
+    t.unlink(tfsname)
+    print "case 9 put/write from buffer objects success"
+
+    datas = [data[i * 1024:(i + 1) * 1024 * 64] for i in range(20)]
+    names = t.put_many(datas + [None, 123], 8)
+    assert all(names[:20]), 'put_many fail'
+    assert names[20:] == [None, False], names[20:]
+    results = t.get_many(names[:20] + ['T1nonexistent00000'], 8)
+    assert results[:20] == datas, 'get_many data not match'
+    assert results[20] is None, 'get_many nonexistent file'
+    t.unlink_many(names[:20])
+    print "case 10 put_many/get_many %d files success" % len(datas)
+
+    tfsname = t.put(data)
+    assert tfsname, 'put fail'
+    with t.open_file(tfsname, 64 * 1024) as f:
+        assert f.size == len(data), f.size
+        assert f.read(10) == data[:10], 'read data not match'
+        f.seek(-10, 2)
+        assert f.tell() == len(data) - 10
+        assert f.read() == data[-10:], 'read tail not match'
+        assert f.read(10) == '', 'read after eof'
+        f.seek(0)
+        out = StringIO.StringIO()
+        shutil.copyfileobj(f, out, 100 * 1024)
+        assert out.getvalue() == data, 'copyfileobj data not match'
+        f.seek(1000)
+        assert ''.join(f) == data[1000:], 'iterate data not match'
+    assert f.closed
+    fd = t.open(tfsname, "", pytfs.READ)
+    assert t.read(fd, 1024) == data[:1024], 'read count not honored'
+    t.close(fd)
+    t.unlink(tfsname)
+    print "case 11 stream file %s success" % tfsname
+
+    src = tempfile.mktemp()
+    dst = tempfile.mktemp()
+    open(src, 'wb').write(data + 'x' * 123)
+    tfsname, size, rate = t.put_file(src)
+    assert size == len(data) + 123, size
+    assert t.get(tfsname) == data + 'x' * 123, 'put_file data not match'
+    for direct in (False, True):
+        size, rate = t.get_file(tfsname, dst, direct)
+        assert open(dst, 'rb').read() == data + 'x' * 123, 'get_file data not match'
+    os.unlink(dst)
+    assert t.get_file('T1nonexistent00000', dst) is False
+    assert not os.path.exists(dst), 'partial file left'
+    t.unlink(tfsname)
+    os.unlink(src)
+    print "case 12 put_file/get_file %s success, %d bytes/s" % (tfsname, rate)
+
+    e = t.executor(16)
+    jobs = {}
+    for i, d in enumerate(datas):
+        jobs[e.put(d)] = i
+    names = [None] * len(datas)
+    while jobs:
+        select.select([e.fileno()], [], [], 5)
+        for job, result in e.completed():
+            names[jobs.pop(job)] = result
+    assert all(names), 'executor put fail'
+    jobs = dict((e.get(n), i) for i, n in enumerate(names))
+    jobs[e.stat(names[0])] = 'stat'
+    while jobs:
+        select.select([e.fileno()], [], [], 5)
+        for job, result in e.completed():
+            i = jobs.pop(job)
+            if i == 'stat':
+                assert result['size'] == len(datas[0]), result
+            else:
+                assert result == datas[i], 'executor get data not match'
+    e.close()
+    print "case 13 executor %d files success" % len(names)
+
+    try:
+        import pytfs_async
+    except ImportError:
+        pytfs_async = None
+    if pytfs_async:
+        loop = pytfs_async.asyncio.get_event_loop()
+        atfs = pytfs_async.AsyncTfsClient(t, 16, loop)
+        futures = [atfs.aget(n) for n in names] + [atfs.astat('T1nonexistent00000')]
+        results = loop.run_until_complete(pytfs_async.asyncio.gather(*futures))
+        assert results == datas + [None], 'aget data not match'
+        atfs.close()
+        print "case 14 asyncio aget %d files success" % len(names)
+    t.unlink_many(names)
+
+    shm = tempfile.mktemp()
+    pytfs.set_cache(1024 * 1024, shm, 4 * 1024 * 1024)
+    tfsname = t.put(data[:64 * 1024])
+    assert t.get(tfsname) == data[:64 * 1024]
+    assert t.get(tfsname) is t.get(tfsname), 'lru cache miss'
+    pytfs.cache_clear()
+    assert t.get(tfsname) == data[:64 * 1024]
+    stats = pytfs.cache_stats()
+    assert stats['hits'] >= 2 and stats['shm_hits'] == 1 and stats['misses'] == 1, stats
+    pid = os.fork()
+    if pid == 0:
+        # the child gets it from the shared cache
+        pytfs.cache_clear()
+        t.get(tfsname)
+        os._exit(0 if pytfs.cache_stats()['shm_hits'] == 2 else 1)
+    assert os.waitpid(pid, 0)[1] == 0, 'shm cache not shared'
+    t.unlink(tfsname)
+    assert t.get(tfsname) is None, 'cache not invalidated by unlink'
+    pytfs.set_cache(0)
+    os.unlink(shm)
+    print "case 15 cache", pytfs.cache_stats()
+
+    t2 = pytfs.TfsClient()
+    assert t2.init(svr), 'second init failed'
+    tfsname = t2.put(data[:1024])
+    del t2
+    # deleting one client must not tear down the others
+    assert t.get(tfsname) == data[:1024], 'client destroyed with another object'
+    pid = os.fork()
+    if pid == 0:
+        try:
+            t.get(tfsname)
+        except pytfs.TfsError:
+            os._exit(0)
+        os._exit(1)
+    assert os.waitpid(pid, 0)[1] == 0, 'use after fork not detected'
+    t.unlink(tfsname)
+    print "case 16 independent clients success"
+
+    old = pytfs.set_chunk_size(5000)
+    assert pytfs.set_chunk_size(4096) == 8192, 'chunk size not aligned'
+    tfsname = t.put(data[:100000])
+    assert t.get(tfsname) == data[:100000], 'small chunk get not match'
+    t.unlink(tfsname)
+    pytfs.set_chunk_size(old)
+    print "case 17 chunk size success"
     
 if __name__ == '__main__':
     main("127.0.0.1:8108")